@@ -0,0 +1,150 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements the spare VMs autoscaler: the spare VMs have to
+ * serve the clients arriving while their replacements boot. The arrival
+ * rate is forecast from the recent rate and from the same time of the
+ * previous days, so the spares are started before a known peak.
+ */
+
+#include "common.h"
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "autoscale.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+
+// The bucket of the local time of day "ahead_ms" later
+static int autoscale_bucket ( uint64_t ahead_ms )
+{
+	time_t t = time ( NULL ) + ahead_ms / 1000;
+	struct tm tm;
+	localtime_r ( &t, &tm );
+	return ( tm.tm_hour * 60 + tm.tm_min ) / KVMPOOL_AUTOSCALE_BUCKET;
+}
+
+void autoscale_init ( autoscale_t *as, uint64_t boot_min_ms )
+{
+	memset ( as, 0, sizeof ( *as ) );
+	as->boot_min_ms = boot_min_ms;
+	as->tick_at = as->bucket_at = kvmpool_now_ms();
+	as->bucket  = autoscale_bucket ( 0 );
+	return;
+}
+
+static inline double autoscale_ewma ( double avg, double sample )
+{
+	return avg == 0 ? sample : avg + KVMPOOL_AUTOSCALE_ALPHA * ( sample - avg );
+}
+
+void autoscale_booted ( autoscale_t *as, uint64_t boot_ms )
+{
+	as->boot_ms = autoscale_ewma ( as->boot_ms, boot_ms );
+	return;
+}
+
+void autoscale_session ( autoscale_t *as, uint64_t session_ms )
+{
+	as->session_ms = autoscale_ewma ( as->session_ms, session_ms );
+	return;
+}
+
+void autoscale_tick ( autoscale_t *as )
+{
+	uint64_t now = kvmpool_now_ms();
+	int bucket = autoscale_bucket ( 0 );
+	int arrivals;
+	double dt;
+
+	if ( now == as->tick_at )
+		return;
+
+	arrivals = __sync_fetch_and_and ( &as->arrivals, 0 );
+	dt = ( now - as->tick_at ) / 1000.0;
+	// The ticks are not periodic, so the weight depends on the time passed
+	as->rate += dt / ( dt + KVMPOOL_AUTOSCALE_TAU / 1000.0 ) * ( arrivals / dt - as->rate );
+	as->tick_at = now;
+	as->bucket_arrivals += arrivals;
+
+	if ( bucket != as->bucket ) {
+		int b = as->bucket;
+		double rate = as->bucket_arrivals / ( ( now - as->bucket_at ) / 1000.0 );
+		as->hist[b] = as->hist_seen[b] ? as->hist[b] + KVMPOOL_AUTOSCALE_DAY_ALPHA * ( rate - as->hist[b] ) : rate;
+		as->hist_seen[b]++;
+		debug ( 3, "bucket %i: %.3f arrivals/s (%.3f on average over %i days)", b, rate, as->hist[b], as->hist_seen[b] );
+		as->bucket          = bucket;
+		as->bucket_arrivals = 0;
+		as->bucket_at       = now;
+	}
+
+	return;
+}
+
+/*
+ * The clients arriving while a spare VM boots: lambda = rate * boot time,
+ * plus 2*sqrt(lambda) for the bursts (arrivals are close to Poisson). The
+ * rate is the max of the recent one and of the histogram buckets of now and
+ * of KVMPOOL_AUTOSCALE_LOOKAHEAD later. The VMs coming back as spares
+ * meanwhile ("--recycle") are subtracted: the ones being reverted, and
+ * the attached ones whose clients leave, each at the rate 1 / session
+ * length (mu = attached * boot time / session length, minus 2*sqrt(mu),
+ * so fewer returns than expected are covered, too). The boot time is the
+ * measured one (up to the guest being up, see proxy_boot_start()), but
+ * not less than "--boot-delay" (it's the only estimate before the first
+ * boot).
+ */
+int autoscale_target ( autoscale_t *as, int attached, int recycling, int min, int max )
+{
+	double boot_ms = as->boot_ms > as->boot_min_ms ? as->boot_ms : as->boot_min_ms;
+	int now_b   = autoscale_bucket ( 0 );
+	int ahead_b = autoscale_bucket ( boot_ms + KVMPOOL_AUTOSCALE_LOOKAHEAD );
+	double rate = as->rate, lambda, mu = 0, returns = recycling;
+	int target;
+
+	if ( as->hist_seen[now_b] && as->hist[now_b] > rate )
+		rate = as->hist[now_b];
+
+	if ( as->hist_seen[ahead_b] && as->hist[ahead_b] > rate )
+		rate = as->hist[ahead_b];
+
+	lambda = rate * boot_ms / 1000;
+
+	if ( as->session_ms > 0 )
+		mu = attached * boot_ms / as->session_ms;
+
+	if ( mu > 2 * sqrt ( mu ) )
+		returns += mu - 2 * sqrt ( mu );
+
+	target = ceil ( lambda + 2 * sqrt ( lambda ) - returns );
+
+	if ( target < min )
+		target = min;
+
+	if ( target > max )
+		target = max;
+
+	debug ( 5, "rate == %.3f/s (%.3f/s recent); boot == %.0f ms; session == %.0f ms; returns == %.1f: target == %i", rate, as->rate, boot_ms, as->session_ms, returns, target );
+	return target;
+}
@@ -0,0 +1,63 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVMPOOL_AUTOSCALE_H
+#define __KVMPOOL_AUTOSCALE_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+#define AUTOSCALE_BUCKETS (24 * 60 / KVMPOOL_AUTOSCALE_BUCKET)
+
+/*
+ * The arrival statistics used to size the spare VMs: the recent arrival
+ * rate (EWMA), the arrival rate by the time of day (a histogram, every
+ * bucket is an EWMA over days), the boot time and the session length.
+ * Requires the global lock, except autoscale_arrivals().
+ */
+struct autoscale {
+	volatile int	 arrivals;	// Since the last autoscale_tick()
+	uint64_t	 tick_at;	// CLOCK_MONOTONIC, ms
+	double		 rate;		// Arrivals per second
+	double		 hist[AUTOSCALE_BUCKETS];	// Arrivals per second
+	int		 hist_seen[AUTOSCALE_BUCKETS];	// Days the bucket is measured
+	int		 bucket;	// The current bucket
+	int		 bucket_arrivals;
+	uint64_t	 bucket_at;	// CLOCK_MONOTONIC, ms; when the current bucket is started
+	double		 boot_ms;	// EWMA, 0 if unknown
+	double		 boot_min_ms;	// The lower bound of boot_ms ("--boot-delay")
+	double		 session_ms;	// EWMA, 0 if unknown
+};
+typedef struct autoscale autoscale_t;
+
+static inline void autoscale_arrivals ( autoscale_t *as, int n )
+{
+	__sync_fetch_and_add ( &as->arrivals, n );
+	return;
+}
+
+extern void autoscale_init ( autoscale_t *as, uint64_t boot_min_ms );
+extern void autoscale_booted ( autoscale_t *as, uint64_t boot_ms );
+extern void autoscale_session ( autoscale_t *as, uint64_t session_ms );
+extern void autoscale_tick ( autoscale_t *as );
+extern int autoscale_target ( autoscale_t *as, int attached, int recycling, int min, int max );
+
+#endif
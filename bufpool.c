@@ -0,0 +1,177 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements a pool of I/O buffers of a few size classes.
+ * Buffers are carved from slabs of KVMPOOL_BUFPOOL_SLAB bytes (optionally
+ * hugepages). Free buffers are kept in LIFO stacks, so the hot ones are
+ * reused, while the cold ones are returned to the kernel by
+ * bufpool_trim() with MADV_DONTNEED.
+ */
+
+#include "common.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+
+#include "error.h"
+#include "malloc.h"
+
+int bufpool_init ( bufpool_t *pool, int hugepages )
+{
+	memset ( pool, 0, sizeof ( *pool ) );
+	pool->hugepages = hugepages;
+	return 0;
+}
+
+static inline void bufpool_push ( struct bufpool_class *class_p, char *buf )
+{
+	if ( class_p->free_count >= class_p->free_size ) {
+		class_p->free_size += ALLOC_PORTION;
+		class_p->free = xrealloc ( class_p->free, class_p->free_size * sizeof ( *class_p->free ) );
+	}
+
+	class_p->free[class_p->free_count++] = buf;
+	return;
+}
+
+static int bufpool_grow ( bufpool_t *pool, int class )
+{
+	struct bufpool_class *class_p = &pool->class[class];
+	size_t size = bufpool_class_size ( class );
+	char *slab = MAP_FAILED;
+	size_t off = 0;
+
+	if ( pool->hugepages ) {
+		slab = mmap ( NULL, KVMPOOL_BUFPOOL_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+
+		if ( slab == MAP_FAILED ) {
+			warning ( "Cannot allocate hugepages for I/O buffers, using regular pages" );
+			pool->hugepages = 0;
+		}
+	}
+
+	if ( slab == MAP_FAILED )
+		slab = mmap ( NULL, KVMPOOL_BUFPOOL_SLAB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+	if ( slab == MAP_FAILED ) {
+		error ( "Cannot allocate a slab for I/O buffers" );
+		return errno;
+	}
+
+	debug ( 5, "class %i: new slab %p", class, slab );
+	pool->slabs = xrealloc ( pool->slabs, ( pool->slabs_count + 1 ) * sizeof ( *pool->slabs ) );
+	pool->slabs[pool->slabs_count++] = slab;
+
+	// Fresh pages are not resident, so these buffers are "clean"
+	if ( class_p->clean == class_p->free_count )
+		class_p->clean += KVMPOOL_BUFPOOL_SLAB / size;
+
+	while ( off < KVMPOOL_BUFPOOL_SLAB ) {
+		bufpool_push ( class_p, &slab[off] );
+		off += size;
+	}
+
+	return 0;
+}
+
+char *bufpool_get ( bufpool_t *pool, int class )
+{
+	struct bufpool_class *class_p = &pool->class[class];
+	critical_on ( class < 0 || class >= BUFPOOL_CLASSES );
+
+	if ( !class_p->free_count )
+		if ( bufpool_grow ( pool, class ) )
+			return NULL;
+
+	class_p->free_count--;
+
+	if ( class_p->clean > class_p->free_count )
+		class_p->clean = class_p->free_count;
+
+	return class_p->free[class_p->free_count];
+}
+
+void bufpool_put ( bufpool_t *pool, char *buf, int class )
+{
+	bufpool_push ( &pool->class[class], buf );
+	return;
+}
+
+/*
+ * Returns non-zero if there're cold free buffers that are not returned
+ * to the kernel, yet.
+ */
+int bufpool_dirty ( bufpool_t *pool )
+{
+	int class = 0;
+
+	if ( pool->hugepages )
+		return 0;	// Hugepages cannot be partially returned
+
+	while ( class < BUFPOOL_CLASSES ) {
+		struct bufpool_class *class_p = &pool->class[class++];
+
+		if ( class_p->free_count - KVMPOOL_BUFPOOL_HOT > class_p->clean )
+			return 1;
+	}
+
+	return 0;
+}
+
+int bufpool_trim ( bufpool_t *pool )
+{
+	int class = 0;
+
+	if ( pool->hugepages )
+		return 0;
+
+	while ( class < BUFPOOL_CLASSES ) {
+		struct bufpool_class *class_p = &pool->class[class];
+		size_t size = bufpool_class_size ( class );
+		int end = class_p->free_count - KVMPOOL_BUFPOOL_HOT;
+		debug ( 10, "class %i: madvise(MADV_DONTNEED) for %i buffers", class, end - class_p->clean );
+
+		while ( class_p->clean < end )
+			madvise ( class_p->free[class_p->clean++], size, MADV_DONTNEED );
+
+		class++;
+	}
+
+	return 0;
+}
+
+void bufpool_deinit ( bufpool_t *pool )
+{
+	int class = 0;
+
+	while ( class < BUFPOOL_CLASSES )
+		free ( pool->class[class++].free );
+
+	while ( pool->slabs_count )
+		munmap ( pool->slabs[--pool->slabs_count], KVMPOOL_BUFPOOL_SLAB );
+
+	free ( pool->slabs );
+	memset ( pool, 0, sizeof ( *pool ) );
+	return;
+}
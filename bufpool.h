@@ -0,0 +1,62 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVMPOOL_BUFPOOL_H
+#define __KVMPOOL_BUFPOOL_H
+
+#include "common.h"
+
+#include <sys/types.h>
+
+// Size classes: BUFPOOL_CLASS_MINSIZE << (2*class), the last one is KVMPOOL_NET_BUFSIZE
+#define BUFPOOL_CLASS_MINSIZE	(1<<12)
+#define BUFPOOL_CLASSES		5
+
+struct bufpool_class {
+	char	**free;		// A stack, free[0] is the coldest buffer
+	int	  free_count;
+	int	  free_size;
+	int	  clean;	// free[0 .. clean-1] are already returned to the kernel
+};
+
+/*
+ * Not thread-safe: every proxy worker has its own pool.
+ */
+struct bufpool {
+	int			 hugepages;
+	struct bufpool_class	 class[BUFPOOL_CLASSES];
+	void			**slabs;
+	int			 slabs_count;
+};
+typedef struct bufpool bufpool_t;
+
+static inline size_t bufpool_class_size ( int class )
+{
+	return ( size_t ) BUFPOOL_CLASS_MINSIZE << ( 2 * class );
+}
+
+extern int bufpool_init ( bufpool_t *pool, int hugepages );
+extern char *bufpool_get ( bufpool_t *pool, int class );
+extern void bufpool_put ( bufpool_t *pool, char *buf, int class );
+extern int bufpool_trim ( bufpool_t *pool );
+extern int bufpool_dirty ( bufpool_t *pool );
+extern void bufpool_deinit ( bufpool_t *pool );
+
+#endif
@@ -0,0 +1,358 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements "--cgroup": the VMs are put into a cgroup v2
+ * subtree, so the spare ones don't take the CPU and the disks from the
+ * ones serving clients. There are two groups: "spare" (a low weight and a
+ * CPU cap) and "active" (a high weight), and every VM has a leaf cgroup
+ * "vm-<vnc_id>" in both. A VM is spawned into its spare leaf, and it's
+ * moved to its active leaf (and back, see "--recycle") by the controller,
+ * not by the acceptors, so the migration of a process doesn't slow an
+ * attach down: a VM is queued when its state changes (see cgroup_queue())
+ * and the controller moves the queued ones (see cgroup_sync()). The usage
+ * of a VM is the sum of both leaves, see cgroup_usage().
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+#include "readyq.h"
+
+static const char *const cgroup_groups[CGROUP_MAX] = {
+	[CGROUP_SPARE]	= "spare",
+	[CGROUP_ACTIVE]	= "active",
+};
+
+// The VMs to be moved (indexes in ctx_p->vmtable.vms), see cgroup_queue()
+static readyq_t cgroup_moveq;
+static volatile int cgroup_moveq_overflow;
+
+static int cgroup_path ( ctx_t *ctx_p, int group, int vnc_id, const char *file, char *path, size_t path_size )
+{
+	if ( vnc_id < 0 )
+		return snprintf ( path, path_size, "%s/%s%s%s", ctx_p->cgroup_path, cgroup_groups[group], file ? "/" : "", file ? file : "" );
+
+	return snprintf ( path, path_size, "%s/%s/vm-%i%s%s", ctx_p->cgroup_path, cgroup_groups[group], vnc_id, file ? "/" : "", file ? file : "" );
+}
+
+// No stdio: it's used between fork() and exec(), too
+static int cgroup_write ( const char *path, const char *value )
+{
+	int fd = open ( path, O_WRONLY | O_CLOEXEC ), rc = 0;
+
+	if ( fd == -1 )
+		return errno;
+
+	if ( write ( fd, value, strlen ( value ) ) == -1 )
+		rc = errno;
+
+	close ( fd );
+	return rc;
+}
+
+// Makes the controllers available to the children of the cgroup, the missing ones are skipped
+static void cgroup_delegate ( const char *dir )
+{
+	static const char *const controllers[] = { "+cpu", "+io", "+memory", NULL };
+	const char *const *controller = controllers;
+	char path[PATH_MAX];
+	snprintf ( path, sizeof ( path ), "%s/cgroup.subtree_control", dir );
+
+	while ( *controller != NULL ) {
+		if ( ( errno = cgroup_write ( path, *controller ) ) )
+			warning ( "Cannot enable the controller \"%s\" in \"%s\"", &( *controller ) [1], dir );
+
+		controller++;
+	}
+
+	return;
+}
+
+static int cgroup_mkdir ( const char *path )
+{
+	if ( mkdir ( path, 0755 ) && errno != EEXIST ) {
+		error ( "Cannot create the cgroup \"%s\"", path );
+		return errno;
+	}
+
+	return 0;
+}
+
+// Creates the "spare" and "active" groups
+int cgroup_init ( ctx_t *ctx_p )
+{
+	char dir[PATH_MAX], path[PATH_MAX], value[64];
+	int group = CGROUP_SPARE, rc;
+
+	if ( ( rc = cgroup_mkdir ( ctx_p->cgroup_path ) ) )
+		return rc;
+
+	cgroup_delegate ( ctx_p->cgroup_path );
+
+	while ( group < CGROUP_MAX ) {
+		int weight = group == CGROUP_SPARE ? KVMPOOL_CGROUP_SPARE_WEIGHT : KVMPOOL_CGROUP_ACTIVE_WEIGHT;
+		cgroup_path ( ctx_p, group, -1, NULL, dir, sizeof ( dir ) );
+
+		if ( ( rc = cgroup_mkdir ( dir ) ) )
+			return rc;
+
+		cgroup_delegate ( dir );
+		snprintf ( value, sizeof ( value ), "%i", weight );
+		cgroup_path ( ctx_p, group, -1, "cpu.weight", path, sizeof ( path ) );
+
+		if ( ( errno = cgroup_write ( path, value ) ) )
+			warning ( "Cannot set \"%s\" to %s", path, value );
+
+		snprintf ( value, sizeof ( value ), "default %i", weight );
+		cgroup_path ( ctx_p, group, -1, "io.weight", path, sizeof ( path ) );
+
+		if ( ( errno = cgroup_write ( path, value ) ) )
+			debug ( 1, "Cannot set \"%s\" to \"%s\": %s", path, value, strerror ( errno ) );
+
+		group++;
+	}
+
+	// All the spare VMs together, in percents of a CPU
+	if ( ctx_p->flags[CGROUP_SPARE_CPU] )
+		snprintf ( value, sizeof ( value ), "%i %i", ctx_p->flags[CGROUP_SPARE_CPU] * KVMPOOL_CGROUP_CPU_PERIOD / 100, KVMPOOL_CGROUP_CPU_PERIOD );
+	else
+		snprintf ( value, sizeof ( value ), "max %i", KVMPOOL_CGROUP_CPU_PERIOD );
+
+	cgroup_path ( ctx_p, CGROUP_SPARE, -1, "cpu.max", path, sizeof ( path ) );
+
+	if ( ( errno = cgroup_write ( path, value ) ) )
+		warning ( "Cannot set \"%s\" to \"%s\"", path, value );
+
+	// A reused slot can be queued again before its stale entry is popped
+	readyq_init ( &cgroup_moveq, 2 * ctx_p->vms_max );
+	return 0;
+}
+
+/*
+ * Creates the leaves of the VM before it's spawned; the VM is put into
+ * one of them by cgroup_enter(). A VM without them just runs out of the
+ * cgroups. Requires the global lock.
+ */
+int cgroup_create ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+	int group = CGROUP_SPARE, rc = 0;
+	char path[PATH_MAX];
+
+	while ( group < CGROUP_MAX && !rc ) {
+		cgroup_path ( ctx_p, group++, vm->vnc_id, NULL, path, sizeof ( path ) );
+		rc = cgroup_mkdir ( path );
+	}
+
+	// Even if a leaf is missing: cgroup_remove() removes the rest
+	cold->cgroup = CGROUP_SPARE;
+	return rc;
+}
+
+// Moves the calling process into the leaf of the group; called by the child between fork() and exec()
+void cgroup_enter ( ctx_t *ctx_p, int group, int vnc_id )
+{
+	char path[PATH_MAX];
+	cgroup_path ( ctx_p, group, vnc_id, "cgroup.procs", path, sizeof ( path ) );
+	cgroup_write ( path, "0" );
+	return;
+}
+
+/*
+ * Queues the VM to be moved by cgroup_sync(), it's called when the VM is
+ * attached or detached. Lock-free (the acceptors claim VMs without the
+ * lock), a VM is in the queue once. If the queue is full, the next
+ * cgroup_sync() checks every VM.
+ */
+void cgroup_queue ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+
+	if ( ctx_p->cgroup_path == NULL || !__sync_bool_compare_and_swap ( &cold->cgroup_queued, 0, 1 ) )
+		return;
+
+	if ( readyq_push ( &cgroup_moveq, vmtable_idx ( &ctx_p->vmtable, vm ) ) )
+		cgroup_moveq_overflow = 1;
+
+	return;
+}
+
+/*
+ * Moves the VM to the active group if it's serving a client, or back to
+ * the spare group if it's a spare (or being recycled) one. The closed
+ * VMs are skipped, their leaves are removed by cgroup_remove().
+ */
+static void cgroup_move ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+	char path[PATH_MAX], pid[16];
+	int group;
+
+	if ( !cold->cgroup || vm->pid <= 0 )
+		return;
+
+	switch ( vm->state ) {
+		case VMST_ATTACHED:
+			group = CGROUP_ACTIVE;
+			break;
+
+		case VMST_FREE:
+		case VMST_DRAINING:
+		case VMST_DEAD:
+			return;
+
+		default:
+			group = CGROUP_SPARE;
+			break;
+	}
+
+	if ( cold->cgroup == group )
+		return;
+
+	debug ( 4, "vm->vnc_id == %i: cgroup \"%s\"", vm->vnc_id, cgroup_groups[group] );
+	cgroup_path ( ctx_p, group, vm->vnc_id, "cgroup.procs", path, sizeof ( path ) );
+	snprintf ( pid, sizeof ( pid ), "%i", vm->pid );
+
+	// The process is exiting, the VM is going to be closed
+	if ( ( errno = cgroup_write ( path, pid ) ) ) {
+		debug ( 1, "Cannot move the VM (vnc_id == %i) to \"%s\": %s", vm->vnc_id, path, strerror ( errno ) );
+		return;
+	}
+
+	cold->cgroup = group;
+	return;
+}
+
+/*
+ * Moves the queued VMs, a write to "cgroup.procs" per VM; the lock keeps
+ * the process from being reaped (and its PID reused) meanwhile. Called by
+ * the controller, requires the global lock.
+ */
+void cgroup_sync ( ctx_t *ctx_p )
+{
+	vmtable_t *t = &ctx_p->vmtable;
+	int i = 0;
+
+	while ( !readyq_pop ( &cgroup_moveq, &i ) ) {
+		vm_t *vm = &t->vms[i];
+		// Cleared first, so a state change from now on queues it again
+		__sync_lock_release ( &vmtable_cold ( t, vm )->cgroup_queued );
+		cgroup_move ( ctx_p, vm );
+	}
+
+	if ( !cgroup_moveq_overflow )
+		return;
+
+	warning ( "The cgroup queue overflowed, checking every VM" );
+	cgroup_moveq_overflow = i = 0;
+
+	while ( i < t->size )
+		cgroup_move ( ctx_p, &t->vms[i++] );
+
+	return;
+}
+
+// Sums "key value" lines ("cpu.stat") or "key=value" fields of every device ("io.stat")
+static uint64_t cgroup_stat ( const char *path, const char *key )
+{
+	char line[1024], *p;
+	size_t key_len = strlen ( key );
+	uint64_t sum = 0;
+	FILE *f;
+
+	if ( ( f = fopen ( path, "r" ) ) == NULL )
+		return 0;
+
+	while ( fgets ( line, sizeof ( line ), f ) != NULL ) {
+		p = line;
+
+		while ( ( p = strstr ( p, key ) ) != NULL ) {
+			int fits = ( p == line || p[-1] == ' ' ) && ( p[key_len] == ' ' || p[key_len] == '=' );
+			p += key_len;
+
+			if ( fits )
+				sum += strtoull ( p + 1, &p, 10 );
+		}
+	}
+
+	fclose ( f );
+	return sum;
+}
+
+// The usage of the VM (both of its leaves): CPU time in us, and bytes read and written
+int cgroup_usage ( ctx_t *ctx_p, int vnc_id, uint64_t *cpu_us, uint64_t *read, uint64_t *written )
+{
+	int group = CGROUP_SPARE;
+	*cpu_us = *read = *written = 0;
+
+	while ( group < CGROUP_MAX ) {
+		char path[PATH_MAX];
+		cgroup_path ( ctx_p, group, vnc_id, "cpu.stat", path, sizeof ( path ) );
+		*cpu_us  += cgroup_stat ( path, "usage_usec" );
+		cgroup_path ( ctx_p, group, vnc_id, "io.stat", path, sizeof ( path ) );
+		*read    += cgroup_stat ( path, "rbytes" );
+		*written += cgroup_stat ( path, "wbytes" );
+		group++;
+	}
+
+	return 0;
+}
+
+// The VM is gone (its process is reaped). Requires the global lock.
+void cgroup_remove ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+	int group = CGROUP_SPARE;
+
+	if ( !cold->cgroup )
+		return;
+
+	while ( group < CGROUP_MAX ) {
+		char path[PATH_MAX];
+		cgroup_path ( ctx_p, group++, vm->vnc_id, NULL, path, sizeof ( path ) );
+
+		// Busy if a child of QEMU is still there
+		if ( rmdir ( path ) && errno != ENOENT )
+			debug ( 3, "Cannot remove the cgroup \"%s\": %s", path, strerror ( errno ) );
+	}
+
+	cold->cgroup = CGROUP_NONE;
+	return;
+}
+
+void cgroup_deinit ( ctx_t *ctx_p )
+{
+	readyq_deinit ( &cgroup_moveq );
+	return;
+}
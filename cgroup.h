@@ -0,0 +1,48 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_CGROUP_H
+#define __KVMPOOL_CGROUP_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+#include "ctx.h"
+
+enum cgroup_group {
+	CGROUP_NONE = 0,
+	CGROUP_SPARE,
+	CGROUP_ACTIVE,
+
+	CGROUP_MAX
+};
+
+extern int cgroup_init ( ctx_t *ctx_p );
+extern int cgroup_create ( ctx_t *ctx_p, vm_t *vm );
+extern void cgroup_enter ( ctx_t *ctx_p, int group, int vnc_id );
+extern void cgroup_queue ( ctx_t *ctx_p, vm_t *vm );
+extern void cgroup_sync ( ctx_t *ctx_p );
+extern int cgroup_usage ( ctx_t *ctx_p, int vnc_id, uint64_t *cpu_us, uint64_t *read, uint64_t *written );
+extern void cgroup_remove ( ctx_t *ctx_p, vm_t *vm );
+extern void cgroup_deinit ( ctx_t *ctx_p );
+
+#endif
@@ -24,8 +24,8 @@
 
 #include "macros.h"
 
-//#define USE_SPLICE	// Don't use this option, doesn't work: splice cannot be used for tcp->tcp: http://stackoverflow.com/questions/7084254/linux-splice-returning-einval-invalid-argument
 #define _DEBUG_SUPPORT
+#define IO_URING_SUPPORT	// "--io-backend io_uring"; requires Linux >= 6.0 at run time
 //#define _DEBUG_FORCE
 
 #define PROGRAM "kvm-pool"
@@ -42,23 +42,81 @@
 #define WAITPID_TIMED_GRANULARITY        (30*1000*1000)
 
 #define KVM "kvm"
+#define QEMU_IMG "qemu-img"
 
 #define KVMPOOL_NET_BUFSIZE (1<<20)
-#define KVMPOOL_CONNECT_TIMEOUT 15
+#define KVMPOOL_CONNECT_TIMEOUT 15000 /* ms */
+#define KVMPOOL_CONNECT_BACKOFF_MIN 1 /* ms */
+#define KVMPOOL_CONNECT_BACKOFF_MAX 128 /* ms */
+#define KVMPOOL_PROXY_EPOLL_EVENTS 256
+#define KVMPOOL_SPLICE_PIPESIZE (1<<20)	/* per direction; limited by /proc/sys/fs/pipe-max-size */
+#define KVMPOOL_URING_ENTRIES 1024
+#define KVMPOOL_URING_BUFS 256	/* per worker, has to be a power of 2 */
+#define KVMPOOL_URING_BUFSIZE (1<<16)
+#define KVMPOOL_URING_CHAIN 16	/* max linked send()-s in flight per direction */
+#define KVMPOOL_URING_FLOW_BUFS 32	/* max buffers queued per direction */
+#define KVMPOOL_BUFPOOL_SLAB (1<<21)	/* a hugepage */
+#define KVMPOOL_BUFPOOL_HOT 4	/* free buffers per size class kept resident */
+#define KVMPOOL_BUFPOOL_WINDOW 1000 /* ms */
+#define KVMPOOL_BUFPOOL_TRIM_INTERVAL 5000 /* ms */
+#define KVMPOOL_ACCEPT_BATCH 64	/* connections attached under one lock */
+#define KVMPOOL_RECONCILE_RETRY 1000 /* ms, if spare VMs couldn't be started */
+#define KVMPOOL_TRIM_DELAY 30000 /* ms, surplus spare VMs are killed if the surplus lasts that long */
+#define KVMPOOL_AUTOSCALE_TICK 5000 /* ms */
+#define KVMPOOL_AUTOSCALE_TAU 60000 /* ms, the time constant of the arrival rate EWMA */
+#define KVMPOOL_AUTOSCALE_ALPHA 0.2 /* the weight of a new boot time or session length */
+#define KVMPOOL_AUTOSCALE_BUCKET 15 /* minutes, a bucket of the time-of-day histogram */
+#define KVMPOOL_AUTOSCALE_DAY_ALPHA 0.3 /* the weight of the last day in the histogram */
+#define KVMPOOL_AUTOSCALE_LOOKAHEAD 300000 /* ms, spares are started this earlier than a known peak */
+#define KVMPOOL_BOOT_SLOWDOWN 2 /* "--max-booting=0": a boot this times slower than the baseline halves the cap */
+#define KVMPOOL_BOOT_BASELINE_DRIFT 16 /* the baseline moves 1/16 of the way to every slower boot */
+#define KVMPOOL_BOOT_TIMEOUT 600000 /* ms, "--guest-agent": a guest not answering that long (after "--boot-delay") is considered booted */
+#define KVMPOOL_AGENT_PING_INTERVAL 1000 /* ms, "--guest-agent" */
+#define KVMPOOL_AGENT_CHARDEV "kvmpool-agent" /* "--guest-agent": the id of the chardev (and "<id>-serial" of the virtio-serial bus) */
+#define KVMPOOL_SNAPSHOT_TIMEOUT 600000 /* ms, to save the template VM (not counting "--snapshot-delay") */
+#define KVMPOOL_SNAPSHOT_POLL 100 /* ms */
+#define KVMPOOL_RECYCLE_THREADS 4 /* "--recycle": VMs saved or reverted at once */
+#define KVMPOOL_RECYCLE_TIMEOUT 30000 /* ms, to save or to revert a VM */
+#define KVMPOOL_RECYCLE_POLL 100 /* ms, "query-status" until the VM runs */
+#define KVMPOOL_OVERLAY_RETRY 1000 /* ms, if an overlay couldn't be created */
+#define KVMPOOL_MEMORY_BACKEND "kvmpool-ram" /* "--memory-template": the id of the memory backend object */
+#define KVMPOOL_NUMA_NODES_MAX 1024 /* "--numa": the memory policy is set on the nodes below it */
+#define KVMPOOL_CGROUP_SPARE_WEIGHT 10 /* "--cgroup": cpu.weight and io.weight of the spare VMs */
+#define KVMPOOL_CGROUP_ACTIVE_WEIGHT 1000 /* "--cgroup": the same of the VMs serving clients */
+#define KVMPOOL_CGROUP_CPU_PERIOD 100000 /* us, cpu.max of the spare VMs */
 
 #define DEFAULT_VMS_MIN 1
 #define DEFAULT_VMS_MAX 64
 #define DEFAULT_VMS_SPARE_MIN 1
 #define DEFAULT_VMS_SPARE_MAX 8
 #define DEFAULT_KILL_ON_DISCONNECT 1
+#define DEFAULT_HUGEPAGES 0
+#define DEFAULT_HANDOFF 0
 #define DEFAULT_LISTEN "0.0.0.0:5900"
+#define DEFAULT_IO_BACKEND IOB_RECV
+#define DEFAULT_VNC_TRANSPORT VNCT_TCP
+#define DEFAULT_RUNTIME_DIR "/run/kvm-pool"
+#define DEFAULT_ACCEPTORS 1
+#define DEFAULT_LISTEN_BACKLOG 1024
+#define DEFAULT_VNC_ID_BASE 256
+#define DEFAULT_MAC_PREFIX "52:54:00"
+#define DEFAULT_AUTOSCALE 0
+#define DEFAULT_MAX_BOOTING 0	/* adaptive */
+#define DEFAULT_SNAPSHOT_DELAY 30
+#define DEFAULT_OVERLAY_FORMAT "qcow2"
+#define DEFAULT_MEMORY_STATS 0
+#define DEFAULT_NUMA 0
+#define DEFAULT_CGROUP_SPARE_CPU 100	/* percents of a CPU */
+#define DEFAULT_GUEST_AGENT 0
+#define DEFAULT_BOOT_DELAY 0
+
+#define KVMPOOL_VNC_PORT_BASE 5900
+#define KVMPOOL_VNC_ID_MAX 0xffffff	/* the MAC suffix is 24 bits */
 
 #define SYSLOG_BUFSIZ                   (1<<16)
 #define SYSLOG_FLAGS                    (LOG_PID|LOG_CONS)
 #define SYSLOG_FACILITY                 LOG_DAEMON
 
-#define BACKLOG 10
-
 #define CONFIG_PATHS                    { ".kvm-pool.conf", "/etc/kvm-pool/kvm-pool.conf", "/etc/kvm-pool.conf", "/usr/local/etc/kvm-pool/kvm-pool.conf", "/usr/local/etc/kvm-pool.conf", NULL }
 
 #define DEFAULT_CONFIG_GROUP "default"
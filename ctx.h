@@ -24,9 +24,13 @@
 
 #include "common.h"
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "vmtable.h"
+#include "autoscale.h"
+
 
 #define OPTION_FLAGS		(1<<10)
 #define OPTION_LONGOPTONLY	(1<<9)
@@ -48,10 +52,52 @@ enum flags_enum {
 
 	CONFIG_GROUP_INHERITS	=  0 | OPTION_LONGOPTONLY,
 	KVM_ARGS		=  1 | OPTION_LONGOPTONLY,
+	PROXY_WORKERS		=  2 | OPTION_LONGOPTONLY,
+	IO_BACKEND		=  3 | OPTION_LONGOPTONLY,
+	HUGEPAGES		=  4 | OPTION_LONGOPTONLY,
+	VNC_TRANSPORT		=  5 | OPTION_LONGOPTONLY,
+	RUNTIME_DIR		=  6 | OPTION_LONGOPTONLY,
+	HANDOFF			=  7 | OPTION_LONGOPTONLY,
+	ACCEPTORS		=  8 | OPTION_LONGOPTONLY,
+	LISTEN_BACKLOG		=  9 | OPTION_LONGOPTONLY,
+	VNC_ID_BASE		= 10 | OPTION_LONGOPTONLY,
+	MAC_PREFIX		= 11 | OPTION_LONGOPTONLY,
+	AUTOSCALE		= 12 | OPTION_LONGOPTONLY,
+	MAX_BOOTING		= 13 | OPTION_LONGOPTONLY,
+	SNAPSHOT		= 14 | OPTION_LONGOPTONLY,
+	SNAPSHOT_DELAY		= 15 | OPTION_LONGOPTONLY,
+	RECYCLE			= 16 | OPTION_LONGOPTONLY,
+	OVERLAY_BACKING		= 17 | OPTION_LONGOPTONLY,
+	OVERLAY_FORMAT		= 18 | OPTION_LONGOPTONLY,
+	OVERLAY_DIR		= 19 | OPTION_LONGOPTONLY,
+	MEMORY_TEMPLATE		= 20 | OPTION_LONGOPTONLY,
+	MEMORY_STATS		= 21 | OPTION_LONGOPTONLY,
+	NUMA			= 22 | OPTION_LONGOPTONLY,
+	CGROUP			= 23 | OPTION_LONGOPTONLY,
+	CGROUP_SPARE_CPU	= 24 | OPTION_LONGOPTONLY,
+	GUEST_AGENT		= 25 | OPTION_LONGOPTONLY,
+	BOOT_DELAY		= 26 | OPTION_LONGOPTONLY,
 };
 typedef enum flags_enum flags_t;
 
 
+enum io_backend {
+	IOB_RECV = 0,
+	IOB_SPLICE,
+	IOB_IO_URING,
+
+	IOB_MAX
+};
+typedef enum io_backend io_backend_t;
+
+enum vnc_transport {
+	VNCT_TCP = 0,
+	VNCT_UNIX,
+
+	VNCT_MAX
+};
+typedef enum vnc_transport vnc_transport_t;
+
 enum shargsid {
 	SHARGS_PRIMARY = 0,
 	SHARGS_MAX,
@@ -73,15 +119,8 @@ enum state_enum {
 };
 typedef enum state_enum state_t;
 
-struct vm {
-	pid_t		 pid;
-	int		 vnc_id;
-	int		 vnc_fd;
-	int		 client_fd;
-	pthread_t	 handler;
-	char		*buf;
-};
-typedef struct vm vm_t;
+struct proxy_worker;
+struct kvmpool_acceptor;
 
 struct ctx {
 	volatile state_t state;
@@ -97,12 +136,30 @@ struct ctx {
 	int		 vms_max;
 	int		 vms_spare_min;
 	int		 vms_spare_max;
-	vm_t		*vms;
-	int		 vms_count;
+	vmtable_t	 vmtable;
 	int		 vms_spare_count;
+	int		 vms_spare_target;	// Between vms_spare_min and vms_spare_max, see "--autoscale"
+	autoscale_t	 autoscale;
+	int		 vms_booting;		// Spawned and not ready, yet
+	int		 vms_booting_max;	// See "--max-booting"
 
 	char		 listen_addr[256];
-	int		 listen_fd;
+	struct kvmpool_acceptor *acceptors;
+	int		 acceptors_count;
+
+	struct proxy_worker *proxy_workers;
+	int		 proxy_workers_count;
+	io_backend_t	 io_backend;
+	vnc_transport_t	 vnc_transport;
+	char		*runtime_dir;
+	unsigned char	 mac_prefix[3];	// The suffix is the VNC id (24 bits)
+	char		*snapshot_path;	// "--snapshot", NULL if the VMs boot
+	char		*recycle_tag;	// "--recycle", NULL if the VMs are killed on disconnect
+	char		*overlay_backing; // "--overlay-backing", NULL if the VMs have no overlays
+	char		*overlay_format;
+	char		*overlay_dir;
+	char		*memory_template; // "--memory-template": the guest RAM size, NULL if the RAM isn't shared
+	char		*cgroup_path;	// "--cgroup", NULL if the VMs aren't put into cgroups
 
 	kvm_args_t kvm_args[SHARGS_MAX];
 
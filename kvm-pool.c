@@ -23,21 +23,34 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
-#ifdef USE_SPLICE
-#	include <fcntl.h>
-#endif
 
 #include "kvm-pool.h"
 
+#include "cgroup.h"
 #include "error.h"
 #include "malloc.h"
 #include "main.h"
+#include "memstat.h"
+#include "numa.h"
+#include "overlay.h"
+#include "proxy.h"
+#include "pthreadex.h"
+#include "recycle.h"
+#include "snapshot.h"
 
 #define debug_argv_dump(level, argv)\
 	if (unlikely(ctx_p->flags[DEBUG] >= level))\
@@ -58,74 +71,171 @@ static inline void argv_dump ( int debug_level, char **argv )
 	return;
 }
 
-#ifdef USE_SPLICE
-static inline int setsock_nonblock ( int sock )
+int kvmpool_vncpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size )
 {
-	int flags;
-
-	if ( -1 == ( flags = fcntl ( sock, F_GETFL, 0 ) ) )
-		flags = 0;
-
-	return fcntl ( sock, F_SETFL, flags | O_NONBLOCK );
+	return snprintf ( path, path_size, "%s/vm-%i.sock", ctx_p->runtime_dir, vnc_id );
 }
-#endif
 
-static int newvncid ( ctx_t *ctx_p )
+int kvmpool_qmppath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size )
 {
-	int new_vnc_id = 0;
-
-	while ( new_vnc_id < ctx_p->vms_max ) {
-		int i = 0;
-		int f = 0;
+	return snprintf ( path, path_size, "%s/vm-%i.qmp", ctx_p->runtime_dir, vnc_id );
+}
 
-		while ( f < ctx_p->vms_count ) {
-			debug ( 30, "i == %i; f == %i, ctx_p->vms_count == %i; new_vnc_id == %i, ctx_p->vms[%i].vnc_id == %i", i, f, ctx_p->vms_count, new_vnc_id, i, ctx_p->vms[i].vnc_id );
+// "--recycle": the QMP monitor of the recyclers (the one of "--handoff" is busy with a proxy session)
+int kvmpool_ctlpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size )
+{
+	return snprintf ( path, path_size, "%s/vm-%i.ctl", ctx_p->runtime_dir, vnc_id );
+}
 
-			if ( ctx_p->vms[i].pid == 0 ) {
-				i++;
-				continue;
-			}
+// "--guest-agent": the host side of the virtio-serial port of the guest agent
+int kvmpool_agentpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size )
+{
+	return snprintf ( path, path_size, "%s/vm-%i.agent", ctx_p->runtime_dir, vnc_id );
+}
 
-			if ( ctx_p->vms[i].vnc_id == 256 + new_vnc_id )
-				break;
+// "--memory-template": the RAM of the template VM, it goes with the snapshot
+int kvmpool_rampath ( ctx_t *ctx_p, char *path, size_t path_size )
+{
+	return snprintf ( path, path_size, "%s.ram", ctx_p->snapshot_path );
+}
 
-			f++;
-			i++;
-		}
+// The per-VM macros of "--kvm-args" (left unexpanded by main()), see getargv_parameter_get()
+struct getargv_vm {
+	ctx_t	*ctx_p;
+	char	 vnc_id[16];
+	char	 overlay[PATH_MAX];	// Empty if the VM has no overlay
+};
 
-		debug ( 28, "f == %i; ctx_p->vms_count == %i", f, ctx_p->vms_count );
+static const char *getargv_parameter_get ( const char *variable_name, void *_vm_p )
+{
+	struct getargv_vm *vm_p = _vm_p;
 
-		if ( f >= ctx_p->vms_count )
-			break;
+	if ( !strcmp ( variable_name, "VNC_ID" ) )
+		return vm_p->vnc_id;
 
-		new_vnc_id++;
-	}
+	if ( !strcmp ( variable_name, "OVERLAY" ) && *vm_p->overlay )
+		return vm_p->overlay;
 
-	debug ( 20, "new_vnc_id + 256 == %i", new_vnc_id + 256 );
-	critical_on ( new_vnc_id >= ctx_p->vms_max );
-	return new_vnc_id + 256;
+	return parameter_get ( variable_name, vm_p->ctx_p );
 }
 
-static char **getargv ( ctx_t *ctx_p, kvm_args_t *args_p, int vnc_id )
+/*
+ * "overlay" is the index of the overlay + 1 (0 if none), see overlay.c.
+ * "template_qmp" is the QMP socket of the "--snapshot" template VM, NULL
+ * for the pool VMs.
+ */
+static char **getargv ( ctx_t *ctx_p, kvm_args_t *args_p, int vnc_id, int overlay, const char *template_qmp )
 {
+	struct getargv_vm vm = { .ctx_p = ctx_p };
 	int d, s;
-	char **argv = ( char ** ) xcalloc ( sizeof ( char * ), MAXARGUMENTS + 2 );
+	char **argv = ( char ** ) xcalloc ( sizeof ( char * ), MAXARGUMENTS + 32 );	// The options of kvm-pool itself, too
 	debug ( 9, "args_p->c == %i", args_p->c );
 	s = d = 0;
 	argv[d++] = strdup ( KVM );
 	argv[d++] = strdup ( "-vnc" );
 	{
-		char vncidstr[256];
-		snprintf ( vncidstr, 256, ":%i", vnc_id );
+		char vncidstr[PATH_MAX];
+
+		switch ( ctx_p->vnc_transport ) {
+			case VNCT_UNIX:
+				strcpy ( vncidstr, "unix:" );
+				kvmpool_vncpath ( ctx_p, vnc_id, &vncidstr[sizeof ( "unix:" ) - 1], sizeof ( vncidstr ) - ( sizeof ( "unix:" ) - 1 ) );
+				break;
+
+			default:
+				snprintf ( vncidstr, sizeof ( vncidstr ), ":%i", vnc_id );
+				break;
+		}
+
 		argv[d++] = strdup ( vncidstr );
 	}
+
+	if ( ctx_p->flags[HANDOFF] ) {
+		char qmpstr[PATH_MAX];
+		size_t len;
+		strcpy ( qmpstr, "unix:" );
+		len = sizeof ( "unix:" ) - 1;
+		len += kvmpool_qmppath ( ctx_p, vnc_id, &qmpstr[len], sizeof ( qmpstr ) - len );
+		snprintf ( &qmpstr[len], sizeof ( qmpstr ) - len, ",server=on,wait=off" );
+		argv[d++] = strdup ( "-qmp" );
+		argv[d++] = strdup ( qmpstr );
+	}
+
+	if ( ctx_p->recycle_tag != NULL && template_qmp == NULL ) {
+		char qmpstr[PATH_MAX];
+		size_t len;
+		strcpy ( qmpstr, "unix:" );
+		len = sizeof ( "unix:" ) - 1;
+		len += kvmpool_ctlpath ( ctx_p, vnc_id, &qmpstr[len], sizeof ( qmpstr ) - len );
+		snprintf ( &qmpstr[len], sizeof ( qmpstr ) - len, ",server=on,wait=off" );
+		argv[d++] = strdup ( "-qmp" );
+		argv[d++] = strdup ( qmpstr );
+	}
+
+	/*
+	 * "--guest-agent": the agent answers when the guest is up, see
+	 * proxy_boot_start(). The template VM gets the port, too: the restored
+	 * VMs have to have the same devices.
+	 */
+	if ( ctx_p->flags[GUEST_AGENT] ) {
+		char chardevstr[PATH_MAX + 64];
+		size_t len;
+		len  = snprintf ( chardevstr, sizeof ( chardevstr ), "socket,id="KVMPOOL_AGENT_CHARDEV",path=" );
+		len += kvmpool_agentpath ( ctx_p, vnc_id, &chardevstr[len], sizeof ( chardevstr ) - len );
+		snprintf ( &chardevstr[len], sizeof ( chardevstr ) - len, ",server=on,wait=off" );
+		argv[d++] = strdup ( "-chardev" );
+		argv[d++] = strdup ( chardevstr );
+		argv[d++] = strdup ( "-device" );
+		argv[d++] = strdup ( "virtio-serial,id="KVMPOOL_AGENT_CHARDEV"-serial" );
+		argv[d++] = strdup ( "-device" );
+		argv[d++] = strdup ( "virtserialport,bus="KVMPOOL_AGENT_CHARDEV"-serial.0,chardev="KVMPOOL_AGENT_CHARDEV",name=org.qemu.guest_agent.0" );
+	}
+
+	if ( template_qmp != NULL ) {
+		char qmpstr[PATH_MAX];
+		snprintf ( qmpstr, sizeof ( qmpstr ), "unix:%s,server=on,wait=off", template_qmp );
+		argv[d++] = strdup ( "-qmp" );
+		argv[d++] = strdup ( qmpstr );
+	} else if ( ctx_p->snapshot_path != NULL ) {
+		char incomingstr[SNAPSHOT_URI_MAX];
+		snapshot_execuri ( incomingstr, sizeof ( incomingstr ), "cat", ctx_p->snapshot_path );
+		argv[d++] = strdup ( "-incoming" );
+		argv[d++] = strdup ( incomingstr );
+	}
+
+	/*
+	 * "--memory-template": the RAM of the template VM is a shared mapping
+	 * of a file, and it's left out of the snapshot ("x-ignore-shared"). The
+	 * pool VMs map the file privately, so the pages they don't write to
+	 * stay shared between them (in the page cache).
+	 */
+	if ( ctx_p->memory_template != NULL ) {
+		char rampath[PATH_MAX], objstr[PATH_MAX + 128];
+		kvmpool_rampath ( ctx_p, rampath, sizeof ( rampath ) );
+		snprintf ( objstr, sizeof ( objstr ), "memory-backend-file,id="KVMPOOL_MEMORY_BACKEND",size=%s,mem-path=%s,share=%s",
+			   ctx_p->memory_template, rampath, template_qmp != NULL ? "on" : "off" );
+		argv[d++] = strdup ( "-object" );
+		argv[d++] = strdup ( objstr );
+		argv[d++] = strdup ( "-machine" );
+		argv[d++] = strdup ( "memory-backend="KVMPOOL_MEMORY_BACKEND );
+		argv[d++] = strdup ( "-global" );
+		argv[d++] = strdup ( "migration.x-ignore-shared=on" );
+	}
+
 	argv[d++] = strdup ( "-net" );
 	{
 		char tapstr[256];
-		snprintf (tapstr, 256, "nic,macaddr=52:54:00:31:14:%02x", vnc_id-256);
+		unsigned char *prefix = ctx_p->mac_prefix;
+		snprintf ( tapstr, 256, "nic,macaddr=%02x:%02x:%02x:%02x:%02x:%02x", prefix[0], prefix[1], prefix[2],
+			   ( vnc_id >> 16 ) & 0xff, ( vnc_id >> 8 ) & 0xff, vnc_id & 0xff );
 		argv[d++] = strdup ( tapstr );
 	}
 
+	snprintf ( vm.vnc_id, sizeof ( vm.vnc_id ), "%i", vnc_id );
+
+	if ( overlay )
+		overlay_path ( ctx_p, overlay - 1, vm.overlay, sizeof ( vm.overlay ) );
+
 	while ( s < args_p->c ) {
 		char *arg        = args_p->v[s];
 		char  isexpanded = args_p->isexpanded[s];
@@ -150,7 +260,7 @@ static char **getargv ( ctx_t *ctx_p, kvm_args_t *args_p, int vnc_id )
 		}
 
 #endif
-		argv[d] = parameter_expand ( ctx_p, strdup ( arg ), 0, NULL, NULL, parameter_get, ctx_p );
+		argv[d] = parameter_expand ( ctx_p, strdup ( arg ), 0, NULL, NULL, getargv_parameter_get, &vm );
 #ifdef _DEBUG_FORCE
 		debug ( 19, "argv[%u] == %p \"%s\"", d, argv[d], argv[d] );
 #endif
@@ -165,42 +275,190 @@ static char **getargv ( ctx_t *ctx_p, kvm_args_t *args_p, int vnc_id )
 }
 
 
-int kvmpool_runspare ( ctx_t *ctx_p )
+// The pidfd becomes readable when the process exits, so the proxy worker of the VM reaps it right away
+static int kvmpool_pidfd_open ( pid_t pid )
 {
-	debug ( 4, "" );
+#ifdef SYS_pidfd_open
+	int fd = syscall ( SYS_pidfd_open, pid, 0 );
 
-	if ( ctx_p->vms_count >= ctx_p->vms_max )
-		return ENOMEM;
+	if ( fd != -1 )
+		return fd;
+
+	debug ( 3, "pidfd_open(%i): %s", pid, strerror ( errno ) );
+#endif
+	return 0;
+}
+
+/*
+ * Moves the VM to VMST_DRAINING (an exchange: an acceptor could claim it
+ * meanwhile) and wakes up the controller to replace it (or free its
+ * slot). Returns the previous state.
+ */
+static vm_state_t kvmpool_drainvm ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_state_t state = __atomic_exchange_n ( &vm->state, VMST_DRAINING, __ATOMIC_SEQ_CST );
+	vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_DRAINING] = kvmpool_now_ms();
+	vmtable_relink ( &ctx_p->vmtable, vm );
+	debug ( 10, "vm->vnc_id == %i: %i -> %i", vm->vnc_id, state, VMST_DRAINING );
+
+	// A spare VM died (or was killed) before a client came
+	if ( kvmpool_state_isspare ( state ) )
+		__sync_fetch_and_sub ( &ctx_p->vms_spare_count, 1 );
+
+	if ( state == VMST_ATTACHED )
+		autoscale_session ( &ctx_p->autoscale, kvmpool_now_ms() - vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_ATTACHED] );
 
-	int new_vnc_id = newvncid ( ctx_p );
-	vm_t *vm = ctx_p->vms;
+	kvmpool_ctl_wakeup();
+	return state;
+}
+
+// Forks a queued VM; its proxy session is already started by kvmpool_runspare()
+static int kvmpool_spawnvm ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+	int rc;
+	debug ( 4, "vm->vnc_id == %i", vm->vnc_id );
 
-	while ( vm->pid ) vm++;
+	// A client could claim the VM while it was queued
+	if ( vm->state == VMST_QUEUED )
+		vmtable_setstate ( &ctx_p->vmtable, vm, VMST_SPAWNING );
+	else
+		cold->state_at[VMST_SPAWNING] = kvmpool_now_ms();
+
+	// Without them the VM just runs out of the cgroups
+	if ( ctx_p->cgroup_path != NULL && !cold->cgroup )
+		cgroup_create ( ctx_p, vm );
+
+	// A client could claim the VM while it was queued, too
+	if ( cold->cgroup && vm->state == VMST_ATTACHED )
+		cold->cgroup = CGROUP_ACTIVE;
 
-	ctx_p->vms_spare_count++;
-	ctx_p->vms_count++;
-	memset ( vm, 0, sizeof ( *vm ) );
-	vm->vnc_id = new_vnc_id;
 	vm->pid = fork();
 
 	switch ( vm->pid ) {
-		case -1:
-			error ( "Cannot fork()." );
-			return errno;
+		case -1: {
+				rc = errno;
+				error ( "Cannot fork()." );
+				kvmpool_drainvm ( ctx_p, vm );
+
+				// The session (and the client, if any) is closed by the worker
+				if ( proxy_close ( ctx_p, vm ) )
+					kvmpool_closevm ( ctx_p, vm );
+
+				return rc;
+			}
 
 		case  0: {
-				exit ( execvp ( KVM, getargv ( ctx_p, &ctx_p->kvm_args[SHARGS_PRIMARY], vm->vnc_id ) ) );
+				if ( cold->node )
+					numa_bind ( cold->node - 1 );
+
+				if ( cold->cgroup )
+					cgroup_enter ( ctx_p, cold->cgroup, vm->vnc_id );
+
+				exit ( execvp ( KVM, getargv ( ctx_p, &ctx_p->kvm_args[SHARGS_PRIMARY], vm->vnc_id, cold->overlay, NULL ) ) );
 			}
 	}
 
+	vm->pidfd     = kvmpool_pidfd_open ( vm->pid );
+	cold->booting = 1;
+	ctx_p->vms_booting++;
+
+	if ( vm->state == VMST_SPAWNING )
+		vmtable_setstate ( &ctx_p->vmtable, vm, VMST_BOOTING );
+
+	if ( ( rc = proxy_spawned ( ctx_p, vm ) ) ) {
+		kvmpool_closevm ( ctx_p, vm );
+		return rc;
+	}
+
 	return 0;
 }
 
-int kvmpool_prepare_spare_vms ( ctx_t *ctx_p )
+/*
+ * Spawns the queued VMs while less than vms_booting_max VMs boot, so a
+ * burst of clients doesn't start dozens of QEMUs at once (they would
+ * thrash the disks and the CPUs, and every one of them would boot
+ * slower). The rest are spawned in turn as the booting ones become ready
+ * (see kvmpool_vm_booted()), or as the overlays become ready (see
+ * overlay.c). Requires the global lock.
+ */
+static int kvmpool_spawn ( ctx_t *ctx_p )
+{
+	vmtable_t *t = &ctx_p->vmtable;
+	vm_t *vm;
+
+	while ( ctx_p->vms_booting < ctx_p->vms_booting_max && ( vm = t->spawnq.head ) != NULL ) {
+		vm_cold_t *cold = vmtable_cold ( t, vm );
+		int rc;
+
+		if ( ctx_p->overlay_backing != NULL && !cold->overlay ) {
+			int overlay = overlay_take ( ctx_p, 0 );
+
+			if ( overlay < 0 ) {
+				debug ( 5, "No overlays are ready, %i VMs are queued", t->spawnq.count );
+				break;
+			}
+
+			cold->overlay = overlay + 1;
+		}
+
+		vmtable_dequeue ( t, vm );
+
+		if ( ( rc = kvmpool_spawnvm ( ctx_p, vm ) ) )
+			return rc;
+	}
+
+	if ( t->spawnq.count )
+		debug ( 5, "%i VMs are booting, %i are queued", ctx_p->vms_booting, t->spawnq.count );
+
+	return 0;
+}
+
+/*
+ * Queues a spare VM, it's spawned by kvmpool_spawn() when there's a boot
+ * slot. The proxy session is started right away, so a client can be
+ * attached to the VM while it's queued, and the connection to the VM is
+ * made in advance, so a client doesn't wait for the handshake.
+ */
+int kvmpool_runspare ( ctx_t *ctx_p )
+{
+	debug ( 4, "" );
+
+	vm_t *vm = vmtable_alloc ( &ctx_p->vmtable );
+
+	if ( vm == NULL )
+		return ENOMEM;
+
+	__sync_fetch_and_add ( &ctx_p->vms_spare_count, 1 );
+	vmtable_setstate ( &ctx_p->vmtable, vm, VMST_QUEUED );
+
+	// Before proxy_prepare(): the session goes to a worker of the node
+	if ( ctx_p->flags[NUMA] )
+		numa_place ( ctx_p, vm );
+
+	if ( proxy_prepare ( ctx_p, vm ) ) {
+		int rc = errno;
+		kvmpool_closevm ( ctx_p, vm );
+		return rc ? rc : EIO;
+	}
+
+	vmtable_enqueue ( &ctx_p->vmtable, &ctx_p->vmtable.spawnq, vm );
+	// The VM is queued anyway; a failed spawn wakes up the controller to retry
+	kvmpool_spawn ( ctx_p );
+	return 0;
+}
+
+int kvmpool_prepare_spare_vms ( ctx_t *ctx_p, int want )
 {
 	debug ( 18, "" );
 
-	while ( ctx_p->vms_spare_count < ctx_p->vms_spare_min ) {
+	while ( ctx_p->vms_spare_count < want ) {
+		// No room: a closed VM will wake up the controller
+		if ( !ctx_p->vmtable.free_count ) {
+			debug ( 3, "No free slots for spare VMs" );
+			return 0;
+		}
+
 		int rc;
 		rc = kvmpool_runspare ( ctx_p );
 
@@ -210,7 +468,7 @@ int kvmpool_prepare_spare_vms ( ctx_t *ctx_p )
 	return 0;
 }
 
-int ipv4listen ( char *listen_addr ) // TODO: add support of arbitrary hosts
+int ipv4listen ( char *listen_addr, int backlog, int reuseport, int cpu ) // TODO: add support of arbitrary hosts
 {
 	//char *host     = listen_addr;
 	char *port_str = strchr ( listen_addr, ':' );
@@ -222,328 +480,842 @@ int ipv4listen ( char *listen_addr ) // TODO: add support of arbitrary hosts
 	critical_on ( ( sockfd = socket ( AF_INET, SOCK_STREAM, 0 ) ) == -1 );
 	int itrue = 1;
 	critical_on ( setsockopt ( sockfd, SOL_SOCKET, SO_REUSEADDR, &itrue, sizeof ( int ) ) == -1 );
+
+	if ( reuseport )
+		critical_on ( setsockopt ( sockfd, SOL_SOCKET, SO_REUSEPORT, &itrue, sizeof ( int ) ) == -1 );
+
+	// The kernel prefers the socket of the CPU that handles the incoming packets
+	if ( cpu >= 0 && setsockopt ( sockfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof ( cpu ) ) == -1 )
+		warning ( "Cannot set SO_INCOMING_CPU" );
+
 	sin.sin_family		= AF_INET;
 	sin.sin_port		= htons ( port );
 	sin.sin_addr.s_addr	= htonl ( INADDR_ANY ); //inet_addr ( host );
 	memset ( &sin.sin_zero, '\0', 8 );
 	critical_on ( bind ( sockfd, ( struct sockaddr * ) &sin, sizeof ( struct sockaddr ) ) == -1 )
-	critical_on ( listen ( sockfd, BACKLOG ) == -1 );
+	critical_on ( listen ( sockfd, backlog ) == -1 );
+	critical_on ( fcntl ( sockfd, F_SETFL, O_NONBLOCK ) == -1 );
 	return sockfd;
 }
 
-int ipv4connect_s ( const char const *host, const uint16_t port ) // TODO: add support of arbitrary hosts
+// Makes the VM available to acceptors; requires the global lock
+void kvmpool_vm_ready ( ctx_t *ctx_p, vm_t *vm )
 {
-	struct sockaddr_in dest = {0};
-	int sock;
-	SAFE ( ( sock = socket ( AF_INET, SOCK_STREAM, 0 ) ) < 0, return -1 );
-	dest.sin_family = AF_INET;
-	dest.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
-	dest.sin_port = htons ( port );
-	SAFE ( connect ( sock, ( struct sockaddr * ) &dest, sizeof ( struct sockaddr ) ) < 0, return -1 );
-#ifdef USE_SPLICE
-	setsock_nonblock ( sock );
-#endif
-	return sock;
+	proxy_worker_t *worker = vm->worker;
+
+	if ( readyq_push ( &worker->readyq, vmtable_idx ( &ctx_p->vmtable, vm ) ) )
+		debug ( 3, "The ready queue of worker #%i is full", worker->id );	// The VM still can be found by kvmpool_findsparevm()
+
+	return;
+}
+
+/*
+ * Takes a spare VM for a client. Returns non-zero if the VM was in
+ * "state", and it's ATTACHED now. The only state change done without the
+ * global lock, so a READY VM can be moved elsewhere only by a CAS.
+ */
+static int kvmpool_claim ( ctx_t *ctx_p, vm_t *vm, vm_state_t state )
+{
+	if ( !__sync_bool_compare_and_swap ( &vm->state, state, VMST_ATTACHED ) )
+		return 0;
+
+	vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_ATTACHED] = kvmpool_now_ms();
+	__sync_fetch_and_sub ( &ctx_p->vms_spare_count, 1 );
+	cgroup_queue ( ctx_p, vm );
+	return 1;
 }
 
+// Undoes kvmpool_claim() if the client couldn't be passed to the proxy
+static void kvmpool_unclaim ( ctx_t *ctx_p, vm_t *vm, vm_state_t state )
+{
+	if ( !__sync_bool_compare_and_swap ( &vm->state, VMST_ATTACHED, state ) )
+		return;	// Already closed
+
+	__sync_fetch_and_add ( &ctx_p->vms_spare_count, 1 );
+	cgroup_queue ( ctx_p, vm );
+
+	if ( state == VMST_READY )
+		readyq_push ( &vm->worker->readyq, vmtable_idx ( &ctx_p->vmtable, vm ) );
+
+	return;
+}
+
+/*
+ * Prefers the VM that is ready for the longest time, so the attach latency
+ * doesn't depend on luck. If there's no ready VM, the client waits for the
+ * VM that boots for the longest time, or else for the VM that is queued
+ * for the longest time. Requires the global lock.
+ */
 vm_t *kvmpool_findsparevm ( ctx_t *ctx_p )
 {
-	int i = 0;
-	int f = 0;
-	debug ( 15, "ctx_p->vms_count == %i", ctx_p->vms_count );
+	vm_t *vm = vmtable_first ( &ctx_p->vmtable, VMST_READY );
 
-	while ( f < ctx_p->vms_count ) {
-		debug ( 25, "ctx_p->vms[i].pid == %i; ctx_p->vms[i].client_fd == %i", ctx_p->vms[i].pid, ctx_p->vms[i].client_fd );
+	if ( vm == NULL )
+		vm = vmtable_first ( &ctx_p->vmtable, VMST_BOOTING );
 
-		if ( ctx_p->vms[i].pid == 0 ) {
-			i++;
-			continue;
-		}
+	if ( vm == NULL )
+		vm = vmtable_first ( &ctx_p->vmtable, VMST_QUEUED );
 
-		if ( ctx_p->vms[i].client_fd == 0 )
-			return &ctx_p->vms[i];
+	debug ( 15, "vm == %p", vm );
+	return vm;
+}
 
-		f++;
-		i++;
+// Records the exit status of the reaped process of the VM
+void kvmpool_vm_reaped ( ctx_t *ctx_p, vm_t *vm, int status )
+{
+	vmtable_cold ( &ctx_p->vmtable, vm )->exit_status = status;
+	vm->pid = -1;
+
+	if ( WIFEXITED ( status ) ) {
+		debug ( 3, "vm->vnc_id == %i: exited with code %i", vm->vnc_id, WEXITSTATUS ( status ) );
+	} else if ( WIFSIGNALED ( status ) ) {
+		debug ( 3, "vm->vnc_id == %i: killed by signal %i", vm->vnc_id, WTERMSIG ( status ) );
 	}
 
-	return NULL;
+	return;
 }
 
-int kvmpool_closevm ( vm_t *vm )
+/*
+ * The guest of a spawned VM is up (see proxy_boot_start()).
+ * "--max-booting=0" adapts the cap to the host: a boot not slower than
+ * KVMPOOL_BOOT_SLOWDOWN times the baseline (the fastest recent boot) lets
+ * one more VM boot at once if VMs are waiting for a slot and the host is
+ * not overloaded (the load average is below the number of CPUs); a slower
+ * boot halves the cap, but only once per the VMs spawned before the cut
+ * (they were slowed down by the same storm). Requires the global lock.
+ */
+void kvmpool_vm_booted ( ctx_t *ctx_p, vm_t *vm, uint64_t boot_ms )
+{
+	static double baseline;
+	static uint64_t cut_at;
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+	int ncpus;
+	double load;
+
+	if ( !cold->booting )
+		return;	// Not spawned, but reverted ("--recycle")
+
+	cold->booting = 0;
+	ctx_p->vms_booting--;
+	autoscale_booted ( &ctx_p->autoscale, boot_ms );
+
+	if ( ctx_p->vmtable.spawnq.count )
+		kvmpool_ctl_wakeup();	// The next queued VM can be spawned
+
+	if ( ctx_p->flags[MAX_BOOTING] )
+		return;
+
+	if ( !baseline || boot_ms < baseline )
+		baseline = boot_ms;
+
+	if ( boot_ms > baseline * KVMPOOL_BOOT_SLOWDOWN ) {
+		baseline += ( boot_ms - baseline ) / KVMPOOL_BOOT_BASELINE_DRIFT;
+
+		if ( cold->state_at[VMST_SPAWNING] >= cut_at && ctx_p->vms_booting_max > 1 ) {
+			ctx_p->vms_booting_max /= 2;
+			cut_at = kvmpool_now_ms();
+			debug ( 2, "booted in %llu ms (baseline %.0f ms): max booting == %i", ( unsigned long long ) boot_ms, baseline, ctx_p->vms_booting_max );
+		}
+
+		return;
+	}
+
+	baseline += ( boot_ms - baseline ) / KVMPOOL_BOOT_BASELINE_DRIFT;
+	ncpus = sysconf ( _SC_NPROCESSORS_ONLN );
+
+	if ( !ctx_p->vmtable.spawnq.count || ctx_p->vms_booting_max >= 2 * ncpus )
+		return;
+
+	if ( getloadavg ( &load, 1 ) == 1 && load > ncpus )
+		return;
+
+	ctx_p->vms_booting_max++;
+	debug ( 3, "booted in %llu ms (baseline %.0f ms): max booting == %i", ( unsigned long long ) boot_ms, baseline, ctx_p->vms_booting_max );
+	return;
+}
+
+// Closes the connections of the VM, the process is kept
+static void kvmpool_closefds ( vm_t *vm )
 {
 	if ( vm->client_fd ) {
-		close ( vm->client_fd );
+		if ( vm->client_fd > 0 )
+			close ( vm->client_fd );
+
 		vm->client_fd = 0;
 	}
 
+	if ( vm->qmp_fd ) {
+		close ( vm->qmp_fd );
+		vm->qmp_fd = 0;
+	}
+
 	if ( vm->vnc_fd ) {
 		close ( vm->vnc_fd );
 		vm->vnc_fd = 0;
 	}
 
+	return;
+}
+
+/*
+ * "--recycle": a VM whose client is gone is reverted to its clean state
+ * (see recycle.c) instead of being killed, if it's alive and the clean
+ * state is saved. Returns non-zero if the VM is taken (its connections
+ * are closed); the caller has to stop watching its pidfd. Requires the
+ * global lock.
+ */
+int kvmpool_recyclevm ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+
+	if ( ctx_p->recycle_tag == NULL || ctx_p->state != STATE_RUNNING || vm->state != VMST_ATTACHED || vm->pid <= 0 || !cold->clean )
+		return 0;
+
+	autoscale_session ( &ctx_p->autoscale, kvmpool_now_ms() - cold->state_at[VMST_ATTACHED] );
+	kvmpool_closefds ( vm );
+	vmtable_setstate ( &ctx_p->vmtable, vm, VMST_RECYCLING );
+	cgroup_queue ( ctx_p, vm );
+	recycle_push ( ctx_p, vm );
+	return 1;
+}
+
+int kvmpool_closevm ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+
+	if ( vm->state != VMST_FREE && vm->state != VMST_DEAD )
+		kvmpool_drainvm ( ctx_p, vm );
+
+	vmtable_dequeue ( &ctx_p->vmtable, vm );
+
+	if ( cold->booting ) {
+		cold->booting = 0;
+		ctx_p->vms_booting--;
+	}
+
+	kvmpool_closefds ( vm );
+
 	if ( vm->pid > 0 ) {
-		kill ( vm->pid, 9 );
 		int status = 0;
+		kill ( vm->pid, 9 );
 		waitpid ( vm->pid, &status, 0 );
-		vm->pid = -1;
+		kvmpool_vm_reaped ( ctx_p, vm, status );
+	}
+
+	if ( vm->pidfd ) {
+		close ( vm->pidfd );
+		vm->pidfd = 0;
 	}
 
-	if ( vm->buf != NULL ) {
-		free ( vm->buf );
-		vm->buf = NULL;
+	// Nothing writes to it anymore
+	if ( cold->overlay ) {
+		overlay_release ( ctx_p, cold->overlay - 1 );
+		cold->overlay = 0;
+	}
+
+	numa_unplace ( ctx_p, vm );
+	cgroup_remove ( ctx_p, vm );
+
+	// The process is reaped (here or by the proxy worker, see proxy_vm_exited())
+	if ( vm->state == VMST_DRAINING ) {
+		vmtable_setstate ( &ctx_p->vmtable, vm, VMST_DEAD );
+
+		// The VM is killed, so nobody else removes its sockets
+		if ( ctx_p->vnc_transport == VNCT_UNIX ) {
+			char path[PATH_MAX];
+			kvmpool_vncpath ( ctx_p, vm->vnc_id, path, sizeof ( path ) );
+			unlink ( path );
+		}
+
+		if ( ctx_p->flags[HANDOFF] ) {
+			char path[PATH_MAX];
+			kvmpool_qmppath ( ctx_p, vm->vnc_id, path, sizeof ( path ) );
+			unlink ( path );
+		}
+
+		if ( ctx_p->recycle_tag != NULL ) {
+			char path[PATH_MAX];
+			kvmpool_ctlpath ( ctx_p, vm->vnc_id, path, sizeof ( path ) );
+			unlink ( path );
+		}
 	}
 
 	return 0;
 }
 
-static inline int passthrough_dataportion ( int dst, int src, char *buf )
+pthread_mutex_t kvmpool_globalmutex;
+static int kvmpool_ctl_eventfd = -1;
+static int kvmpool_ctl_timerfd = -1;
+
+/*
+ * The fast path: pops a ready VM from the queue of the local worker (or
+ * steals from the others), no locks are taken. The queues may contain
+ * stale entries (VMs that are closed or taken by kvmpool_attach()), they
+ * are just dropped. Returns ENOENT if there's no ready VM.
+ */
+int kvmpool_attach_ready ( ctx_t *ctx_p, int client_fd, proxy_worker_t *local )
 {
-	int r;
-	debug ( 8, "passthrough_dataportion(%i, %i, buf)", dst, src );
+	int i = 0, n = ctx_p->proxy_workers_count;
+	int first = local - ctx_p->proxy_workers;
 
-	while ( 1 ) {
-#ifdef USE_SPLICE
-		debug ( 9,  "splice(%i, NULL, %i, NULL, %i, 0x%x)", src, dst, KVMPOOL_NET_BUFSIZE, SPLICE_F_NONBLOCK );
-		r = splice ( src, NULL, dst, NULL, KVMPOOL_NET_BUFSIZE, SPLICE_F_NONBLOCK );
-		if (r == 0) {
-			error ( "unimplemented case while forwarding a data from %i to %i", src, dst );
-			return -1;
-		}
-		if (r < 0) {
-			error ( "got error while forwarding a data from %i to %i", src, dst );
-			return r;
+	while ( i < n ) {
+		proxy_worker_t *worker = &ctx_p->proxy_workers[( first + i ) % n];
+		int vm_idx;
+
+		if ( readyq_pop ( &worker->readyq, &vm_idx ) ) {
+			i++;
+			continue;
 		}
-#else
-		debug ( 9,  "recv(%i, buf, %i, 0x%x)", src, KVMPOOL_NET_BUFSIZE, MSG_DONTWAIT );
-		errno = 0;
-		r = recv ( src, buf, KVMPOOL_NET_BUFSIZE, MSG_DONTWAIT );
-		debug ( 10, "recv() -> %i", r );
 
-		if ( r == 0 )
-			return -1;
+		vm_t *vm = &ctx_p->vmtable.vms[vm_idx];
 
-		if ( errno == EAGAIN )
-			break;
+		if ( !kvmpool_claim ( ctx_p, vm, VMST_READY ) )
+			continue;
 
-		if ( r < 0 ) {
-			error ( "got error while receiving from fd == %i", src );
-			return r;
-		}
+		debug ( 3, "vm_idx == %i (from worker #%i)", vm_idx, worker->id );
 
-		int s = 0;
-		while (s<r) {
-			debug ( 9, "send(%i, &buf[%i], %i, 0x%x)", dst, s, r-s, 0 );
-			s += send ( dst, &buf[s], r-s, 0 );
+		if ( proxy_attach ( ctx_p, vm, client_fd ) ) {
+			kvmpool_unclaim ( ctx_p, vm, VMST_READY );
+			return EIO;
 		}
 
-		if ( s < 0 ) {
-			error ( "got error while sending to fd == %i", dst );
-			return s;
-		}
+		return 0;
+	}
 
-		if ( s != r ) {
-			error ( "sent (%i) != received (%i)", s, r );
-			return -1;
-		}
+	return ENOENT;
+}
 
-#endif
-	};
+// The slow path: requires the global lock
+int kvmpool_attach ( ctx_t *ctx_p, int client_fd, proxy_worker_t *local )
+{
+	vm_state_t state;
+	vm_t *vm;
+
+	// A ready VM could be claimed by an acceptor meanwhile
+	do {
+		vm = kvmpool_findsparevm ( ctx_p );
+		debug ( 3, "vm == %p", vm );
+
+		if ( vm == NULL )
+			return ENOMEM;
 
-	debug ( 9, "finish" );
+		state = vm->state;
+	} while ( !kvmpool_state_isspare ( state ) || !kvmpool_claim ( ctx_p, vm, state ) );
+
+	if ( proxy_attach ( ctx_p, vm, client_fd ) ) {
+		kvmpool_unclaim ( ctx_p, vm, state );
+		return EIO;
+	}
 
 	return 0;
 }
 
-pthread_mutex_t kvmpool_globalmutex;
+int kvmpool_gc ( ctx_t *ctx_p )
+{
+	vm_t *vm;
+	debug ( 23, "start: ctx_p->vmtable.count == %i; ctx_p->vms_spare_count == %i", ctx_p->vmtable.count, ctx_p->vms_spare_count );
 
-void *kvmpool_connectionhandler ( void *_vm )
+	while ( ( vm = vmtable_first ( &ctx_p->vmtable, VMST_DEAD ) ) != NULL ) {
+		debug ( 30, "vm->vnc_id == %i", vm->vnc_id );
+		vmtable_free ( &ctx_p->vmtable, vm );
+	}
+
+	debug ( 20, "finish: ctx_p->vmtable.count == %i; ctx_p->vms_spare_count == %i", ctx_p->vmtable.count, ctx_p->vms_spare_count );
+	return 0;
+}
+
+/*
+ * Kills up to "n" spare VMs: the queued ones first (they cost nothing),
+ * then the ready ones, the oldest first. A VM is taken by a CAS, so an
+ * acceptor cannot claim it meanwhile; the session (and the VM) is closed
+ * by its proxy worker.
+ */
+static int kvmpool_trim ( ctx_t *ctx_p, int n )
 {
-	vm_t *vm = _vm;
-	debug ( 3, "" );
-	int vnc_fd = 0;
-	int connect_try = 0;
+	int trimmed = 0;
+	vm_t *vm;
 
-	while ( vm->pid > 0 ) {
-		vnc_fd = ipv4connect_s ( "127.0.0.1", vm->vnc_id + 5900 );
+	while ( trimmed < n ) {
+		vm_state_t state = VMST_QUEUED;
 
-		if ( vnc_fd > 0 )
-			break;
+		if ( ( vm = vmtable_first ( &ctx_p->vmtable, state ) ) == NULL )
+			if ( ( vm = vmtable_first ( &ctx_p->vmtable, state = VMST_READY ) ) == NULL )
+				break;
 
-		if ( connect_try > KVMPOOL_CONNECT_TIMEOUT ) {
-			error ( "Cannot connect to 127.0.0.1:%u", vm->vnc_id + 5900 );
-			vnc_fd = 0;
-			break;
-		}
+		// Claimed: vmtable_first() relinks it on the next iteration
+		if ( !__sync_bool_compare_and_swap ( &vm->state, state, VMST_DRAINING ) )
+			continue;
 
-		sleep ( 1 );
-		connect_try++;
-	};
+		__sync_fetch_and_sub ( &ctx_p->vms_spare_count, 1 );
+		vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_DRAINING] = kvmpool_now_ms();
+		vmtable_relink ( &ctx_p->vmtable, vm );
+		vmtable_dequeue ( &ctx_p->vmtable, vm );
+		debug ( 3, "vm->vnc_id == %i", vm->vnc_id );
 
-	pthread_mutex_lock ( &kvmpool_globalmutex );
+		if ( proxy_close ( ctx_p, vm ) )
+			kvmpool_closevm ( ctx_p, vm );
 
-	vm->vnc_fd = vnc_fd;
+		trimmed++;
+	}
 
-	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	return trimmed;
+}
 
-	int max_fd = MAX ( vm->client_fd, vm->vnc_fd ) + 1;
+/*
+ * Brings the pool to the configured bounds: at least min-vms running VMs
+ * (this has priority over max-spare), the spare target (min-spare or the
+ * autoscaler's one, bounded by max-spare) and max-vms (the size of the VM
+ * table). Idempotent and cheap (no scans), so it's run on every event.
+ * Surplus spares are trimmed only if the surplus lasts KVMPOOL_TRIM_DELAY,
+ * so the pool doesn't flap around the target.
+ *
+ * Returns the delay (ms) to run it again after (0 if not needed), or a
+ * negative error code if it has to be retried.
+ */
+static int kvmpool_reconcile ( ctx_t *ctx_p )
+{
+	static uint64_t surplus_since;
+	uint64_t now = kvmpool_now_ms();
+	vmtable_t *t = &ctx_p->vmtable;
+	int attached, want, rc;
 
-	debug ( 3, "vm->client_fd == %i; vm->vnc_fd == %i", vm->client_fd, vm->vnc_fd );
+	SAFE ( kvmpool_gc ( ctx_p ), ( void ) 0 );
 
-	while ( vm->client_fd && vm->vnc_fd ) {
-		fd_set rfds;
-		FD_ZERO ( &rfds );
-		FD_SET ( vm->client_fd, &rfds );
-		FD_SET ( vm->vnc_fd, &rfds );
-		debug ( 7, "select(): vm->client_fd == %i; vm->vnc_fd == %i", vm->client_fd, vm->vnc_fd );
-		int sret = select ( max_fd, &rfds, NULL, NULL, NULL );
-		debug ( 8, "select() -> %i", sret );
+	// The attached VMs get the priority (only the VMs queued by cgroup_queue() are checked)
+	if ( ctx_p->cgroup_path != NULL )
+		cgroup_sync ( ctx_p );
 
-		if ( !sret )
-			continue;
+	if ( ( rc = SAFE ( kvmpool_spawn ( ctx_p ), ( void ) 0 ) ) )
+		return -rc;
 
-		if ( sret < 0 )
-			break;
+	// Not spare, not being reverted and not being closed (the dead ones are already freed by kvmpool_gc())
+	attached = t->count - ctx_p->vms_spare_count - t->lists[VMST_RECYCLING].count - t->lists[VMST_DRAINING].count;
 
-		debug ( 7, "FD_ISSET()s" );
+	// Without "--recycle" the VMs of the leaving clients are killed, they don't come back as spares
+	if ( ctx_p->flags[AUTOSCALE] ) {
+		int recycled = ctx_p->recycle_tag != NULL;
+		autoscale_tick ( &ctx_p->autoscale );
+		ctx_p->vms_spare_target = autoscale_target ( &ctx_p->autoscale, recycled ? attached : 0, recycled ? t->lists[VMST_RECYCLING].count : 0, ctx_p->vms_spare_min, ctx_p->vms_spare_max );
+	}
 
-		if ( FD_ISSET ( vm->client_fd, &rfds ) )
-			if ( passthrough_dataportion ( vm->vnc_fd, vm->client_fd, vm->buf ) )
-				break;
+	want = ctx_p->vms_spare_target;
 
-		if ( FD_ISSET ( vm->vnc_fd, &rfds ) )
-			if ( passthrough_dataportion ( vm->client_fd, vm->vnc_fd, vm->buf ) )
-				break;
+	if ( want < ctx_p->vms_min - attached )
+		want = ctx_p->vms_min - attached;
+
+	debug ( 10, "attached == %i; spare == %i; want == %i", attached, ctx_p->vms_spare_count, want );
+
+	if ( ctx_p->vms_spare_count <= want ) {
+		surplus_since = 0;
+		return -SAFE ( kvmpool_prepare_spare_vms ( ctx_p, want ) , ( void ) 0 );
 	}
 
-	debug ( 3, "finish" );
-	pthread_mutex_lock ( &kvmpool_globalmutex );
-	kvmpool_closevm ( vm );
-	pthread_mutex_unlock ( &kvmpool_globalmutex );
-	return NULL;
-}
+	if ( !surplus_since )
+		surplus_since = now;
 
-int kvmpool_attach ( ctx_t *ctx_p, int client_fd )
-{
-	vm_t *vm = kvmpool_findsparevm ( ctx_p );
-	debug ( 3, "vm == %p", vm );
+	if ( now - surplus_since < KVMPOOL_TRIM_DELAY )
+		return surplus_since + KVMPOOL_TRIM_DELAY - now;
 
-	if ( vm == NULL )
-		return ENOMEM;
+	kvmpool_trim ( ctx_p, ctx_p->vms_spare_count - want );
 
-	ctx_p->vms_spare_count--;
-	vm->client_fd = client_fd;
-	vm->buf = xmalloc ( KVMPOOL_NET_BUFSIZE );
-	pthread_create ( &vm->handler, NULL, kvmpool_connectionhandler, vm );
+	// The booting ones will be trimmed when they are ready
+	if ( ctx_p->vms_spare_count > want ) {
+		surplus_since = now;
+		return KVMPOOL_TRIM_DELAY;
+	}
+
+	surplus_since = 0;
 	return 0;
 }
 
-int kvmpool_gc ( ctx_t *ctx_p )
+// Arms the timer of the controller, 0 disarms it
+static void kvmpool_ctl_timer ( int delay_ms )
 {
-	debug ( 23, "start: ctx_p->vms_count == %i; ctx_p->vms_spare_count == %i", ctx_p->vms_count, ctx_p->vms_spare_count );
-	int i = 0;
-	int f = 0;
+	struct itimerspec its = {{0}};
+	its.it_value.tv_sec  = delay_ms / 1000;
+	its.it_value.tv_nsec = ( delay_ms % 1000 ) * 1000 * 1000;
+	timerfd_settime ( kvmpool_ctl_timerfd, 0, &its, NULL );
+	return;
+}
 
-	while ( f < ctx_p->vms_count ) {
-		debug ( 30, "ctx_p->vms[%i].pid: %i; ctx_p->vms[%i].vnc_id: %i", i, ctx_p->vms[i].pid, i, ctx_p->vms[i].vnc_id );
+/*
+ * The pool controller. It sleeps in epoll_wait() until something changes:
+ * an eventfd is signalled on every attach and every closed VM (including
+ * the exits noticed through pidfds by the proxy workers, see
+ * proxy_vm_exited()), and a timerfd fires only when kvmpool_reconcile()
+ * asks for it (a retry, a trimming delay, or every KVMPOOL_AUTOSCALE_TICK
+ * with "--autoscale"), or for a "--memory-stats" report. So a steady pool
+ * doesn't wake this thread at all.
+ */
+static void *kvmpool_controller ( void *_ctx_p )
+{
+	ctx_t *ctx_p = _ctx_p;
+	struct epoll_event ev = {0};
+	int epoll_fd = epoll_create1 ( EPOLL_CLOEXEC );
+	critical_on ( epoll_fd == -1 );
+	ev.events  = EPOLLIN;
+	ev.data.fd = kvmpool_ctl_eventfd;
+	critical_on ( epoll_ctl ( epoll_fd, EPOLL_CTL_ADD, kvmpool_ctl_eventfd, &ev ) == -1 );
+	ev.data.fd = kvmpool_ctl_timerfd;
+	critical_on ( epoll_ctl ( epoll_fd, EPOLL_CTL_ADD, kvmpool_ctl_timerfd, &ev ) == -1 );
 
-		if ( ctx_p->vms[i].pid == 0 ) {
-			i++;
-			continue;
+	while ( ctx_p->state == STATE_RUNNING ) {
+		struct epoll_event events[2];
+		int n, i = 0, delay;
+		pthread_mutex_lock ( &kvmpool_globalmutex );
+		delay = kvmpool_reconcile ( ctx_p );
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+		if ( delay < 0 ) {
+			debug ( 3, "retrying in %i ms", KVMPOOL_RECONCILE_RETRY );
+			delay = KVMPOOL_RECONCILE_RETRY;
 		}
 
-		if ( ctx_p->vms[i].pid == -1 ) {
-			ctx_p->vms[i].pid = 0;
-			pthread_join ( ctx_p->vms[i].handler, NULL );
-			ctx_p->vms_count--;
-			//if (i != ctx_p->vms_count)
-			//	memcpy ( &ctx_p->vms[i], &ctx_p->vms[ctx_p->vms_count], sizeof ( *ctx_p->vms ) );
+		// The arrival rate decays even if nobody comes
+		if ( ctx_p->flags[AUTOSCALE] && ( !delay || delay > KVMPOOL_AUTOSCALE_TICK ) )
+			delay = KVMPOOL_AUTOSCALE_TICK;
+
+		// Without the lock: it reads /proc/<pid>/smaps_rollup of every VM
+		if ( ctx_p->flags[MEMORY_STATS] ) {
+			int memstat_delay = memstat_tick ( ctx_p );
+
+			if ( !delay || delay > memstat_delay )
+				delay = memstat_delay;
 		}
 
-		f++;
-		i++;
+		kvmpool_ctl_timer ( delay );
+
+		if ( ( n = epoll_wait ( epoll_fd, events, 2, -1 ) ) == -1 ) {
+			if ( errno != EINTR )
+				warning ( "Got error from epoll_wait() in the controller" );
+
+			continue;
+		}
+
+		// Both are counters, reading resets them
+		while ( i < n ) {
+			uint64_t count;
+
+			if ( read ( events[i++].data.fd, &count, sizeof ( count ) ) == -1 && errno != EAGAIN )
+				warning ( "Cannot read an event of the controller" );
+		}
 	}
 
-	debug ( 20, "finish: ctx_p->vms_count == %i; ctx_p->vms_spare_count == %i", ctx_p->vms_count, ctx_p->vms_spare_count );
-	return 0;
+	close ( epoll_fd );
+	return NULL;
 }
 
-int kvmpool_idle ( ctx_t *ctx_p )
+// Asks the controller to reconcile the pool right now (a spare VM is taken, or a VM is closed)
+void kvmpool_ctl_wakeup()
 {
-	SAFE ( kvmpool_gc ( ctx_p ), ( void ) 0 );
-	SAFE ( kvmpool_prepare_spare_vms ( ctx_p ) , ( void ) 0 );
-	return 0;
+	uint64_t one = 1;
+
+	if ( write ( kvmpool_ctl_eventfd, &one, sizeof ( one ) ) == -1 )
+		warning ( "Cannot wake up the controller" );
+
+	return;
 }
 
-void *kvmpool_idlehandler ( void *_ctx_p )
+/*
+ * Accepted connections are drained in batches (up to KVMPOOL_ACCEPT_BATCH).
+ * Ready VMs are taken without locks, so a fork() or waitpid() under the
+ * global lock doesn't delay the clients; the lock is taken (once per batch)
+ * only if there's no ready VM.
+ */
+static void *kvmpool_acceptor_loop ( void *_acceptor )
 {
-	ctx_t *ctx_p = _ctx_p;
-	int i = 0;
+	kvmpool_acceptor_t *acceptor = _acceptor;
+	ctx_t *ctx_p = acceptor->ctx_p;
+	struct pollfd pfd = {0};
+	int fds[KVMPOOL_ACCEPT_BATCH];
+	pfd.fd     = acceptor->fd;
+	pfd.events = POLLIN;
+	debug ( 2, "acceptor #%i: cpu == %i", acceptor->id, acceptor->cpu );
 
 	while ( ctx_p->state == STATE_RUNNING ) {
-		usleep ( 100000 );
+		int i = 0, n = 0;
+
+		if ( poll ( &pfd, 1, -1 ) < 0 ) {
+			if ( errno != EINTR )
+				warning ( "Got error from poll() in acceptor #%i", acceptor->id );
+
+			continue;
+		}
+
+		while ( n < KVMPOOL_ACCEPT_BATCH ) {
+			int client_fd = accept4 ( acceptor->fd, NULL, NULL, SOCK_CLOEXEC );
+
+			if ( client_fd < 0 ) {
+				if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+					warning ( "client_fd == %i", client_fd );
+
+				break;
+			}
+
+			fds[n++] = client_fd;
+		}
+
+		debug ( 5, "acceptor #%i: %i clients", acceptor->id, n );
+		autoscale_arrivals ( &ctx_p->autoscale, n );
+
+		if ( !n )
+			continue;
+
+		while ( i < n ) {
+			int rc = kvmpool_attach_ready ( ctx_p, fds[i], acceptor->worker );
 
-		if ( ! ( i++ % 10 ) ) {
+			if ( rc == ENOENT )
+				break;
+
+			if ( rc )
+				close ( fds[i] );
+
+			i++;
+		}
+
+		if ( i < n ) {
 			pthread_mutex_lock ( &kvmpool_globalmutex );
-			kvmpool_idle ( ctx_p );
+			kvmpool_gc ( ctx_p );
+
+			while ( i < n ) {
+				int client_fd = fds[i++];
+
+				if ( ctx_p->vms_spare_count == 0 )
+					if ( kvmpool_runspare ( ctx_p ) ) {
+						close ( client_fd );
+						continue;
+					}
+
+				if ( kvmpool_attach ( ctx_p, client_fd, acceptor->worker ) )
+					close ( client_fd );
+			}
+
 			pthread_mutex_unlock ( &kvmpool_globalmutex );
 		}
+
+		kvmpool_ctl_wakeup();
 	}
 
 	return NULL;
 }
 
+/*
+ * "--acceptors": every acceptor has its own socket bound with SO_REUSEPORT,
+ * so the kernel spreads the connections among them. If there's more than
+ * one acceptor, the acceptor is pinned to the CPU of its proxy worker.
+ */
+static void kvmpool_acceptors_init ( ctx_t *ctx_p )
+{
+	int count = ctx_p->flags[ACCEPTORS];
+	int i = 0;
+	ctx_p->acceptors_count = count;
+	ctx_p->acceptors = xcalloc ( count, sizeof ( *ctx_p->acceptors ) );
+
+	while ( i < count ) {
+		kvmpool_acceptor_t *acceptor = &ctx_p->acceptors[i];
+		acceptor->ctx_p  = ctx_p;
+		acceptor->id     = i;
+		acceptor->worker = &ctx_p->proxy_workers[i % ctx_p->proxy_workers_count];
+		acceptor->cpu    = acceptor->worker->cpu;
+		acceptor->fd     = ipv4listen ( ctx_p->listen_addr, ctx_p->flags[LISTEN_BACKLOG], count > 1, acceptor->cpu );
+		i++;
+	}
+
+	return;
+}
+
+/*
+ * "--snapshot": boots a template VM (with a VNC id of the pool, it's free
+ * again afterwards) and saves its state (see snapshot_save()). The pool
+ * VMs are restored from the snapshot ("-incoming", see getargv()). An
+ * existing snapshot is reused, it has to be removed if the VM arguments or
+ * the image change.
+ */
+static int kvmpool_snapshot ( ctx_t *ctx_p )
+{
+	char qmp_path[PATH_MAX], ram_path[PATH_MAX];
+	int rc, status, overlay = 0;
+	vm_t *vm;
+	pid_t pid;
+	kvmpool_rampath ( ctx_p, ram_path, sizeof ( ram_path ) );
+
+	if ( !access ( ctx_p->snapshot_path, R_OK ) && ( ctx_p->memory_template == NULL || !access ( ram_path, R_OK ) ) ) {
+		debug ( 1, "Using the existing snapshot \"%s\"", ctx_p->snapshot_path );
+		return 0;
+	}
+
+	// The snapshot doesn't contain the RAM, so an old RAM file doesn't match it
+	if ( ctx_p->memory_template != NULL )
+		unlink ( ram_path );
+
+	if ( ctx_p->overlay_backing != NULL ) {
+		pthread_mutex_lock ( &kvmpool_globalmutex );
+		overlay = overlay_take ( ctx_p, 1 ) + 1;
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+		if ( !overlay )
+			return EIO;
+	}
+
+	vm = vmtable_alloc ( &ctx_p->vmtable );
+	snprintf ( qmp_path, sizeof ( qmp_path ), "%s/template.qmp", ctx_p->runtime_dir );
+	debug ( 1, "Starting the template VM (vnc_id == %i)", vm->vnc_id );
+
+	switch ( ( pid = fork() ) ) {
+		case -1:
+			rc = errno;
+			error ( "Cannot fork()." );
+			break;
+
+		case  0: {
+				exit ( execvp ( KVM, getargv ( ctx_p, &ctx_p->kvm_args[SHARGS_PRIMARY], vm->vnc_id, overlay, qmp_path ) ) );
+			}
+
+		default:
+			rc = snapshot_save ( ctx_p, pid, qmp_path );
+			kill ( pid, 9 );
+			waitpid ( pid, &status, 0 );
+			unlink ( qmp_path );
+			break;
+	}
+
+	// Restored VMs get overlays of their own, the template's one is of no use
+	if ( overlay ) {
+		pthread_mutex_lock ( &kvmpool_globalmutex );
+		overlay_release ( ctx_p, overlay - 1 );
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+	}
+
+	if ( ctx_p->vnc_transport == VNCT_UNIX ) {
+		char path[PATH_MAX];
+		kvmpool_vncpath ( ctx_p, vm->vnc_id, path, sizeof ( path ) );
+		unlink ( path );
+	}
+
+	if ( ctx_p->flags[GUEST_AGENT] ) {
+		char path[PATH_MAX];
+		kvmpool_agentpath ( ctx_p, vm->vnc_id, path, sizeof ( path ) );
+		unlink ( path );
+	}
+
+	vmtable_free ( &ctx_p->vmtable, vm );
+	return rc;
+}
+
 int kvmpool ( ctx_t *ctx_p )
 {
 	debug ( 2, "" );
-	ctx_p->vms = xcalloc ( ctx_p->vms_max, sizeof ( ctx_p->vms ) );
-	SAFE ( kvmpool_prepare_spare_vms ( ctx_p ) , return _SAFE_rc );
-	ctx_p->listen_fd = ipv4listen ( ctx_p->listen_addr );
-	ctx_p->state = STATE_RUNNING;
-	pthread_t idlehandler;
-	pthread_create ( &idlehandler, NULL, kvmpool_idlehandler, ctx_p );
+	vmtable_init ( &ctx_p->vmtable, ctx_p->vms_max, ctx_p->flags[VNC_ID_BASE] );
+	autoscale_init ( &ctx_p->autoscale, ctx_p->flags[BOOT_DELAY] * 1000ULL );
+	ctx_p->vms_spare_target = ctx_p->vms_spare_min;
+	ctx_p->vms_booting_max  = ctx_p->flags[MAX_BOOTING] ? ctx_p->flags[MAX_BOOTING] : sysconf ( _SC_NPROCESSORS_ONLN );
+
+	if ( ctx_p->vnc_transport == VNCT_UNIX || ctx_p->flags[HANDOFF] || ctx_p->flags[GUEST_AGENT] || ctx_p->snapshot_path != NULL || ctx_p->recycle_tag != NULL || ctx_p->overlay_backing != NULL )
+		if ( mkdir ( ctx_p->runtime_dir, 0700 ) && errno != EEXIST ) {
+			error ( "Cannot create the runtime directory \"%s\"", ctx_p->runtime_dir );
+			return errno;
+		}
 
-	while ( ctx_p->state == STATE_RUNNING ) {
-		int client_fd = accept ( ctx_p->listen_fd, NULL, NULL );
+	if ( ctx_p->cgroup_path != NULL ) {
+		int rc = cgroup_init ( ctx_p );
 
-		if ( client_fd < 0 ) {
-			warning ( "client_fd == %i", client_fd );
-			continue;
+		if ( rc ) {
+			error ( "Cannot set up the cgroups in \"%s\"", ctx_p->cgroup_path );
+			return rc;
+		}
+	}
+
+	// Before the template VM: it needs an overlay, too
+	if ( ctx_p->overlay_backing != NULL )
+		critical_on ( overlay_init ( ctx_p ) );
+
+	if ( ctx_p->snapshot_path != NULL ) {
+		int rc = kvmpool_snapshot ( ctx_p );
+
+		if ( rc ) {
+			error ( "Cannot create the snapshot \"%s\"", ctx_p->snapshot_path );
+			overlay_stop ( ctx_p );
+			overlay_deinit ( ctx_p );
+			return rc;
 		}
+	}
 
-		pthread_mutex_lock ( &kvmpool_globalmutex );
-		kvmpool_idle ( ctx_p );
+	// Closed VMs signal it since the very beginning
+	critical_on ( ( kvmpool_ctl_eventfd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) == -1 );
+	critical_on ( ( kvmpool_ctl_timerfd = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) == -1 );
+	// The proxy workers are required to prepare spare VMs
+	ctx_p->state = STATE_RUNNING;
 
-		if ( ctx_p->vms_spare_count == 0 )
-			if ( kvmpool_runspare ( ctx_p ) ) {
-				close ( client_fd );
-				pthread_mutex_unlock ( &kvmpool_globalmutex );
-				continue;
-			}
+	// The workers are spread over the nodes
+	if ( ctx_p->flags[NUMA] )
+		critical_on ( numa_init ( ctx_p ) );
 
-#ifdef USE_SPLICE
-		setsock_nonblock ( client_fd );
-#endif
+	proxy_init ( ctx_p );
 
-		if ( kvmpool_attach ( ctx_p, client_fd ) )
-			close ( client_fd );
+	if ( ctx_p->recycle_tag != NULL )
+		critical_on ( recycle_init ( ctx_p ) );
 
-		pthread_mutex_unlock ( &kvmpool_globalmutex );
+	// The workers already change states of the VMs
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	int rc = kvmpool_reconcile ( ctx_p );
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+	if ( rc < 0 )
+		return -rc;
+
+	kvmpool_acceptors_init ( ctx_p );
+	pthread_t controller;
+	critical_on ( pthread_create ( &controller, NULL, kvmpool_controller, ctx_p ) );
+	int i = 1;
+
+	// The acceptor #0 runs in this thread
+	while ( i < ctx_p->acceptors_count ) {
+		kvmpool_acceptor_t *acceptor = &ctx_p->acceptors[i++];
+		critical_on ( pthread_create ( &acceptor->thread, NULL, kvmpool_acceptor_loop, acceptor ) );
+
+		if ( acceptor->cpu >= 0 )
+			pthread_setaffinity_cpu ( acceptor->thread, acceptor->cpu );
 	}
 
+	if ( ctx_p->acceptors[0].cpu >= 0 )
+		pthread_setaffinity_cpu ( pthread_self(), ctx_p->acceptors[0].cpu );
+
+	kvmpool_acceptor_loop ( &ctx_p->acceptors[0] );
 	ctx_p->state = STATE_EXIT;
-	int i = 0;
+	i = 1;
 
-	while ( i < ctx_p->vms_count )
-		kvmpool_closevm ( &ctx_p->vms[i++] );
+	while ( i < ctx_p->acceptors_count )
+		pthread_join ( ctx_p->acceptors[i++].thread, NULL );
+
+	kvmpool_ctl_wakeup();
+	pthread_join ( controller, NULL );
+	recycle_deinit ( ctx_p );
+	overlay_stop ( ctx_p );
+	proxy_deinit ( ctx_p );
+	i = 0;
+
+	while ( i < ctx_p->vmtable.size )
+		kvmpool_closevm ( ctx_p, &ctx_p->vmtable.vms[i++] );
 
-	ctx_p->vms_count = 0;
 	ctx_p->vms_spare_count = 0;
-	close ( ctx_p->listen_fd );
-	free ( ctx_p->vms );
-	ctx_p->vms = NULL;
+	overlay_deinit ( ctx_p );
+	i = 0;
+
+	while ( i < ctx_p->acceptors_count )
+		close ( ctx_p->acceptors[i++].fd );
+
+	free ( ctx_p->acceptors );
+	ctx_p->acceptors = NULL;
+	vmtable_deinit ( &ctx_p->vmtable );
+	numa_deinit ( ctx_p );
+
+	if ( ctx_p->cgroup_path != NULL )
+		cgroup_deinit ( ctx_p );
+
+	close ( kvmpool_ctl_eventfd );
+	close ( kvmpool_ctl_timerfd );
+	kvmpool_ctl_eventfd = kvmpool_ctl_timerfd = -1;
 	debug ( 2, "finish" );
-	pthread_join ( idlehandler, NULL );
 	return 0;
 }
 
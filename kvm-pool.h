@@ -23,9 +23,50 @@
 
 #include "common.h"
 
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
 #include "ctx.h"
 #include "malloc.h"
 
+extern pthread_mutex_t kvmpool_globalmutex;
+
+// A thread accepting clients on its own SO_REUSEPORT socket
+struct kvmpool_acceptor {
+	ctx_t			*ctx_p;
+	int			 id;
+	int			 fd;
+	int			 cpu;		// -1 if not pinned
+	pthread_t		 thread;
+	struct proxy_worker	*worker;	// Spare VMs of this worker are preferred
+};
+typedef struct kvmpool_acceptor kvmpool_acceptor_t;
+
+static inline uint64_t kvmpool_now_ms()
+{
+	struct timespec ts;
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ( uint64_t ) ts.tv_sec * 1000 + ts.tv_nsec / ( 1000 * 1000 );
+}
+
+// Queued, spawning, booting or ready VMs are the spare ones
+static inline int kvmpool_state_isspare ( vm_state_t state )
+{
+	return state == VMST_QUEUED || state == VMST_SPAWNING || state == VMST_BOOTING || state == VMST_READY;
+}
+
+extern void kvmpool_vm_ready ( ctx_t *ctx_p, vm_t *vm );
+extern void kvmpool_vm_booted ( ctx_t *ctx_p, vm_t *vm, uint64_t boot_ms );
+extern int kvmpool_vncpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size );
+extern int kvmpool_qmppath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size );
+extern int kvmpool_ctlpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size );
+extern int kvmpool_agentpath ( ctx_t *ctx_p, int vnc_id, char *path, size_t path_size );
+extern int kvmpool_rampath ( ctx_t *ctx_p, char *path, size_t path_size );
+extern int kvmpool_recyclevm ( ctx_t *ctx_p, vm_t *vm );
+extern void kvmpool_vm_reaped ( ctx_t *ctx_p, vm_t *vm, int status );
+extern int kvmpool_closevm ( ctx_t *ctx_p, vm_t *vm );
+extern void kvmpool_ctl_wakeup();
 extern int kvmpool ( ctx_t *ctx_p );
 
 #endif
@@ -5,6 +5,10 @@
 #	define MAX(a, b) ((a)>(b)?(a):(b))
 #endif
 
+#ifndef MIN
+#	define MIN(a, b) ((a)<(b)?(a):(b))
+#endif
+
 #ifdef _DEBUG
 #	define DEBUGV(...) __VA_ARGS__
 #else
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/prctl.h>
+#include <sys/un.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -53,10 +54,46 @@ static const struct option long_options[] = {
 	{"kill-vm-on-disconnect", required_argument,	NULL,	KILL_ON_DISCONNECT},
 	{"listen",		required_argument,	NULL,	LISTEN},
 	{"output-method",	required_argument,	NULL,	OUTPUT_METHOD},
+	{"proxy-workers",	required_argument,	NULL,	PROXY_WORKERS},
+	{"io-backend",		required_argument,	NULL,	IO_BACKEND},
+	{"hugepages",		required_argument,	NULL,	HUGEPAGES},
+	{"vnc-transport",	required_argument,	NULL,	VNC_TRANSPORT},
+	{"runtime-dir",		required_argument,	NULL,	RUNTIME_DIR},
+	{"handoff",		required_argument,	NULL,	HANDOFF},
+	{"acceptors",		required_argument,	NULL,	ACCEPTORS},
+	{"listen-backlog",	required_argument,	NULL,	LISTEN_BACKLOG},
+	{"vnc-id-base",		required_argument,	NULL,	VNC_ID_BASE},
+	{"mac-prefix",		required_argument,	NULL,	MAC_PREFIX},
+	{"autoscale",		required_argument,	NULL,	AUTOSCALE},
+	{"max-booting",		required_argument,	NULL,	MAX_BOOTING},
+	{"snapshot",		required_argument,	NULL,	SNAPSHOT},
+	{"snapshot-delay",	required_argument,	NULL,	SNAPSHOT_DELAY},
+	{"recycle",		required_argument,	NULL,	RECYCLE},
+	{"overlay-backing",	required_argument,	NULL,	OVERLAY_BACKING},
+	{"overlay-backing-format", required_argument,	NULL,	OVERLAY_FORMAT},
+	{"overlay-dir",		required_argument,	NULL,	OVERLAY_DIR},
+	{"memory-template",	required_argument,	NULL,	MEMORY_TEMPLATE},
+	{"memory-stats",	required_argument,	NULL,	MEMORY_STATS},
+	{"numa",		required_argument,	NULL,	NUMA},
+	{"cgroup",		required_argument,	NULL,	CGROUP},
+	{"cgroup-spare-cpu",	required_argument,	NULL,	CGROUP_SPARE_CPU},
+	{"guest-agent",		required_argument,	NULL,	GUEST_AGENT},
+	{"boot-delay",		required_argument,	NULL,	BOOT_DELAY},
 
 	{NULL,			0,			NULL,	0}
 };
 
+static const char *const io_backends[IOB_MAX] = {
+	[IOB_RECV]	= "recv",
+	[IOB_SPLICE]	= "splice",
+	[IOB_IO_URING]	= "io_uring",
+};
+
+static const char *const vnc_transports[VNCT_MAX] = {
+	[VNCT_TCP]	= "tcp",
+	[VNCT_UNIX]	= "unix",
+};
+
 int syntax()
 {
 	info ( "possible options:" );
@@ -515,6 +552,88 @@ static int parse_parameter ( ctx_t *ctx_p, uint16_t param_id, char *arg, paramso
 			strncpy ( ctx_p->listen_addr, arg, sizeof ( ctx_p->listen_addr ) - 1 );
 			break;
 
+		case IO_BACKEND: {
+				int io_backend = 0;
+
+				while ( io_backend < IOB_MAX && strcmp ( arg, io_backends[io_backend] ) )
+					io_backend++;
+
+				if ( io_backend == IOB_MAX ) {
+					error ( "Unknown io-backend: \"%s\"", arg );
+					ret = EINVAL;
+					break;
+				}
+
+				ctx_p->io_backend = io_backend;
+				break;
+			}
+
+		case VNC_TRANSPORT: {
+				int vnc_transport = 0;
+
+				while ( vnc_transport < VNCT_MAX && strcmp ( arg, vnc_transports[vnc_transport] ) )
+					vnc_transport++;
+
+				if ( vnc_transport == VNCT_MAX ) {
+					error ( "Unknown vnc-transport: \"%s\"", arg );
+					ret = EINVAL;
+					break;
+				}
+
+				ctx_p->vnc_transport = vnc_transport;
+				break;
+			}
+
+		case RUNTIME_DIR:
+			ctx_p->runtime_dir	= arg;
+			break;
+
+		case SNAPSHOT:
+			ctx_p->snapshot_path	= *arg ? arg : NULL;
+			break;
+
+		case RECYCLE:
+			ctx_p->recycle_tag	= *arg ? arg : NULL;
+			break;
+
+		case OVERLAY_BACKING:
+			ctx_p->overlay_backing	= *arg ? arg : NULL;
+			break;
+
+		case OVERLAY_FORMAT:
+			ctx_p->overlay_format	= arg;
+			break;
+
+		case OVERLAY_DIR:
+			ctx_p->overlay_dir	= *arg ? arg : NULL;
+			break;
+
+		case MEMORY_TEMPLATE:
+			ctx_p->memory_template	= *arg ? arg : NULL;
+			break;
+
+		case CGROUP:
+			ctx_p->cgroup_path	= *arg ? arg : NULL;
+			break;
+
+		case MAC_PREFIX: {
+				unsigned char *p = ctx_p->mac_prefix;
+				int len = 0;
+
+				if ( sscanf ( arg, "%2hhx:%2hhx:%2hhx%n", &p[0], &p[1], &p[2], &len ) != 3 || arg[len] ) {
+					error ( "Invalid mac-prefix (expected \"xx:xx:xx\"): \"%s\"", arg );
+					ret = EINVAL;
+					break;
+				}
+
+				if ( p[0] & 1 ) {
+					error ( "mac-prefix is a multicast address: \"%s\"", arg );
+					ret = EINVAL;
+				}
+
+				break;
+			}
+
 		default:
 			if ( arg == NULL )
 				ctx_p->flags[param_id]++;
@@ -734,6 +853,136 @@ int ctx_check ( ctx_t *ctx_p )
 		error ( "required: max-spare <= max-vms" );
 	}
 
+#ifndef IO_URING_SUPPORT
+
+	if ( ctx_p->io_backend == IOB_IO_URING ) {
+		ret = errno = EINVAL;
+		error ( "kvm-pool was compiled without io_uring support" );
+	}
+
+#endif
+
+	if ( ctx_p->flags[PROXY_WORKERS] < 1 ) {
+		ret = errno = EINVAL;
+		error ( "required: proxy-workers >= 1" );
+	}
+
+	if ( ctx_p->flags[ACCEPTORS] < 1 ) {
+		ret = errno = EINVAL;
+		error ( "required: acceptors >= 1" );
+	}
+
+	if ( ctx_p->flags[LISTEN_BACKLOG] < 1 ) {
+		ret = errno = EINVAL;
+		error ( "required: listen-backlog >= 1" );
+	}
+
+	if ( ctx_p->flags[MAX_BOOTING] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: max-booting >= 0" );
+	}
+
+	if ( ctx_p->flags[BOOT_DELAY] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: boot-delay >= 0" );
+	}
+
+	// Without them the boot time is measured up to the VNC handshake only, the guest is still in its firmware then
+	if ( ctx_p->flags[AUTOSCALE] && !ctx_p->flags[GUEST_AGENT] && !ctx_p->flags[BOOT_DELAY] ) {
+		ret = errno = EINVAL;
+		error ( "autoscale requires guest-agent or boot-delay" );
+	}
+
+	// The boot slots are released at the VNC handshake then, when the guest is still in its firmware
+	if ( !ctx_p->flags[GUEST_AGENT] && !ctx_p->flags[BOOT_DELAY] && !ctx_p->flags[MAX_BOOTING] )
+		warning ( "The adaptive max-booting measures the boots up to the VNC handshake only, consider guest-agent or boot-delay" );
+
+	if ( ctx_p->flags[SNAPSHOT_DELAY] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: snapshot-delay >= 0" );
+	}
+
+	if ( ctx_p->snapshot_path != NULL && strlen ( ctx_p->snapshot_path ) + sizeof ( ".tmp" ) > PATH_MAX ) {
+		ret = errno = EINVAL;
+		error ( "snapshot path has to be shorter than PATH_MAX: \"%s\"", ctx_p->snapshot_path );
+	}
+
+	if ( ctx_p->flags[VNC_ID_BASE] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: vnc-id-base >= 0" );
+	} else if ( ( long ) ctx_p->flags[VNC_ID_BASE] + ctx_p->vms_max - 1 > KVMPOOL_VNC_ID_MAX ) {
+		ret = errno = EINVAL;
+		error ( "required: vnc-id-base + max-vms - 1 <= %i (MAC suffixes are 24 bits)", KVMPOOL_VNC_ID_MAX );
+	} else if ( ctx_p->vnc_transport == VNCT_TCP && KVMPOOL_VNC_PORT_BASE + ctx_p->flags[VNC_ID_BASE] + ctx_p->vms_max - 1 > 65535 ) {
+		ret = errno = EINVAL;
+		error ( "required: vnc-id-base + max-vms - 1 <= %i with vnc-transport \"tcp\" (VNC port is 5900+<id>), consider vnc-transport \"unix\"", 65535 - KVMPOOL_VNC_PORT_BASE );
+	}
+
+	// It's a HMP argument ("savevm <tag>") within a JSON string
+	if ( ctx_p->recycle_tag != NULL && ( strlen ( ctx_p->recycle_tag ) > 64 || strspn ( ctx_p->recycle_tag, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.-" ) != strlen ( ctx_p->recycle_tag ) ) ) {
+		ret = errno = EINVAL;
+		error ( "recycle snapshot tag has to be up to 64 letters, digits, \"_\", \".\" or \"-\": \"%s\"", ctx_p->recycle_tag );
+	}
+
+	if ( ctx_p->memory_template != NULL ) {
+		size_t len = strspn ( ctx_p->memory_template, "0123456789" );
+
+		if ( !len || ( ctx_p->memory_template[len] && ( strchr ( "KMGT", ctx_p->memory_template[len] ) == NULL || ctx_p->memory_template[len + 1] ) ) ) {
+			ret = errno = EINVAL;
+			error ( "memory-template has to be a size, like \"512M\" or \"2G\": \"%s\"", ctx_p->memory_template );
+		}
+
+		if ( ctx_p->snapshot_path == NULL ) {
+			ret = errno = EINVAL;
+			error ( "memory-template requires snapshot" );
+		} else if ( strchr ( ctx_p->snapshot_path, ',' ) != NULL ) {	// "-object memory-backend-file,mem-path=<snapshot>.ram,..."
+			ret = errno = EINVAL;
+			error ( "snapshot path cannot contain commas with memory-template: \"%s\"", ctx_p->snapshot_path );
+		}
+	}
+
+	if ( ctx_p->flags[MEMORY_STATS] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: memory-stats >= 0" );
+	}
+
+	if ( ctx_p->cgroup_path != NULL && *ctx_p->cgroup_path != '/' ) {
+		ret = errno = EINVAL;
+		error ( "cgroup has to be an absolute path (like \"/sys/fs/cgroup/kvm-pool\"): \"%s\"", ctx_p->cgroup_path );
+	}
+
+	if ( ctx_p->flags[CGROUP_SPARE_CPU] < 0 ) {
+		ret = errno = EINVAL;
+		error ( "required: cgroup-spare-cpu >= 0" );
+	}
+
+	if ( ctx_p->overlay_backing != NULL ) {
+		if ( ctx_p->overlay_dir == NULL )
+			ctx_p->overlay_dir = ctx_p->runtime_dir;
+
+		// QEMU resolves a relative backing file name against the overlay directory
+		if ( *ctx_p->overlay_backing != '/' ) {
+			ret = errno = EINVAL;
+			error ( "overlay-backing has to be an absolute path: \"%s\"", ctx_p->overlay_backing );
+		}
+
+		// "%OVERLAY%" is usually a part of "-drive file=...,..."
+		if ( strchr ( ctx_p->overlay_dir, ',' ) != NULL || strlen ( ctx_p->overlay_dir ) + sizeof ( "/overlay-2147483647.qcow2" ) > PATH_MAX ) {
+			ret = errno = EINVAL;
+			error ( "overlay-dir cannot contain commas and has to be shorter than PATH_MAX: \"%s\"", ctx_p->overlay_dir );
+		}
+	}
+
+	if ( ctx_p->vnc_transport == VNCT_UNIX || ctx_p->flags[HANDOFF] || ctx_p->flags[GUEST_AGENT] || ctx_p->snapshot_path != NULL || ctx_p->recycle_tag != NULL ) {
+		struct sockaddr_un sun;
+
+		// "<runtime-dir>/vm-<vnc_id>.sock" (and ".qmp", ".agent") has to fit into sun_path
+		if ( strlen ( ctx_p->runtime_dir ) + sizeof ( "/vm-2147483647.agent" ) > sizeof ( sun.sun_path ) ) {
+			ret = errno = ENAMETOOLONG;
+			error ( "runtime-dir is too long for unix sockets: \"%s\"", ctx_p->runtime_dir );
+		}
+	}
+
 	return ret;
 }
 
@@ -887,8 +1136,27 @@ int main ( int _argc, char *_argv[] )
 	ctx_p->vms_spare_min			 = DEFAULT_VMS_SPARE_MIN;
 	ctx_p->vms_spare_max			 = DEFAULT_VMS_SPARE_MAX;
 	strncpy ( ctx_p->listen_addr, strdup ( DEFAULT_LISTEN ), 256 );
+	ctx_p->io_backend			 = DEFAULT_IO_BACKEND;
+	ctx_p->vnc_transport			 = DEFAULT_VNC_TRANSPORT;
+	ctx_p->runtime_dir			 = DEFAULT_RUNTIME_DIR;
+	ctx_p->overlay_format			 = DEFAULT_OVERLAY_FORMAT;
 	ctx_p->flags[KILL_ON_DISCONNECT]	 = DEFAULT_KILL_ON_DISCONNECT;
+	ctx_p->flags[HUGEPAGES]			 = DEFAULT_HUGEPAGES;
+	ctx_p->flags[HANDOFF]			 = DEFAULT_HANDOFF;
+	ctx_p->flags[ACCEPTORS]			 = DEFAULT_ACCEPTORS;
+	ctx_p->flags[LISTEN_BACKLOG]		 = DEFAULT_LISTEN_BACKLOG;
+	ctx_p->flags[VNC_ID_BASE]		 = DEFAULT_VNC_ID_BASE;
+	ctx_p->flags[AUTOSCALE]			 = DEFAULT_AUTOSCALE;
+	ctx_p->flags[MAX_BOOTING]		 = DEFAULT_MAX_BOOTING;
+	ctx_p->flags[SNAPSHOT_DELAY]		 = DEFAULT_SNAPSHOT_DELAY;
+	ctx_p->flags[MEMORY_STATS]		 = DEFAULT_MEMORY_STATS;
+	ctx_p->flags[NUMA]			 = DEFAULT_NUMA;
+	ctx_p->flags[CGROUP_SPARE_CPU]		 = DEFAULT_CGROUP_SPARE_CPU;
+	ctx_p->flags[GUEST_AGENT]		 = DEFAULT_GUEST_AGENT;
+	ctx_p->flags[BOOT_DELAY]		 = DEFAULT_BOOT_DELAY;
+	sscanf ( DEFAULT_MAC_PREFIX, "%hhx:%hhx:%hhx", &ctx_p->mac_prefix[0], &ctx_p->mac_prefix[1], &ctx_p->mac_prefix[2] );
 	ncpus					 = sysconf ( _SC_NPROCESSORS_ONLN ); // Get number of available logical CPUs
+	ctx_p->flags[PROXY_WORKERS]		 = ncpus;
 	memory_init();
 	ctx_p->pid				 = getpid();
 	int quiet = 0, verbose = 3;
@@ -0,0 +1,134 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements "--memory-stats": the memory of every VM is
+ * reported periodically, split to the pages shared with other processes
+ * (with "--memory-template", mostly the guest pages left intact since the
+ * snapshot) and the private ones (written by the guest, and QEMU itself).
+ * It's taken from /proc/<pid>/smaps_rollup, so the lock is only held to
+ * list the VMs. With "--cgroup" the CPU time and the I/O of the VMs are
+ * reported, too (see cgroup_usage()).
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "memstat.h"
+
+#include "cgroup.h"
+#include "error.h"
+#include "kvm-pool.h"
+#include "malloc.h"
+
+struct memstat_vm {
+	int		 vnc_id;
+	pid_t		 pid;
+};
+
+// In KiB; returns -1 if the process is gone
+static int memstat_read ( pid_t pid, unsigned long *shared, unsigned long *private )
+{
+	char path[64], line[256];
+	unsigned long kb;
+	FILE *f;
+	snprintf ( path, sizeof ( path ), "/proc/%i/smaps_rollup", pid );
+
+	if ( ( f = fopen ( path, "r" ) ) == NULL )
+		return -1;
+
+	*shared = *private = 0;
+
+	while ( fgets ( line, sizeof ( line ), f ) != NULL ) {
+		if ( sscanf ( line, "Shared_%*[A-Za-z]: %lu kB", &kb ) == 1 )
+			*shared  += kb;
+		else if ( sscanf ( line, "Private_%*[A-Za-z]: %lu kB", &kb ) == 1 )
+			*private += kb;
+	}
+
+	fclose ( f );
+	return 0;
+}
+
+static void memstat_report ( ctx_t *ctx_p )
+{
+	vmtable_t *t = &ctx_p->vmtable;
+	unsigned long shared, private, private_total = 0;
+	struct memstat_vm *vms;
+	int i = 0, count = 0;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	vms = xcalloc ( t->size, sizeof ( *vms ) );
+
+	while ( i < t->size ) {
+		vm_t *vm = &t->vms[i++];
+
+		if ( vm->pid > 0 && vm->state >= VMST_BOOTING && vm->state <= VMST_RECYCLING ) {
+			vms[count].vnc_id = vm->vnc_id;
+			vms[count].pid    = vm->pid;
+			count++;
+		}
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	i = 0;
+
+	while ( i < count ) {
+		struct memstat_vm *vm = &vms[i++];
+
+		if ( memstat_read ( vm->pid, &shared, &private ) )
+			continue;
+
+		private_total += private;
+
+		if ( ctx_p->cgroup_path != NULL ) {
+			uint64_t cpu_us, read, written;
+			cgroup_usage ( ctx_p, vm->vnc_id, &cpu_us, &read, &written );
+			info ( "Memory of the VM (vnc_id == %i): shared %lu KiB, private %lu KiB; CPU %llu ms, read %llu KiB, written %llu KiB", vm->vnc_id, shared, private,
+			       ( unsigned long long ) cpu_us / 1000, ( unsigned long long ) read >> 10, ( unsigned long long ) written >> 10 );
+		} else
+			info ( "Memory of the VM (vnc_id == %i): shared %lu KiB, private %lu KiB", vm->vnc_id, shared, private );
+	}
+
+	// The shared pages are counted by every VM mapping them, so only the private ones add up
+	info ( "Memory of %i VMs: private %lu MiB", count, private_total >> 10 );
+	free ( vms );
+	return;
+}
+
+// Reports the memory if it's time to, returns the delay till the next report in ms. Called by the controller.
+int memstat_tick ( ctx_t *ctx_p )
+{
+	static uint64_t next;
+	uint64_t now = kvmpool_now_ms();
+
+	if ( now >= next ) {
+		if ( next )
+			memstat_report ( ctx_p );
+
+		next = now + ctx_p->flags[MEMORY_STATS] * 1000ULL;
+	}
+
+	return next - now;
+}
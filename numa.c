@@ -0,0 +1,228 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements "--numa": every VM is placed on a NUMA node (the
+ * one with the least VMs per CPU) before it's spawned, and the QEMU
+ * process is bound to it (the CPUs of the node, and the memory is
+ * preferably allocated from it) before exec(). The proxy workers are
+ * spread over the nodes as well, and the proxy session of a VM is given
+ * to a worker of its node (see proxy_prepare()), so the guest memory, the
+ * vCPUs and the copying of the session's bytes stay on one node. The
+ * nodes are taken from sysfs; without it there's a single node of all
+ * the CPUs.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "numa.h"
+
+#include "error.h"
+#include "malloc.h"
+#include "pthreadex.h"
+
+#define NUMA_SYSFS "/sys/devices/system/node"
+#define NUMA_MASK_BITS ( 8 * sizeof ( unsigned long ) )
+
+struct numa_node {
+	int		 id;		// The node number of the kernel, -1 if unknown (no sysfs)
+	cpu_set_t	 cpus;		// The online CPUs of the node we may run on
+	int		 cpus_count;
+	int		 vms;		// Placed VMs
+};
+
+static struct numa_node *numa;	// Indexed by vm_cold.node - 1 and proxy_worker.node
+static int numa_count;
+
+// Parses a list like "0-3,8-11" (see cpuset(7)) into the set
+static int numa_parselist ( const char *path, cpu_set_t *set )
+{
+	char line[4096], *p = line;
+	FILE *f;
+	CPU_ZERO ( set );
+
+	if ( ( f = fopen ( path, "r" ) ) == NULL )
+		return -1;
+
+	if ( fgets ( line, sizeof ( line ), f ) == NULL )
+		*line = 0;
+
+	fclose ( f );
+
+	while ( *p >= '0' && *p <= '9' ) {
+		long first = strtol ( p, &p, 10 ), last = first;
+
+		if ( *p == '-' )
+			last = strtol ( p + 1, &p, 10 );
+
+		while ( first <= last && first < CPU_SETSIZE )
+			CPU_SET ( first++, set );
+
+		if ( *p == ',' )
+			p++;
+	}
+
+	return 0;
+}
+
+int numa_init ( ctx_t *ctx_p )
+{
+	cpu_set_t online, allowed;
+	int id = 0;
+
+	if ( sched_getaffinity ( 0, sizeof ( allowed ), &allowed ) )
+		return errno;
+
+	numa = xcalloc ( CPU_SETSIZE, sizeof ( *numa ) );
+
+	if ( numa_parselist ( NUMA_SYSFS "/online", &online ) )
+		CPU_ZERO ( &online );	// Not a cpuset, but a set of the node numbers
+
+	while ( id < CPU_SETSIZE ) {
+		struct numa_node *node = &numa[numa_count];
+		char path[128];
+
+		if ( !CPU_ISSET ( id, &online ) ) {
+			id++;
+			continue;
+		}
+
+		snprintf ( path, sizeof ( path ), NUMA_SYSFS "/node%i/cpulist", id );
+		node->id = id++;
+
+		if ( numa_parselist ( path, &node->cpus ) )
+			continue;
+
+		CPU_AND ( &node->cpus, &node->cpus, &allowed );
+
+		// A node of memory only (or of the CPUs we're not allowed to use)
+		if ( ! ( node->cpus_count = CPU_COUNT ( &node->cpus ) ) )
+			continue;
+
+		debug ( 2, "node #%i: NUMA node %i, %i CPUs", numa_count, node->id, node->cpus_count );
+		numa_count++;
+	}
+
+	if ( !numa_count ) {
+		warning ( "Cannot find the NUMA nodes in \""NUMA_SYSFS"\", assuming a single node" );
+		numa[0].id         = -1;
+		numa[0].cpus       = allowed;
+		numa[0].cpus_count = CPU_COUNT ( &allowed );
+		numa_count = 1;
+	}
+
+	return 0;
+}
+
+int numa_nodes()
+{
+	return numa_count;
+}
+
+// Returns the n-th (modulo) CPU of the node
+int numa_cpu ( int node, int n )
+{
+	int cpu = 0;
+	n %= numa[node].cpus_count;
+
+	while ( !CPU_ISSET ( cpu, &numa[node].cpus ) || n-- )
+		cpu++;
+
+	return cpu;
+}
+
+// Pins the thread to be created to the CPU, or to the whole node if "cpu" is -1
+int numa_pin ( pthread_attr_t *attr, int node, int cpu )
+{
+	if ( cpu >= 0 )
+		return pthread_attr_setaffinity_cpu ( attr, cpu );
+
+	return pthread_attr_setaffinity_np ( attr, sizeof ( numa[node].cpus ), &numa[node].cpus );
+}
+
+// Chooses the node of the VM (vm_cold.node). Requires the global lock.
+int numa_place ( ctx_t *ctx_p, vm_t *vm )
+{
+	int i = 1, best = 0;
+
+	// The least VMs per CPU (cross-multiplied)
+	while ( i < numa_count ) {
+		if ( numa[i].vms * numa[best].cpus_count < numa[best].vms * numa[i].cpus_count )
+			best = i;
+
+		i++;
+	}
+
+	numa[best].vms++;
+	vmtable_cold ( &ctx_p->vmtable, vm )->node = best + 1;
+	debug ( 4, "vm->vnc_id == %i -> node #%i (%i VMs)", vm->vnc_id, best, numa[best].vms );
+	return best;
+}
+
+// The VM is closed. Requires the global lock.
+void numa_unplace ( ctx_t *ctx_p, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( &ctx_p->vmtable, vm );
+
+	if ( !cold->node )
+		return;
+
+	numa[cold->node - 1].vms--;
+	cold->node = 0;
+	return;
+}
+
+/*
+ * Binds the calling process to the node; called by the child between
+ * fork() and exec() (so nothing is logged: the error output lock could be
+ * held by another thread of the parent), both are inherited by QEMU.
+ */
+void numa_bind ( int node )
+{
+	unsigned long mask[KVMPOOL_NUMA_NODES_MAX / NUMA_MASK_BITS] = {0};
+	struct numa_node *n = &numa[node];
+	sched_setaffinity ( 0, sizeof ( n->cpus ), &n->cpus );
+
+	if ( n->id < 0 || n->id >= KVMPOOL_NUMA_NODES_MAX )
+		return;
+
+	// Preferred rather than bound: a full node falls back to the others instead of the OOM killer
+	mask[n->id / NUMA_MASK_BITS] |= 1UL << ( n->id % NUMA_MASK_BITS );
+	syscall ( SYS_set_mempolicy, MPOL_PREFERRED, mask, KVMPOOL_NUMA_NODES_MAX + 1 );
+	return;
+}
+
+void numa_deinit ( ctx_t *ctx_p )
+{
+	free ( numa );
+	numa       = NULL;
+	numa_count = 0;
+	return;
+}
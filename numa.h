@@ -0,0 +1,40 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_NUMA_H
+#define __KVMPOOL_NUMA_H
+
+#include "common.h"
+
+#include <pthread.h>
+
+#include "ctx.h"
+
+extern int numa_init ( ctx_t *ctx_p );
+extern int numa_nodes();
+extern int numa_cpu ( int node, int n );
+extern int numa_pin ( pthread_attr_t *attr, int node, int cpu );
+extern int numa_place ( ctx_t *ctx_p, vm_t *vm );
+extern void numa_unplace ( ctx_t *ctx_p, vm_t *vm );
+extern void numa_bind ( int node );
+extern void numa_deinit ( ctx_t *ctx_p );
+
+#endif
@@ -0,0 +1,318 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements "--overlay-backing": every VM gets a copy-on-write
+ * qcow2 overlay of the backing image ("%OVERLAY%" in "--kvm-args", see
+ * getargv()), so the VMs don't share a writable disk and their writes
+ * are thrown away with the VM. "qemu-img create" takes a while, so the
+ * overlays are created in advance by a background thread: it keeps
+ * "--max-spare" of them ready, and the used ones are reset (created
+ * anew in place) or removed by it, too. Neither a spawn nor an attach
+ * waits for a disk.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "overlay.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+#include "malloc.h"
+
+enum overlay_state {
+	OVST_FREE = 0,		// No file
+	OVST_BUSY,		// Being created or removed by the overlay thread
+	OVST_READY,		// Created, to be taken by a VM
+	OVST_USED,		// Taken by a VM
+	OVST_DIRTY,		// The VM is gone, to be reset or removed
+
+	OVST_MAX
+};
+
+// The overlays in a state (OVST_FREE, OVST_READY or OVST_DIRTY), like the free slots of the VM table
+struct overlay_stack {
+	int	*idx;
+	int	 count;
+};
+
+static pthread_cond_t overlay_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t overlay_thread;
+static int overlay_running;
+static char *overlay_states;	// Per overlay: enum overlay_state
+static struct overlay_stack overlay_stacks[OVST_MAX];	// NULL "idx" for the states without a stack
+static int overlay_size;	// Overlay "i" is "<overlay-dir>/overlay-<i>.qcow2"
+static int overlay_creating;
+static int overlay_target;	// Overlays kept ready
+
+int overlay_path ( ctx_t *ctx_p, int idx, char *path, size_t path_size )
+{
+	return snprintf ( path, path_size, "%s/overlay-%i.qcow2", ctx_p->overlay_dir, idx );
+}
+
+// Creates the overlay (an existing file is overwritten, so it's a reset, too)
+static int overlay_create ( ctx_t *ctx_p, int idx )
+{
+	char path[PATH_MAX];
+	int status;
+	pid_t pid;
+	overlay_path ( ctx_p, idx, path, sizeof ( path ) );
+	debug ( 5, "\"%s\"", path );
+
+	switch ( ( pid = fork() ) ) {
+		case -1:
+			error ( "Cannot fork()." );
+			return errno;
+
+		case  0: {
+				char *argv[] = { QEMU_IMG, "create", "-q", "-f", "qcow2", "-F", ctx_p->overlay_format, "-b", ctx_p->overlay_backing, path, NULL };
+				exit ( execvp ( QEMU_IMG, argv ) );
+			}
+	}
+
+	if ( waitpid ( pid, &status, 0 ) == -1 )
+		return errno;
+
+	if ( !WIFEXITED ( status ) || WEXITSTATUS ( status ) ) {
+		error ( "Cannot create the overlay \"%s\" (\""QEMU_IMG"\" exit status: %i)", path, status );
+		unlink ( path );
+		return EIO;
+	}
+
+	return 0;
+}
+
+static void overlay_remove ( ctx_t *ctx_p, int idx )
+{
+	char path[PATH_MAX];
+	overlay_path ( ctx_p, idx, path, sizeof ( path ) );
+	debug ( 5, "\"%s\"", path );
+	unlink ( path );
+	return;
+}
+
+// Requires the global lock
+static void overlay_setstate ( int idx, char state )
+{
+	struct overlay_stack *stack = &overlay_stacks[( int ) state];
+	overlay_states[idx] = state;
+
+	if ( stack->idx != NULL )
+		stack->idx[stack->count++] = idx;
+
+	return;
+}
+
+// Takes an overlay in the state (it's to be moved to another one), returns -1 if there's none. Requires the global lock.
+static int overlay_pop ( char state )
+{
+	struct overlay_stack *stack = &overlay_stacks[( int ) state];
+	return stack->count ? stack->idx[--stack->count] : -1;
+}
+
+static void overlay_sleep ( int delay_ms )
+{
+	struct timespec ts;
+	clock_gettime ( CLOCK_REALTIME, &ts );
+	ts.tv_sec  += delay_ms / 1000;
+	ts.tv_nsec += ( delay_ms % 1000 ) * 1000000;
+
+	if ( ts.tv_nsec >= 1000000000 ) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_cond_timedwait ( &overlay_cond, &kvmpool_globalmutex, &ts );
+	return;
+}
+
+static void *overlay_loop ( void *_ctx_p )
+{
+	ctx_t *ctx_p = _ctx_p;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+
+	while ( overlay_running ) {
+		int idx, create, rc = 0;
+
+		// A used overlay is reset rather than a new one created, so the files are reused
+		create = overlay_stacks[OVST_READY].count + overlay_creating < overlay_target;
+		idx    = overlay_pop ( OVST_DIRTY );
+
+		if ( idx < 0 && create )
+			idx = overlay_pop ( OVST_FREE );
+
+		if ( idx < 0 ) {
+			pthread_cond_wait ( &overlay_cond, &kvmpool_globalmutex );
+			continue;
+		}
+
+		overlay_setstate ( idx, OVST_BUSY );
+		overlay_creating += create;
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+		if ( create )
+			rc = overlay_create ( ctx_p, idx );
+		else
+			overlay_remove ( ctx_p, idx );
+
+		pthread_mutex_lock ( &kvmpool_globalmutex );
+		overlay_creating -= create;
+
+		if ( !create || rc ) {
+			overlay_setstate ( idx, OVST_FREE );
+
+			// Doesn't spin on a missing backing image or a full disk
+			if ( rc )
+				overlay_sleep ( KVMPOOL_OVERLAY_RETRY );
+
+			continue;
+		}
+
+		overlay_setstate ( idx, OVST_READY );
+
+		// The queued VMs wait for it, see kvmpool_spawn()
+		if ( ctx_p->vmtable.spawnq.count )
+			kvmpool_ctl_wakeup();
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	return NULL;
+}
+
+/*
+ * Takes a ready overlay, returns its index or -1 if there's none. With
+ * "sync" an overlay is created right away if there's none ready (only for
+ * the "--snapshot" template VM: nothing waits for it). Requires the global
+ * lock (it's released while the overlay is created).
+ */
+int overlay_take ( ctx_t *ctx_p, int sync )
+{
+	int idx = overlay_pop ( OVST_READY );
+
+	if ( idx >= 0 ) {
+		overlay_setstate ( idx, OVST_USED );
+		pthread_cond_signal ( &overlay_cond );
+		debug ( 5, "overlay #%i, %i are ready", idx, overlay_stacks[OVST_READY].count );
+		return idx;
+	}
+
+	if ( !sync || ( idx = overlay_pop ( OVST_FREE ) ) < 0 )
+		return -1;
+
+	overlay_setstate ( idx, OVST_BUSY );
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	int rc = overlay_create ( ctx_p, idx );
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	overlay_setstate ( idx, rc ? OVST_FREE : OVST_USED );
+	return rc ? -1 : idx;
+}
+
+// The VM is gone (its process is reaped), the overlay is to be reset. Requires the global lock.
+void overlay_release ( ctx_t *ctx_p, int idx )
+{
+	debug ( 5, "overlay #%i", idx );
+	overlay_setstate ( idx, OVST_DIRTY );
+	pthread_cond_signal ( &overlay_cond );
+	return;
+}
+
+int overlay_init ( ctx_t *ctx_p )
+{
+	int rc, idx;
+
+	if ( mkdir ( ctx_p->overlay_dir, 0700 ) && errno != EEXIST ) {
+		error ( "Cannot create the overlay directory \"%s\"", ctx_p->overlay_dir );
+		return errno;
+	}
+
+	// Every VM holds one, plus the ready ones, plus the one of the "--snapshot" template VM
+	overlay_target  = ctx_p->vms_spare_max;
+	overlay_size    = ctx_p->vms_max + overlay_target + 1;
+	overlay_states  = xcalloc ( overlay_size, sizeof ( *overlay_states ) );
+	overlay_stacks[OVST_FREE].idx  = xcalloc ( overlay_size, sizeof ( int ) );
+	overlay_stacks[OVST_READY].idx = xcalloc ( overlay_size, sizeof ( int ) );
+	overlay_stacks[OVST_DIRTY].idx = xcalloc ( overlay_size, sizeof ( int ) );
+	idx = overlay_size;
+
+	// The lowest indexes are taken first
+	while ( idx )
+		overlay_setstate ( --idx, OVST_FREE );
+
+	overlay_running = 1;
+
+	if ( ( rc = pthread_create ( &overlay_thread, NULL, overlay_loop, ctx_p ) ) ) {
+		overlay_running = 0;
+		return rc;
+	}
+
+	return 0;
+}
+
+// Stops the overlay thread, the rest of the VMs are to be closed yet
+void overlay_stop ( ctx_t *ctx_p )
+{
+	if ( !overlay_running )
+		return;
+
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	overlay_running = 0;
+	pthread_cond_broadcast ( &overlay_cond );
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	pthread_join ( overlay_thread, NULL );
+	return;
+}
+
+// Removes all the overlays; requires overlay_stop() and the VMs closed
+void overlay_deinit ( ctx_t *ctx_p )
+{
+	int idx = 0;
+
+	while ( idx < overlay_size ) {
+		if ( overlay_states[idx] != OVST_FREE )
+			overlay_remove ( ctx_p, idx );
+
+		idx++;
+	}
+
+	free ( overlay_states );
+	overlay_states = NULL;
+	overlay_size   = 0;
+
+	for ( idx = 0; idx < OVST_MAX; idx++ ) {
+		free ( overlay_stacks[idx].idx );
+		overlay_stacks[idx].idx   = NULL;
+		overlay_stacks[idx].count = 0;
+	}
+
+	return;
+}
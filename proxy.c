@@ -0,0 +1,2114 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements the proxy engine: a fixed set of worker threads,
+ * each one owning an edge-triggered epoll set. Sessions (client <-> VNC
+ * server of a VM) are spread over the workers.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "proxy.h"
+#include "qmp.h"
+#include "recycle.h"
+#include "rfb.h"
+
+#include "kvm-pool.h"
+#include "error.h"
+#include "malloc.h"
+#include "numa.h"
+#include "pthreadex.h"
+
+enum proxy_side {
+	SIDE_CLIENT = 0,
+	SIDE_VNC,
+
+	SIDE_MAX,
+	SIDE_AGENT,	// Not a side: the guest agent of the VM (the pidfd of the VM is SIDE_MAX)
+};
+
+enum proxy_session_state {
+	PSS_CONNECTING = 0,
+	PSS_HANDSHAKE,	// RFB handshake with the VNC server, see proxy_handshake_event()
+	PSS_GREETING,	// RFB handshake with the client, see proxy_greeting_event()
+	PSS_RELAYING,
+	PSS_HANDOFF,	// "--handoff": talking QMP, see proxy_handoff_event()
+	PSS_CLOSED,
+};
+
+enum proxy_qmp_state {
+	PQS_GREETING = 0,
+	PQS_CAPABILITIES,
+	PQS_READY,	// Waiting for a client
+	PQS_GETFD,
+	PQS_ADD_CLIENT,
+	PQS_ATTACHED,
+};
+
+struct proxy_endpoint {
+	struct proxy_session	*session;
+	enum proxy_side		 side;
+};
+
+/*
+ * "recv" backend: the ring buffer of a direction. The memory is taken from
+ * the worker's bufpool only while the ring is not empty, so idle sessions
+ * hold no memory at all.
+ */
+struct proxy_buf {
+	char		*data;		// NULL if the ring is empty
+	size_t		 head;
+	size_t		 len;
+	int		 class;		// bufpool size class, the ring size
+	int		 full;		// A recv() filled the whole ring during the current window
+	size_t		 peak;		// The biggest portion received during the current window
+	uint64_t	 window_start;	// CLOCK_MONOTONIC, ms
+};
+
+#ifdef IO_URING_SUPPORT
+enum proxy_uring_op {
+	PUO_RECV = 0,
+	PUO_SEND,
+};
+
+#define PROXY_URING_USERDATA(session, op, side) ( ( uint64_t ) ( uintptr_t ) ( session ) | ( ( op ) << 1 ) | ( side ) )
+
+struct proxy_uring_portion {
+	int		 next;
+	unsigned	 off;
+	unsigned	 len;
+};
+
+// The data received from one side of a session and not sent to the other side, yet
+struct proxy_uring_flow {
+	struct proxy_session	*session;
+	enum proxy_side		 side;
+	int			 recv_armed;
+	int			 throttled;	// Too many buffers are queued, the recv() is cancelled
+	int			 queued;
+	int			 sends_inflight;
+	int			 head;	// Buffer ID, -1 if the queue is empty
+	int			 tail;
+	int			 nobufs;
+	struct proxy_uring_flow	*nobufs_next;
+};
+#endif
+
+/*
+ * A session is started as soon as a spare VM is queued (PMT_PREPARE) and
+ * connects when the VM is spawned (PMT_SPAWNED), so the connection to the
+ * VM (and the RFB handshake or QMP negotiation) is done before a client
+ * comes (PMT_ATTACH).
+ */
+struct proxy_session {
+	vm_t			*vm;
+	proxy_worker_t		*worker;
+	enum proxy_session_state state;
+	int			 attached;
+	uint64_t		 connect_at;	// CLOCK_MONOTONIC, ms; 0 if a connect() is in progress
+	uint64_t		 connect_deadline;
+	int			 connect_delay;	// ms, doubled on every failed attempt
+	struct proxy_endpoint	 ep[SIDE_MAX];
+	struct proxy_endpoint	 ep_process;	// The pidfd of the VM, "side" is SIDE_MAX
+	struct proxy_session	*next;
+	uint64_t		 boot_at;	// CLOCK_MONOTONIC, ms; the next check of the guest, see proxy_boot_check()
+	uint64_t		 boot_deadline;
+	struct proxy_session	*boot_next;	// In worker->booting
+	qmp_t			*agent;		// "--guest-agent", NULL if not connected
+	struct proxy_endpoint	 ep_agent;	// "side" is SIDE_AGENT
+	int			 pipe_fd[SIDE_MAX][2];	// "splice" backend, the data from the side
+	size_t			 pipe_pending[SIDE_MAX];
+	struct proxy_buf	 buf[SIDE_MAX];	// "recv" backend, the data from the side
+	rfb_t			 rfb;
+	qmp_t			*qmp;	// "--handoff"
+	enum proxy_qmp_state	 qmp_state;
+#ifdef IO_URING_SUPPORT
+	int			 uring;
+	int			 uring_ops;	// Requests in flight, the session cannot be free()-d until they are completed
+	struct proxy_uring_flow	 flow[SIDE_MAX];
+#endif
+};
+typedef struct proxy_session proxy_session_t;
+
+enum proxy_msg_type {
+	PMT_WAKEUP = 0,
+	PMT_PREPARE,
+	PMT_SPAWNED,
+	PMT_ATTACH,
+	PMT_CLOSE,
+};
+
+// Passed to a worker through its pipe
+struct proxy_msg {
+	enum proxy_msg_type	 type;
+	int			 vm_idx;
+	int			 client_fd;	// PMT_ATTACH
+};
+
+static inline int proxy_epoll_add ( proxy_worker_t *worker, int fd, struct proxy_endpoint *ep )
+{
+	struct epoll_event ev = {0};
+	ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = ep;
+	return epoll_ctl ( worker->epoll_fd, EPOLL_CTL_ADD, fd, &ev );
+}
+
+static inline int proxy_fd_setblock ( int fd, int nonblock )
+{
+	int flags;
+
+	if ( -1 == ( flags = fcntl ( fd, F_GETFL, 0 ) ) )
+		flags = 0;
+
+	return fcntl ( fd, F_SETFL, nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK );
+}
+
+static void proxy_booting_unlink ( proxy_session_t *session )
+{
+	proxy_session_t **session_pp = &session->worker->booting;
+
+	while ( *session_pp != NULL ) {
+		if ( *session_pp == session ) {
+			*session_pp = session->boot_next;
+			session->boot_next = NULL;
+			return;
+		}
+
+		session_pp = &( *session_pp )->boot_next;
+	}
+
+	return;
+}
+
+static void proxy_connecting_unlink ( proxy_session_t *session )
+{
+	proxy_session_t **session_pp = &session->worker->connecting;
+
+	while ( *session_pp != NULL ) {
+		if ( *session_pp == session ) {
+			*session_pp = session->next;
+			session->next = NULL;
+			return;
+		}
+
+		session_pp = &( *session_pp )->next;
+	}
+
+	return;
+}
+
+/*
+ * splice() cannot move data from a socket to a socket directly, so every
+ * direction has its own pipe: socket -> pipe -> socket. The pipe is also
+ * the buffer of the direction: if the destination is not writable, the
+ * data waits in the pipe (until EPOLLOUT) and the source is not read.
+ */
+static inline int passthrough_splice ( int dst, int src, int pipe_fd[2], size_t *pending_p )
+{
+	ssize_t r;
+	debug ( 8, "passthrough_splice(%i, %i, {%i, %i}, %u)", dst, src, pipe_fd[0], pipe_fd[1], *pending_p );
+
+	while ( 1 ) {
+		if ( *pending_p ) {
+			r = splice ( pipe_fd[0], NULL, dst, NULL, *pending_p, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+			debug ( 10, "splice(%i, NULL, %i, NULL, %u) -> %i", pipe_fd[0], dst, *pending_p, r );
+
+			if ( r < 0 ) {
+				if ( errno == EAGAIN )
+					break;
+
+				error ( "got error while forwarding a data to fd == %i", dst );
+				return -1;
+			}
+
+			*pending_p -= r;
+			continue;
+		}
+
+		r = splice ( src, NULL, pipe_fd[1], NULL, KVMPOOL_SPLICE_PIPESIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+		debug ( 10, "splice(%i, NULL, %i, NULL, %u) -> %i", src, pipe_fd[1], KVMPOOL_SPLICE_PIPESIZE, r );
+
+		if ( r == 0 )
+			return -1;
+
+		if ( r < 0 ) {
+			if ( errno == EAGAIN )
+				break;
+
+			error ( "got error while forwarding a data from fd == %i", src );
+			return -1;
+		}
+
+		*pending_p += r;
+	}
+
+	return 0;
+}
+
+static int proxy_splice_start ( proxy_session_t *session )
+{
+	enum proxy_side side = SIDE_CLIENT;
+
+	while ( side < SIDE_MAX ) {
+		int *pipe_fd = session->pipe_fd[side++];
+
+		if ( pipe2 ( pipe_fd, O_NONBLOCK | O_CLOEXEC ) ) {
+			error ( "Cannot create a pipe" );
+			pipe_fd[0] = pipe_fd[1] = 0;
+			return -1;
+		}
+
+		if ( fcntl ( pipe_fd[1], F_SETPIPE_SZ, KVMPOOL_SPLICE_PIPESIZE ) == -1 )
+			debug ( 3, "Cannot set the pipe size to "XTOSTR ( KVMPOOL_SPLICE_PIPESIZE ) ": %s", strerror ( errno ) );
+	}
+
+	return 0;
+}
+
+static void proxy_recv_close ( proxy_session_t *session )
+{
+	enum proxy_side side = SIDE_CLIENT;
+
+	while ( side < SIDE_MAX ) {
+		struct proxy_buf *buf = &session->buf[side++];
+
+		if ( buf->data != NULL ) {
+			bufpool_put ( &session->worker->bufpool, buf->data, buf->class );
+			buf->data = NULL;
+			buf->len  = 0;
+		}
+	}
+
+	return;
+}
+
+static void proxy_splice_close ( proxy_session_t *session )
+{
+	enum proxy_side side = SIDE_CLIENT;
+
+	while ( side < SIDE_MAX ) {
+		int *pipe_fd = session->pipe_fd[side++];
+
+		if ( pipe_fd[0] ) {
+			close ( pipe_fd[0] );
+			close ( pipe_fd[1] );
+			pipe_fd[0] = pipe_fd[1] = 0;
+		}
+	}
+
+	return;
+}
+
+#ifdef IO_URING_SUPPORT
+static void proxy_uring_close ( proxy_session_t *session );
+#endif
+
+static void proxy_agent_close ( proxy_session_t *session );
+
+static void proxy_session_close ( proxy_session_t *session )
+{
+	proxy_worker_t *worker = session->worker;
+	vm_t *vm = session->vm;
+	debug ( 3, "vm->vnc_id == %i", vm->vnc_id );
+
+	if ( session->state == PSS_CLOSED )
+		return;
+
+	if ( session->state == PSS_CONNECTING )
+		proxy_connecting_unlink ( session );
+
+	if ( session->boot_at ) {
+		proxy_booting_unlink ( session );
+		proxy_agent_close ( session );
+	}
+
+	session->state = PSS_CLOSED;
+#ifdef IO_URING_SUPPORT
+
+	if ( session->uring )
+		proxy_uring_close ( session );
+
+#endif
+
+	proxy_splice_close ( session );
+	proxy_recv_close ( session );
+
+	if ( session->attached && vm->client_fd > 0 )
+		epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->client_fd, NULL );
+
+	if ( vm->vnc_fd )
+		epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->vnc_fd, NULL );
+
+	if ( vm->qmp_fd )
+		epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->qmp_fd, NULL );
+
+	if ( session->qmp != NULL ) {
+		qmp_free ( session->qmp );
+		session->qmp = NULL;
+	}
+
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+
+	// "--recycle": the VM is reused, another worker may watch its pidfd
+	if ( kvmpool_recyclevm ( worker->ctx_p, vm ) ) {
+		if ( vm->pidfd )
+			epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->pidfd, NULL );
+	} else
+		kvmpool_closevm ( worker->ctx_p, vm );
+
+	vm->session = NULL;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	// Events of this batch may still point to the session, so it's free()-d after the batch
+	session->next  = worker->closed;
+	worker->closed = session;
+	__sync_fetch_and_sub ( &worker->sessions_count, 1 );
+	return;
+}
+
+/*
+ * Moves the data from "src" to "dst" through the ring of the direction.
+ * Nothing blocks: if "dst" is not writable the data stays in the ring
+ * (until EPOLLOUT on "dst") and "src" is read only while the ring has
+ * free space, so a slow receiver just stops the reading from the other
+ * side of its direction.
+ */
+static inline int passthrough_dataportion ( int dst, int src, struct proxy_buf *buf )
+{
+	size_t size = bufpool_class_size ( buf->class );
+	size_t mask = size - 1;
+	ssize_t r;
+	debug ( 8, "passthrough_dataportion(%i, %i, buf): size == %u, len == %u", dst, src, size, buf->len );
+
+	while ( 1 ) {
+		while ( buf->len ) {
+			size_t chunk = MIN ( buf->len, size - buf->head );
+			r = send ( dst, &buf->data[buf->head], chunk, MSG_DONTWAIT | MSG_NOSIGNAL );
+			debug ( 10, "send(%i, &data[%u], %u) -> %i", dst, buf->head, chunk, r );
+
+			if ( r < 0 ) {
+				if ( errno == EAGAIN )
+					break;
+
+				error ( "got error while sending to fd == %i", dst );
+				return -1;
+			}
+
+			buf->head = ( buf->head + r ) & mask;
+			buf->len -= r;
+		}
+
+		if ( !buf->len )
+			buf->head = 0;	// Next recv() may use the whole buffer
+
+		if ( buf->len == size ) {
+			debug ( 9, "the ring is full, waiting for EPOLLOUT on fd == %i", dst );
+			break;
+		}
+
+		size_t tail  = ( buf->head + buf->len ) & mask;
+		size_t chunk = MIN ( size - buf->len, size - tail );
+		r = recv ( src, &buf->data[tail], chunk, MSG_DONTWAIT );
+		debug ( 10, "recv(%i, &data[%u], %u) -> %i", src, tail, chunk, r );
+
+		if ( r == 0 )
+			return -1;
+
+		if ( r < 0 ) {
+			if ( errno == EAGAIN )
+				break;
+
+			error ( "got error while receiving from fd == %i", src );
+			return -1;
+		}
+
+		if ( ( size_t ) r == size )
+			buf->full = 1;
+
+		if ( ( size_t ) r > buf->peak )
+			buf->peak = r;
+
+		buf->len += r;
+	}
+
+	debug ( 9, "finish" );
+
+	return 0;
+}
+
+/*
+ * The buffer of a direction grows as soon as a recv() fills it up, and
+ * shrinks if no portion bigger than a quarter of it was received during
+ * a KVMPOOL_BUFPOOL_WINDOW. So mouse/keyboard events use 4 KiB buffers,
+ * while framebuffer updates get up to KVMPOOL_NET_BUFSIZE.
+ *
+ * The size may be changed only while the ring is empty.
+ */
+static void proxy_buf_adapt ( proxy_session_t *session, enum proxy_side side )
+{
+	struct proxy_buf *buf = &session->buf[side];
+	uint64_t now = kvmpool_now_ms();
+
+	if ( buf->full && buf->class < BUFPOOL_CLASSES - 1 ) {
+		buf->class++;
+		debug ( 7, "vm->vnc_id == %i: side %i: grow to %u", session->vm->vnc_id, side, bufpool_class_size ( buf->class ) );
+		buf->full = 0;
+		buf->peak = 0;
+		buf->window_start = now;
+		return;
+	}
+
+	if ( now - buf->window_start < KVMPOOL_BUFPOOL_WINDOW )
+		return;
+
+	if ( buf->class > 0 && buf->peak <= bufpool_class_size ( buf->class ) / 4 ) {
+		buf->class--;
+		debug ( 7, "vm->vnc_id == %i: side %i: shrink to %u", session->vm->vnc_id, side, bufpool_class_size ( buf->class ) );
+	}
+
+	buf->full = 0;
+	buf->peak = 0;
+	buf->window_start = now;
+	return;
+}
+
+static int proxy_relay_recv ( proxy_session_t *session, int dst, int src, enum proxy_side src_side )
+{
+	proxy_worker_t *worker = session->worker;
+	struct proxy_buf *buf = &session->buf[src_side];
+	int rc;
+
+	if ( buf->data == NULL ) {
+		buf->data = bufpool_get ( &worker->bufpool, buf->class );
+
+		if ( buf->data == NULL )
+			return -1;
+	}
+
+	rc = passthrough_dataportion ( dst, src, buf );
+
+	if ( buf->len )
+		return rc;
+
+	bufpool_put ( &worker->bufpool, buf->data, buf->class );
+	buf->data = NULL;
+
+	if ( !worker->bufpool_trim_at && bufpool_dirty ( &worker->bufpool ) )
+		worker->bufpool_trim_at = kvmpool_now_ms() + KVMPOOL_BUFPOOL_TRIM_INTERVAL;
+
+	proxy_buf_adapt ( session, src_side );
+	return rc;
+}
+
+static int proxy_relay ( proxy_session_t *session, enum proxy_side src_side )
+{
+	vm_t *vm = session->vm;
+
+	if ( session->worker->ctx_p->io_backend == IOB_SPLICE )
+		switch ( src_side ) {
+			case SIDE_CLIENT:
+				return passthrough_splice ( vm->vnc_fd, vm->client_fd, session->pipe_fd[src_side], &session->pipe_pending[src_side] );
+
+			case SIDE_VNC:
+				return passthrough_splice ( vm->client_fd, vm->vnc_fd, session->pipe_fd[src_side], &session->pipe_pending[src_side] );
+
+			default:
+				critical ( "Unknown side: %i", src_side );
+		}
+
+	switch ( src_side ) {
+		case SIDE_CLIENT:
+			return proxy_relay_recv ( session, vm->vnc_fd, vm->client_fd, src_side );
+
+		case SIDE_VNC:
+			return proxy_relay_recv ( session, vm->client_fd, vm->vnc_fd, src_side );
+
+		default:
+			critical ( "Unknown side: %i", src_side );
+	}
+
+	return -1;
+}
+
+#ifdef IO_URING_SUPPORT
+/*
+ * io_uring data path: every side of a session has a multishot recv()
+ * picking buffers from the worker's provided-buffer ring. Received
+ * portions are queued per side and sent to the other side as a chain of
+ * linked send()-s. If the buffers run out, the multishot recv() stops and
+ * is re-armed when the buffers are sent and recycled (that's the flow
+ * control).
+ */
+
+static inline int proxy_side_fd ( proxy_session_t *session, enum proxy_side side )
+{
+	return side == SIDE_CLIENT ? session->vm->client_fd : session->vm->vnc_fd;
+}
+
+static inline void proxy_uring_recycle ( proxy_worker_t *worker, unsigned bid )
+{
+	uring_buf_recycle ( &worker->uring, bid );
+	worker->uring_bufs_free++;
+	return;
+}
+
+static inline void proxy_uring_enqueue ( proxy_worker_t *worker, struct proxy_uring_flow *flow, unsigned bid, unsigned len )
+{
+	struct proxy_uring_portion *portion = &worker->uring_portions[bid];
+	portion->next = -1;
+	portion->off  = 0;
+	portion->len  = len;
+
+	if ( flow->tail == -1 )
+		flow->head = bid;
+	else
+		worker->uring_portions[flow->tail].next = bid;
+
+	flow->tail = bid;
+	flow->queued++;
+	return;
+}
+
+static inline int proxy_uring_dequeue ( proxy_worker_t *worker, struct proxy_uring_flow *flow )
+{
+	int bid = flow->head;
+	flow->head = worker->uring_portions[bid].next;
+
+	if ( flow->head == -1 )
+		flow->tail = -1;
+
+	flow->queued--;
+	return bid;
+}
+
+static void proxy_uring_flush ( proxy_worker_t *worker, struct proxy_uring_flow *flow )
+{
+	while ( flow->head != -1 )
+		proxy_uring_recycle ( worker, proxy_uring_dequeue ( worker, flow ) );
+
+	return;
+}
+
+static struct io_uring_sqe *proxy_uring_sqe ( proxy_worker_t *worker )
+{
+	struct io_uring_sqe *sqe = uring_sqe_get ( &worker->uring );
+
+	if ( sqe == NULL ) {
+		uring_submit ( &worker->uring );
+		sqe = uring_sqe_get ( &worker->uring );
+	}
+
+	return sqe;
+}
+
+static int proxy_uring_recv ( proxy_session_t *session, enum proxy_side side )
+{
+	struct io_uring_sqe *sqe = proxy_uring_sqe ( session->worker );
+
+	if ( sqe == NULL ) {
+		error ( "The submission queue of worker #%i is full", session->worker->id );
+		return -1;
+	}
+
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = proxy_side_fd ( session, side );
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->buf_group = 0;
+	sqe->user_data = PROXY_URING_USERDATA ( session, PUO_RECV, side );
+	session->flow[side].recv_armed = 1;
+	session->uring_ops++;
+	return 0;
+}
+
+static int proxy_uring_send ( proxy_session_t *session, enum proxy_side side )
+{
+	proxy_worker_t *worker = session->worker;
+	struct proxy_uring_flow *flow = &session->flow[side];
+	struct io_uring_sqe *sqe = NULL;
+	int dst_fd = proxy_side_fd ( session, side == SIDE_CLIENT ? SIDE_VNC : SIDE_CLIENT );
+	int bid = flow->head;
+	unsigned chain_max;
+
+	if ( uring_sq_space ( &worker->uring ) < KVMPOOL_URING_CHAIN )
+		uring_submit ( &worker->uring );
+
+	chain_max = MIN ( uring_sq_space ( &worker->uring ), KVMPOOL_URING_CHAIN );
+
+	while ( bid != -1 && flow->sends_inflight < chain_max ) {
+		struct proxy_uring_portion *portion = &worker->uring_portions[bid];
+
+		if ( sqe != NULL )
+			sqe->flags |= IOSQE_IO_LINK;
+
+		sqe = uring_sqe_get ( &worker->uring );
+		sqe->opcode    = IORING_OP_SEND;
+		sqe->fd        = dst_fd;
+		sqe->addr      = ( unsigned long ) &uring_buf ( &worker->uring, bid ) [portion->off];
+		sqe->len       = portion->len;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = PROXY_URING_USERDATA ( session, PUO_SEND, side );
+		flow->sends_inflight++;
+		session->uring_ops++;
+		bid = portion->next;
+	}
+
+	return 0;
+}
+
+/*
+ * All the sessions share the provided buffers, so a direction whose
+ * receiver is slow could take all of them and stall the other direction
+ * (and the other sessions). Such a direction stops receiving until its
+ * queue is half-drained.
+ */
+static void proxy_uring_throttle ( proxy_session_t *session, enum proxy_side side )
+{
+	proxy_worker_t *worker = session->worker;
+	struct proxy_uring_flow *flow = &session->flow[side];
+	struct io_uring_sqe *sqe;
+	flow->throttled = 1;
+
+	if ( !flow->recv_armed )
+		return;
+
+	sqe = proxy_uring_sqe ( worker );
+
+	if ( sqe == NULL )
+		return;	// Will be limited by ENOBUFS
+
+	sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+	sqe->addr      = PROXY_URING_USERDATA ( session, PUO_RECV, side );
+	sqe->user_data = 0;	// The completion is ignored
+	return;
+}
+
+static int proxy_uring_unthrottle ( proxy_session_t *session, enum proxy_side side )
+{
+	struct proxy_uring_flow *flow = &session->flow[side];
+
+	if ( !flow->throttled || flow->recv_armed || flow->queued > KVMPOOL_URING_FLOW_BUFS / 2 )
+		return 0;
+
+	flow->throttled = 0;
+	return proxy_uring_recv ( session, side );
+}
+
+static void proxy_uring_nobufs_unlink ( proxy_worker_t *worker, struct proxy_uring_flow *flow )
+{
+	struct proxy_uring_flow **flow_pp = &worker->uring_nobufs;
+
+	if ( !flow->nobufs )
+		return;
+
+	while ( *flow_pp != NULL ) {
+		if ( *flow_pp == flow ) {
+			*flow_pp = flow->nobufs_next;
+			break;
+		}
+
+		flow_pp = &( *flow_pp )->nobufs_next;
+	}
+
+	flow->nobufs = 0;
+	return;
+}
+
+static void proxy_uring_complete ( proxy_worker_t *worker, struct io_uring_cqe *cqe )
+{
+	proxy_session_t *session = ( proxy_session_t * ) ( uintptr_t ) ( cqe->user_data & ~ ( uint64_t ) 3 );
+	enum proxy_side side = cqe->user_data & 1;
+	enum proxy_uring_op op = ( cqe->user_data >> 1 ) & 1;
+	struct proxy_uring_flow *flow = &session->flow[side];
+	int closed = ( session->state == PSS_CLOSED );
+	int failed = 0;
+	int res = cqe->res;
+	debug ( 10, "op == %i; side == %i; res == %i; flags == 0x%x", op, side, res, cqe->flags );
+
+	switch ( op ) {
+		case PUO_RECV:
+			if ( cqe->flags & IORING_CQE_F_BUFFER ) {
+				unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				worker->uring_bufs_free--;
+
+				if ( res > 0 && !closed ) {
+					proxy_uring_enqueue ( worker, flow, bid, res );
+
+					if ( flow->queued >= KVMPOOL_URING_FLOW_BUFS && !flow->throttled )
+						proxy_uring_throttle ( session, side );
+				} else
+					proxy_uring_recycle ( worker, bid );
+			}
+
+			if ( ! ( cqe->flags & IORING_CQE_F_MORE ) ) {
+				flow->recv_armed = 0;
+				session->uring_ops--;
+
+				if ( flow->throttled && ( res > 0 || res == -ECANCELED || res == -ENOBUFS ) ) {
+					if ( !closed )
+						failed = proxy_uring_unthrottle ( session, side );
+				} else if ( res > 0 || res == -ENOBUFS ) {
+					// The multishot recv() is over, but the stream is not: re-arm it when there're free buffers
+					if ( !closed ) {
+						flow->nobufs      = 1;
+						flow->nobufs_next = worker->uring_nobufs;
+						worker->uring_nobufs = flow;
+					}
+				} else
+					failed = 1;
+			}
+
+			if ( !closed && !failed && flow->sends_inflight == 0 && flow->head != -1 )
+				proxy_uring_send ( session, side );
+
+			break;
+
+		case PUO_SEND:
+			flow->sends_inflight--;
+			session->uring_ops--;
+
+			if ( res >= 0 && flow->head != -1 ) {
+				struct proxy_uring_portion *portion = &worker->uring_portions[flow->head];
+
+				if ( res >= portion->len )
+					proxy_uring_recycle ( worker, proxy_uring_dequeue ( worker, flow ) );
+				else {
+					// A short send(), the rest of the chain will be cancelled and resent
+					portion->off += res;
+					portion->len -= res;
+				}
+			} else if ( res != -ECANCELED )
+				failed = 1;
+
+			if ( flow->sends_inflight == 0 ) {
+				if ( closed || failed )
+					proxy_uring_flush ( worker, flow );
+				else if ( flow->head != -1 )
+					proxy_uring_send ( session, side );
+			}
+
+			if ( !closed && !failed )
+				failed = proxy_uring_unthrottle ( session, side );
+
+			break;
+	}
+
+	if ( failed && !closed ) {
+		if ( res < 0 )
+			debug ( 3, "side %i: %s", side, strerror ( -res ) );
+
+		proxy_session_close ( session );
+	}
+
+	return;
+}
+
+static void proxy_uring_reap ( proxy_worker_t *worker )
+{
+	struct io_uring_cqe *cqe;
+
+	while ( ( cqe = uring_cqe_peek ( &worker->uring ) ) != NULL ) {
+		struct io_uring_cqe cqe_copy = *cqe;
+		uring_cqe_seen ( &worker->uring );
+
+		if ( cqe_copy.user_data )
+			proxy_uring_complete ( worker, &cqe_copy );
+	}
+
+	while ( worker->uring_nobufs != NULL && worker->uring_bufs_free > 0 ) {
+		struct proxy_uring_flow *flow = worker->uring_nobufs;
+		worker->uring_nobufs = flow->nobufs_next;
+		flow->nobufs = 0;
+
+		if ( proxy_uring_recv ( flow->session, flow->side ) )
+			proxy_session_close ( flow->session );
+	}
+
+	return;
+}
+
+static int proxy_uring_start ( proxy_session_t *session )
+{
+	proxy_worker_t *worker = session->worker;
+	vm_t *vm = session->vm;
+	enum proxy_side side = SIDE_CLIENT;
+	// The data path doesn't need epoll anymore
+	epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->client_fd, NULL );
+	epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->vnc_fd, NULL );
+	session->uring = 1;
+
+	while ( side < SIDE_MAX ) {
+		struct proxy_uring_flow *flow = &session->flow[side];
+		flow->session = session;
+		flow->side    = side;
+		flow->head    = flow->tail = -1;
+
+		if ( proxy_uring_recv ( session, side ) )
+			return -1;
+
+		side++;
+	}
+
+	return 0;
+}
+
+static void proxy_uring_close ( proxy_session_t *session )
+{
+	proxy_worker_t *worker = session->worker;
+	vm_t *vm = session->vm;
+	enum proxy_side side = SIDE_CLIENT;
+
+	// Make the requests in flight complete, the session will be free()-d after that
+	if ( vm->client_fd )
+		shutdown ( vm->client_fd, SHUT_RDWR );
+
+	if ( vm->vnc_fd )
+		shutdown ( vm->vnc_fd, SHUT_RDWR );
+
+	while ( side < SIDE_MAX ) {
+		struct proxy_uring_flow *flow = &session->flow[side++];
+		proxy_uring_nobufs_unlink ( worker, flow );
+
+		if ( flow->sends_inflight == 0 )
+			proxy_uring_flush ( worker, flow );
+	}
+
+	return;
+}
+#endif
+
+/*
+ * The process of the VM exited (its pidfd is readable). It's reaped here,
+ * so a crashed spare VM is noticed and replaced in milliseconds instead of
+ * staying in the pool until a client gets it.
+ */
+static void proxy_vm_exited ( proxy_session_t *session )
+{
+	ctx_t *ctx_p = session->worker->ctx_p;
+	vm_t *vm = session->vm;
+	siginfo_t info = {0};
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+
+	if ( vm->pid <= 0 || waitid ( P_PIDFD, vm->pidfd, &info, WEXITED | WNOHANG ) == -1 || info.si_pid == 0 ) {
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+		return;
+	}
+
+	if ( kvmpool_state_isspare ( vm->state ) )
+		warning ( "A spare VM (vnc_id == %i) died", vm->vnc_id );
+
+	kvmpool_vm_reaped ( ctx_p, vm, info.si_code == CLD_EXITED ? info.si_status << 8 : info.si_status );
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	proxy_session_close ( session );
+	return;
+}
+
+// Records the time-to-ready of the VM
+static void proxy_vm_ready ( proxy_session_t *session )
+{
+	ctx_t *ctx_p = session->worker->ctx_p;
+	vm_t *vm = session->vm;
+	uint64_t now = kvmpool_now_ms();
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+
+	kvmpool_vm_booted ( ctx_p, vm, now - vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_SPAWNING] );
+
+	// The client could be attached while booting
+	if ( vm->state == VMST_BOOTING ) {
+		// "--recycle": the clean state is saved first, see recycle.c
+		if ( ctx_p->recycle_tag != NULL && !vmtable_cold ( &ctx_p->vmtable, vm )->clean )
+			recycle_push ( ctx_p, vm );
+		else {
+			vmtable_setstate ( &ctx_p->vmtable, vm, VMST_READY );
+			kvmpool_vm_ready ( ctx_p, vm );
+		}
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	debug ( 2, "vm->vnc_id == %i: ready in %llu ms", vm->vnc_id, ( unsigned long long ) ( now - vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_SPAWNING] ) );
+	return;
+}
+
+static void proxy_agent_close ( proxy_session_t *session )
+{
+	if ( session->agent == NULL )
+		return;
+
+	epoll_ctl ( session->worker->epoll_fd, EPOLL_CTL_DEL, session->agent->fd, NULL );
+	close ( session->agent->fd );
+	qmp_free ( session->agent );
+	session->agent = NULL;
+	return;
+}
+
+// The guest is up: the VM is ready (and its boot slot is released)
+static void proxy_booted ( proxy_session_t *session )
+{
+	proxy_booting_unlink ( session );
+	proxy_agent_close ( session );
+	session->boot_at = 0;
+	proxy_vm_ready ( session );
+	return;
+}
+
+// The guest agent listens as soon as QEMU runs, the guest answers when its agent is started
+static int proxy_agent_connect ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	struct sockaddr_un sun = {0};
+	int fd;
+	sun.sun_family = AF_UNIX;
+	kvmpool_agentpath ( session->worker->ctx_p, vm->vnc_id, sun.sun_path, sizeof ( sun.sun_path ) );
+	SAFE ( ( fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0, return -1 );
+
+	if ( connect ( fd, ( struct sockaddr * ) &sun, sizeof ( sun ) ) ) {
+		debug ( 5, "connect() to the guest agent of the VM (vnc_id == %i): %s", vm->vnc_id, strerror ( errno ) );
+		close ( fd );
+		return -1;
+	}
+
+	session->agent = qmp_new ( fd );
+
+	if ( proxy_epoll_add ( session->worker, fd, &session->ep_agent ) ) {
+		error ( "Cannot add fd %i to the epoll set", fd );
+		proxy_agent_close ( session );
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Pings the guest agent until it answers (its socket buffers the pings
+ * until the agent reads them), or just waits for "--boot-delay".
+ */
+static void proxy_boot_check ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	uint64_t now = kvmpool_now_ms();
+
+	if ( !session->worker->ctx_p->flags[GUEST_AGENT] ) {
+		proxy_booted ( session );
+		return;
+	}
+
+	if ( now >= session->boot_deadline ) {
+		warning ( "The guest agent of the VM (vnc_id == %i) doesn't answer, considering the guest booted", vm->vnc_id );
+		proxy_booted ( session );
+		return;
+	}
+
+	session->boot_at = now + KVMPOOL_AGENT_PING_INTERVAL;
+
+	if ( session->agent == NULL && proxy_agent_connect ( session ) )
+		return;
+
+	debug ( 7, "vm->vnc_id == %i: guest-ping", vm->vnc_id );
+
+	if ( qmp_send ( session->agent, "{\"execute\": \"guest-ping\"}", -1 ) )
+		proxy_agent_close ( session );	// Reconnected on the next ping
+
+	return;
+}
+
+static void proxy_agent_event ( proxy_session_t *session )
+{
+	char *line;
+	int rc;
+
+	while ( ( rc = qmp_readline ( session->agent, &line ) ) == 1 )
+		if ( qmp_msgtype ( line ) == QMP_MSG_RETURN ) {
+			debug ( 3, "vm->vnc_id == %i: the guest agent answered", session->vm->vnc_id );
+			proxy_booted ( session );
+			return;
+		}
+
+	if ( rc < 0 )
+		proxy_agent_close ( session );
+
+	return;
+}
+
+/*
+ * The RFB handshake (or the QMP negotiation) is done as soon as QEMU
+ * runs, while the guest is still in its firmware. So a spawned VM stays
+ * VMST_BOOTING (and keeps its boot slot) until its guest is up: until
+ * "--boot-delay" seconds since the spawn and, with "--guest-agent", until
+ * the guest agent answers "guest-ping". A reverted VM ("--recycle") is
+ * ready at once, it's a snapshot of a booted guest.
+ */
+static void proxy_boot_start ( proxy_session_t *session )
+{
+	proxy_worker_t *worker = session->worker;
+	ctx_t *ctx_p = worker->ctx_p;
+	vm_cold_t *cold;
+	uint64_t spawned_at;
+	int booting;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	cold       = vmtable_cold ( &ctx_p->vmtable, session->vm );
+	booting    = cold->booting;
+	spawned_at = cold->state_at[VMST_SPAWNING];
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+	if ( !booting || ( !ctx_p->flags[GUEST_AGENT] && !ctx_p->flags[BOOT_DELAY] ) ) {
+		proxy_vm_ready ( session );
+		return;
+	}
+
+	debug ( 3, "vm->vnc_id == %i: waiting for the guest", session->vm->vnc_id );
+	session->boot_at       = spawned_at + ctx_p->flags[BOOT_DELAY] * 1000;
+	session->boot_deadline = session->boot_at + KVMPOOL_BOOT_TIMEOUT;
+	session->boot_next     = worker->booting;
+	worker->booting        = session;
+	// Checked by proxy_booting_check() after the current batch of events
+	return;
+}
+
+/*
+ * "--handoff": the client socket is passed to the VM (QMP "getfd" +
+ * "add_client"), so QEMU serves it directly and the data never passes
+ * through kvm-pool. The QMP connection is kept to get VNC_DISCONNECTED
+ * (or a hangup if the VM is gone).
+ */
+#define PROXY_QMP_FDNAME "kvm-pool-client"
+
+static void proxy_handed_over ( proxy_session_t *session )
+{
+	proxy_worker_t *worker = session->worker;
+	vm_t *vm = session->vm;
+	debug ( 3, "vm->vnc_id == %i: vm->client_fd == %i is handed over", vm->vnc_id, vm->client_fd );
+	epoll_ctl ( worker->epoll_fd, EPOLL_CTL_DEL, vm->client_fd, NULL );
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	close ( vm->client_fd );
+	vm->client_fd = -1;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	return;
+}
+
+static int proxy_handoff_attach ( proxy_session_t *session )
+{
+	if ( !session->attached || session->qmp_state != PQS_READY )
+		return 0;
+
+	session->qmp_state = PQS_GETFD;
+	return qmp_send ( session->qmp, "{\"execute\": \"getfd\", \"arguments\": {\"fdname\": \"" PROXY_QMP_FDNAME "\"}}", session->vm->client_fd );
+}
+
+static int proxy_handoff_event ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	char *line;
+	int rc;
+
+	while ( ( rc = qmp_readline ( session->qmp, &line ) ) == 1 ) {
+		qmp_msgtype_t type = qmp_msgtype ( line );
+
+		if ( type == QMP_MSG_EVENT ) {
+			if ( session->qmp_state == PQS_ATTACHED && qmp_isevent ( line, "VNC_DISCONNECTED" ) ) {
+				debug ( 3, "vm->vnc_id == %i: the client disconnected", vm->vnc_id );
+				return -1;
+			}
+
+			continue;
+		}
+
+		if ( type != ( session->qmp_state == PQS_GREETING ? QMP_MSG_GREETING : QMP_MSG_RETURN ) ) {
+			error ( "Unexpected QMP reply from the VM (vnc_id == %i): %s", vm->vnc_id, line );
+			return -1;
+		}
+
+		switch ( session->qmp_state ) {
+			case PQS_GREETING:
+				rc = qmp_send ( session->qmp, "{\"execute\": \"qmp_capabilities\"}", -1 );
+				session->qmp_state = PQS_CAPABILITIES;
+				break;
+
+			case PQS_CAPABILITIES:
+				session->qmp_state = PQS_READY;
+				proxy_boot_start ( session );
+				rc = proxy_handoff_attach ( session );
+				break;
+
+			case PQS_GETFD:
+				rc = qmp_send ( session->qmp, "{\"execute\": \"add_client\", \"arguments\": {\"protocol\": \"vnc\", \"fdname\": \"" PROXY_QMP_FDNAME "\"}}", -1 );
+				session->qmp_state = PQS_ADD_CLIENT;
+				break;
+
+			case PQS_ADD_CLIENT:
+				proxy_handed_over ( session );
+				session->qmp_state = PQS_ATTACHED;
+				rc = 0;
+				break;
+
+			case PQS_READY:
+			case PQS_ATTACHED:
+				rc = 0;
+				break;
+		}
+
+		if ( rc )
+			return -1;
+	}
+
+	return rc;
+}
+
+static int proxy_handoff_start ( proxy_session_t *session )
+{
+	debug ( 3, "vm->qmp_fd == %i", session->vm->qmp_fd );
+	session->state     = PSS_HANDOFF;
+	session->qmp       = qmp_new ( session->vm->qmp_fd );
+	session->qmp_state = PQS_GREETING;
+	return proxy_handoff_event ( session );
+}
+
+/*
+ * The VM is not listening, yet. Retrying with an exponential backoff (the
+ * unix sockets are also watched with inotify, see proxy_readinotify()).
+ */
+static int proxy_connect_retry ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	uint64_t now = kvmpool_now_ms();
+
+	if ( now >= session->connect_deadline ) {
+		error ( "Cannot connect to the VM (vnc_id == %i)", vm->vnc_id );
+		return -1;
+	}
+
+	if ( session->connect_delay < KVMPOOL_CONNECT_BACKOFF_MIN )
+		session->connect_delay = KVMPOOL_CONNECT_BACKOFF_MIN;
+	else if ( session->connect_delay * 2 <= KVMPOOL_CONNECT_BACKOFF_MAX )
+		session->connect_delay *= 2;
+
+	session->connect_at = now + session->connect_delay;
+	return 0;
+}
+
+static int proxy_relay_start ( proxy_session_t *session )
+{
+	debug ( 3, "vm->client_fd == %i; vm->vnc_fd == %i", session->vm->client_fd, session->vm->vnc_fd );
+	session->state = PSS_RELAYING;
+
+	// Every backend relies on EAGAIN of both sockets to never stall the worker
+	proxy_fd_setblock ( session->vm->client_fd, 1 );
+	proxy_fd_setblock ( session->vm->vnc_fd, 1 );
+
+	if ( session->worker->ctx_p->io_backend == IOB_SPLICE )
+		if ( proxy_splice_start ( session ) )
+			return -1;
+
+#ifdef IO_URING_SUPPORT
+
+	if ( session->worker->uring_enabled )
+		return proxy_uring_start ( session );
+
+#endif
+
+	// The epoll set is edge-triggered, so the data that came during the handshake has to be picked up explicitly
+	if ( proxy_relay ( session, SIDE_CLIENT ) )
+		return -1;
+
+	if ( proxy_relay ( session, SIDE_VNC ) )
+		return -1;
+
+	return 0;
+}
+
+static int proxy_greeting_event ( proxy_session_t *session )
+{
+	int rc = rfb_client_handshake ( &session->rfb, session->vm->client_fd );
+
+	if ( rc <= 0 )
+		return rc;
+
+	return proxy_relay_start ( session );
+}
+
+static int proxy_greeting_start ( proxy_session_t *session )
+{
+	if ( !session->attached ) {
+		debug ( 3, "vm->vnc_id == %i: ready", session->vm->vnc_id );
+		return 0;
+	}
+
+	session->state = PSS_GREETING;
+
+	if ( rfb_client_start ( &session->rfb, session->vm->client_fd ) )
+		return -1;
+
+	return proxy_greeting_event ( session );
+}
+
+static int proxy_handshake_event ( proxy_session_t *session )
+{
+	int rc = rfb_upstream_handshake ( &session->rfb, session->vm->vnc_fd );
+
+	if ( rc <= 0 )
+		return rc;
+
+	proxy_boot_start ( session );
+	return proxy_greeting_start ( session );
+}
+
+static int proxy_connected ( proxy_session_t *session )
+{
+	debug ( 3, "vm->vnc_id == %i", session->vm->vnc_id );
+	proxy_connecting_unlink ( session );
+
+	if ( session->worker->ctx_p->flags[HANDOFF] )
+		return proxy_handoff_start ( session );
+
+	session->state = PSS_HANDSHAKE;
+	return proxy_handshake_event ( session );
+}
+
+/*
+ * The socket the session connects to: the VNC server of the VM or, with
+ * "--handoff", its QMP monitor.
+ */
+static inline int *proxy_upstream_fd_p ( proxy_session_t *session )
+{
+	return session->worker->ctx_p->flags[HANDOFF] ? &session->vm->qmp_fd : &session->vm->vnc_fd;
+}
+
+static socklen_t proxy_upstream_addr ( proxy_session_t *session, struct sockaddr_storage *addr )
+{
+	ctx_t *ctx_p = session->worker->ctx_p;
+	vm_t *vm = session->vm;
+	memset ( addr, 0, sizeof ( *addr ) );
+
+	if ( ctx_p->flags[HANDOFF] ) {
+		struct sockaddr_un *sun = ( struct sockaddr_un * ) addr;
+		sun->sun_family = AF_UNIX;
+		kvmpool_qmppath ( ctx_p, vm->vnc_id, sun->sun_path, sizeof ( sun->sun_path ) );
+		return sizeof ( *sun );
+	}
+
+	switch ( ctx_p->vnc_transport ) {
+		case VNCT_UNIX: {
+				struct sockaddr_un *sun = ( struct sockaddr_un * ) addr;
+				sun->sun_family = AF_UNIX;
+				kvmpool_vncpath ( ctx_p, vm->vnc_id, sun->sun_path, sizeof ( sun->sun_path ) );
+				return sizeof ( *sun );
+			}
+
+		default: {
+				struct sockaddr_in *sin = ( struct sockaddr_in * ) addr;
+				sin->sin_family      = AF_INET;
+				sin->sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+				sin->sin_port        = htons ( KVMPOOL_VNC_PORT_BASE + vm->vnc_id );
+				return sizeof ( *sin );
+			}
+	}
+}
+
+static int proxy_connect ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	struct sockaddr_storage dest;
+	socklen_t dest_len;
+	int sock;
+
+	if ( vm->pid <= 0 )
+		return -1;
+
+	dest_len = proxy_upstream_addr ( session, &dest );
+	SAFE ( ( sock = socket ( dest.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0, return -1 );
+
+	// Note: a non-blocking connect() to a unix socket returns EAGAIN (not EINPROGRESS) if the backlog is full
+	if ( connect ( sock, ( struct sockaddr * ) &dest, dest_len ) && errno != EINPROGRESS ) {
+		debug ( 5, "connect() to the VM (vnc_id == %i): %s", vm->vnc_id, strerror ( errno ) );
+		close ( sock );
+		return proxy_connect_retry ( session );
+	}
+
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	*proxy_upstream_fd_p ( session ) = sock;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	session->connect_at = 0;
+	SAFE ( proxy_epoll_add ( session->worker, sock, &session->ep[SIDE_VNC] ), return -1 );
+	return 0;
+}
+
+static int proxy_connect_finish ( proxy_session_t *session )
+{
+	vm_t *vm = session->vm;
+	int *fd_p = proxy_upstream_fd_p ( session );
+	int err = 0;
+	socklen_t err_len = sizeof ( err );
+
+	if ( getsockopt ( *fd_p, SOL_SOCKET, SO_ERROR, &err, &err_len ) )
+		err = errno;
+
+	if ( !err )
+		return proxy_connected ( session );
+
+	debug ( 5, "connect() to the VM (vnc_id == %i): %s", vm->vnc_id, strerror ( err ) );
+	epoll_ctl ( session->worker->epoll_fd, EPOLL_CTL_DEL, *fd_p, NULL );
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	close ( *fd_p );
+	*fd_p = 0;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	return proxy_connect_retry ( session );
+}
+
+static void proxy_session_start ( proxy_worker_t *worker, vm_t *vm )
+{
+	proxy_session_t *session = xcalloc ( 1, sizeof ( *session ) );
+	debug ( 3, "vm->vnc_id == %i", vm->vnc_id );
+	session->vm     = vm;
+	session->worker = worker;
+	session->state  = PSS_CONNECTING;
+	session->ep[SIDE_CLIENT].session = session;
+	session->ep[SIDE_CLIENT].side    = SIDE_CLIENT;
+	session->ep[SIDE_VNC].session    = session;
+	session->ep[SIDE_VNC].side       = SIDE_VNC;
+	session->ep_process.session      = session;
+	session->ep_process.side         = SIDE_MAX;
+	session->ep_agent.session        = session;
+	session->ep_agent.side           = SIDE_AGENT;
+	session->next      = worker->connecting;
+	worker->connecting = session;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	vm->session = session;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	// Waits for the VM to be spawned (PMT_SPAWNED), see kvmpool_spawn()
+	return;
+}
+
+static void proxy_session_spawned ( proxy_worker_t *worker, vm_t *vm )
+{
+	proxy_session_t *session;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	session = vm->session;
+
+	// The VM could be closed (and the slot reused) meanwhile
+	if ( session == NULL || session->worker != worker || session->state != PSS_CONNECTING || session->connect_deadline || vm->pid <= 0 ) {
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+		debug ( 3, "vm->vnc_id == %i: the session is already closed", vm->vnc_id );
+		return;
+	}
+
+	session->connect_deadline = vmtable_cold ( &worker->ctx_p->vmtable, vm )->state_at[VMST_SPAWNING] + KVMPOOL_CONNECT_TIMEOUT;
+
+	if ( vm->pidfd ) {
+		struct epoll_event ev = {0};
+		ev.events   = EPOLLIN;
+		ev.data.ptr = &session->ep_process;
+
+		if ( epoll_ctl ( worker->epoll_fd, EPOLL_CTL_ADD, vm->pidfd, &ev ) == -1 )
+			error ( "Cannot add the pidfd of the VM (vnc_id == %i) to the epoll set", vm->vnc_id );
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+	if ( proxy_connect ( session ) )
+		proxy_session_close ( session );
+
+	return;
+}
+
+static void proxy_session_attach ( proxy_worker_t *worker, vm_t *vm, int client_fd )
+{
+	proxy_session_t *session;
+	int rc = 0;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	session = vm->session;
+
+	// The VM could be closed (and even replaced) since it was claimed by the acceptor
+	if ( session == NULL || session->worker != worker || session->attached || vm->state != VMST_ATTACHED || vm->client_fd ) {
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+		debug ( 3, "vm->vnc_id == %i: the session is already closed", vm->vnc_id );
+		close ( client_fd );
+		return;
+	}
+
+	vm->client_fd = client_fd;
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	debug ( 3, "vm->vnc_id == %i; vm->client_fd == %i", vm->vnc_id, client_fd );
+
+	session->attached = 1;
+
+	if ( proxy_epoll_add ( worker, client_fd, &session->ep[SIDE_CLIENT] ) ) {
+		error ( "Cannot add fd %i to the epoll set", client_fd );
+		proxy_session_close ( session );
+		return;
+	}
+
+	switch ( session->state ) {
+		case PSS_HANDSHAKE:
+			if ( session->rfb.state == RFB_READY )
+				rc = proxy_greeting_start ( session );
+
+			break;
+
+		case PSS_HANDOFF:
+			rc = proxy_handoff_attach ( session );
+			break;
+
+		default:
+			break;	// Will be continued when connected
+	}
+
+	if ( rc )
+		proxy_session_close ( session );
+
+	return;
+}
+
+// Closes a VM trimmed by the controller (see kvmpool_trim())
+static void proxy_session_drain ( proxy_worker_t *worker, vm_t *vm )
+{
+	proxy_session_t *session;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	session = vm->session;
+
+	// The VM could be closed (and the slot reused) meanwhile
+	if ( vm->state != VMST_DRAINING || session == NULL || session->worker != worker ) {
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+		return;
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	debug ( 3, "vm->vnc_id == %i", vm->vnc_id );
+	proxy_session_close ( session );
+	return;
+}
+
+static void proxy_endpoint_event ( struct proxy_endpoint *ep, uint32_t events )
+{
+	proxy_session_t *session = ep->session;
+	debug ( 7, "side == %i; events == 0x%x", ep->side, events );
+
+	if ( ep->side == SIDE_MAX ) {
+		if ( session->state != PSS_CLOSED )
+			proxy_vm_exited ( session );
+
+		return;
+	}
+
+	if ( ep->side == SIDE_AGENT ) {
+		if ( session->agent != NULL )
+			proxy_agent_event ( session );
+
+		return;
+	}
+
+	switch ( session->state ) {
+		case PSS_CLOSED:
+			return;
+
+		case PSS_CONNECTING:
+			if ( ep->side == SIDE_VNC && session->connect_at == 0 ) {
+				if ( proxy_connect_finish ( session ) )
+					proxy_session_close ( session );
+
+				return;
+			}
+
+			if ( ep->side == SIDE_CLIENT && ( events & ( EPOLLHUP | EPOLLERR | EPOLLRDHUP ) ) )
+				proxy_session_close ( session );
+
+			return;
+
+		case PSS_HANDSHAKE:
+			if ( ep->side == SIDE_VNC ) {
+				// When the handshake is complete, nothing is expected from the server until ClientInit
+				if ( session->rfb.state == RFB_READY ) {
+					if ( events & ( EPOLLHUP | EPOLLERR | EPOLLRDHUP ) )
+						proxy_session_close ( session );
+
+					return;
+				}
+
+				if ( proxy_handshake_event ( session ) )
+					proxy_session_close ( session );
+
+				return;
+			}
+
+			if ( events & ( EPOLLHUP | EPOLLERR | EPOLLRDHUP ) )
+				proxy_session_close ( session );
+
+			return;
+
+		case PSS_GREETING:
+			if ( ep->side == SIDE_CLIENT ) {
+				if ( proxy_greeting_event ( session ) )
+					proxy_session_close ( session );
+
+				return;
+			}
+
+			if ( events & ( EPOLLHUP | EPOLLERR | EPOLLRDHUP ) )
+				proxy_session_close ( session );
+
+			return;
+
+		case PSS_HANDOFF:
+			if ( ep->side == SIDE_VNC ) {
+				if ( proxy_handoff_event ( session ) )
+					proxy_session_close ( session );
+
+				return;
+			}
+
+			// The client socket is watched only until it's handed over
+			if ( events & ( EPOLLHUP | EPOLLERR | EPOLLRDHUP ) )
+				proxy_session_close ( session );
+
+			return;
+
+		case PSS_RELAYING:
+			// The side became writable: flushing the data waiting in the pipe or in the ring
+			if ( ( events & EPOLLOUT ) && ( session->pipe_pending[!ep->side] || session->buf[!ep->side].len ) )
+				if ( proxy_relay ( session, !ep->side ) ) {
+					proxy_session_close ( session );
+					return;
+				}
+
+			if ( ! ( events & ( EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP ) ) )
+				return;
+
+			if ( proxy_relay ( session, ep->side ) )
+				proxy_session_close ( session );
+
+			return;
+	}
+
+	return;
+}
+
+static int proxy_timeout ( proxy_worker_t *worker )
+{
+	proxy_session_t *session = worker->connecting;
+	uint64_t now = 0;
+	int timeout = -1;
+
+	if ( worker->bufpool_trim_at ) {
+		now = kvmpool_now_ms();
+		timeout = worker->bufpool_trim_at > now ? worker->bufpool_trim_at - now : 0;
+	}
+
+	while ( session != NULL ) {
+		if ( session->connect_at ) {
+			if ( !now )
+				now = kvmpool_now_ms();
+
+			int session_timeout = session->connect_at > now ? session->connect_at - now : 0;
+
+			if ( timeout == -1 || session_timeout < timeout )
+				timeout = session_timeout;
+		}
+
+		session = session->next;
+	}
+
+	session = worker->booting;
+
+	while ( session != NULL ) {
+		if ( !now )
+			now = kvmpool_now_ms();
+
+		int session_timeout = session->boot_at > now ? session->boot_at - now : 0;
+
+		if ( timeout == -1 || session_timeout < timeout )
+			timeout = session_timeout;
+
+		session = session->boot_next;
+	}
+
+	return timeout;
+}
+
+static void proxy_connecting_check ( proxy_worker_t *worker )
+{
+	proxy_session_t *session = worker->connecting;
+	uint64_t now = kvmpool_now_ms();
+
+	while ( session != NULL ) {
+		proxy_session_t *session_next = session->next;
+
+		if ( session->connect_at && session->connect_at <= now )
+			if ( proxy_connect ( session ) )
+				proxy_session_close ( session );
+
+		session = session_next;
+	}
+
+	return;
+}
+
+static void proxy_booting_check ( proxy_worker_t *worker )
+{
+	proxy_session_t *session = worker->booting;
+	uint64_t now = kvmpool_now_ms();
+
+	while ( session != NULL ) {
+		proxy_session_t *session_next = session->boot_next;
+
+		if ( session->boot_at <= now )
+			proxy_boot_check ( session );
+
+		session = session_next;
+	}
+
+	return;
+}
+
+static void proxy_bufpool_check ( proxy_worker_t *worker )
+{
+	if ( !worker->bufpool_trim_at || worker->bufpool_trim_at > kvmpool_now_ms() )
+		return;
+
+	bufpool_trim ( &worker->bufpool );
+	worker->bufpool_trim_at = 0;
+	return;
+}
+
+/*
+ * A socket appeared in the runtime directory: the VM is going to listen
+ * on it, so the connect() is retried immediately instead of waiting for
+ * the backoff.
+ */
+static void proxy_readinotify ( proxy_worker_t *worker )
+{
+	char buf[sizeof ( struct inotify_event ) + NAME_MAX + 1] __attribute__ ( ( aligned ( __alignof__ ( struct inotify_event ) ) ) );
+	uint64_t now = kvmpool_now_ms();
+	ssize_t len;
+
+	while ( ( len = read ( worker->inotify_fd, buf, sizeof ( buf ) ) ) > 0 ) {
+		char *ptr = buf;
+
+		while ( ptr < buf + len ) {
+			struct inotify_event *ev = ( struct inotify_event * ) ptr;
+			proxy_session_t *session = worker->connecting;
+			ptr += sizeof ( *ev ) + ev->len;
+
+			if ( !ev->len )
+				continue;
+
+			debug ( 9, "inotify: %s", ev->name );
+
+			while ( session != NULL ) {
+				struct sockaddr_storage addr;
+				char *name;
+
+				if ( session->connect_at && proxy_upstream_addr ( session, &addr ) && addr.ss_family == AF_UNIX ) {
+					name = strrchr ( ( ( struct sockaddr_un * ) &addr )->sun_path, '/' );
+
+					if ( name != NULL && !strcmp ( &name[1], ev->name ) ) {
+						session->connect_at    = now;
+						session->connect_delay = 0;
+					}
+				}
+
+				session = session->next;
+			}
+		}
+	}
+
+	return;
+}
+
+static void proxy_readpipe ( proxy_worker_t *worker )
+{
+	ctx_t *ctx_p = worker->ctx_p;
+	struct proxy_msg msg;
+
+	while ( read ( worker->pipe_fd[0], &msg, sizeof ( msg ) ) == sizeof ( msg ) ) {
+		debug ( 9, "msg.type == %i; msg.vm_idx == %i", msg.type, msg.vm_idx );
+
+		switch ( msg.type ) {
+			case PMT_WAKEUP:
+				break;
+
+			case PMT_PREPARE:
+				proxy_session_start ( worker, &ctx_p->vmtable.vms[msg.vm_idx] );
+				break;
+
+			case PMT_SPAWNED:
+				proxy_session_spawned ( worker, &ctx_p->vmtable.vms[msg.vm_idx] );
+				break;
+
+			case PMT_ATTACH:
+				proxy_session_attach ( worker, &ctx_p->vmtable.vms[msg.vm_idx], msg.client_fd );
+				break;
+
+			case PMT_CLOSE:
+				proxy_session_drain ( worker, &ctx_p->vmtable.vms[msg.vm_idx] );
+				break;
+		}
+	}
+
+	return;
+}
+
+static void proxy_sessions_free ( proxy_worker_t *worker, int force )
+{
+	proxy_session_t **session_pp = &worker->closed;
+
+	while ( *session_pp != NULL ) {
+		proxy_session_t *session = *session_pp;
+#ifdef IO_URING_SUPPORT
+
+		if ( session->uring_ops && !force ) {
+			session_pp = &session->next;
+			continue;
+		}
+
+#endif
+		*session_pp = session->next;
+		free ( session );
+	}
+
+	return;
+}
+
+static void *proxy_worker_loop ( void *_worker )
+{
+	proxy_worker_t *worker = _worker;
+	ctx_t *ctx_p = worker->ctx_p;
+	struct epoll_event events[KVMPOOL_PROXY_EPOLL_EVENTS];
+	debug ( 2, "worker #%i", worker->id );
+
+	while ( ctx_p->state == STATE_RUNNING ) {
+		int i, n;
+		n = epoll_wait ( worker->epoll_fd, events, KVMPOOL_PROXY_EPOLL_EVENTS, proxy_timeout ( worker ) );
+		debug ( 8, "epoll_wait() -> %i", n );
+
+		if ( n < 0 ) {
+			if ( errno == EINTR )
+				continue;
+
+			error ( "Got error from epoll_wait() in worker #%i", worker->id );
+			break;
+		}
+
+		i = 0;
+
+		while ( i < n ) {
+			if ( events[i].data.ptr == NULL )
+				proxy_readpipe ( worker );
+			else if ( events[i].data.ptr == &worker->inotify_fd )
+				proxy_readinotify ( worker );
+
+#ifdef IO_URING_SUPPORT
+			else if ( events[i].data.ptr == &worker->uring )
+				proxy_uring_reap ( worker );
+
+#endif
+			else
+				proxy_endpoint_event ( events[i].data.ptr, events[i].events );
+
+			i++;
+		}
+
+		proxy_connecting_check ( worker );
+		proxy_booting_check ( worker );
+		proxy_bufpool_check ( worker );
+#ifdef IO_URING_SUPPORT
+
+		if ( worker->uring_enabled )
+			uring_submit ( &worker->uring );
+
+#endif
+		proxy_sessions_free ( worker, 0 );
+	}
+
+	debug ( 2, "worker #%i: finish", worker->id );
+	return NULL;
+}
+
+static int proxy_msg_send ( proxy_worker_t *worker, enum proxy_msg_type type, int vm_idx, int client_fd )
+{
+	struct proxy_msg msg = {0};
+	msg.type      = type;
+	msg.vm_idx    = vm_idx;
+	msg.client_fd = client_fd;
+
+	// sizeof(msg) < PIPE_BUF, so the write is atomic
+	if ( write ( worker->pipe_fd[1], &msg, sizeof ( msg ) ) != sizeof ( msg ) ) {
+		error ( "Cannot pass a message to worker #%i", worker->id );
+		return errno ? errno : EIO;
+	}
+
+	return 0;
+}
+
+// The least loaded worker of the node ("--numa"), or of all if "node" is -1
+static proxy_worker_t *proxy_worker_pick ( ctx_t *ctx_p, int node )
+{
+	proxy_worker_t *worker = NULL;
+	int i = 0;
+
+	while ( i < ctx_p->proxy_workers_count ) {
+		proxy_worker_t *candidate = &ctx_p->proxy_workers[i++];
+
+		if ( node >= 0 && candidate->node != node )
+			continue;
+
+		if ( worker == NULL || candidate->sessions_count < worker->sessions_count )
+			worker = candidate;
+	}
+
+	return worker;
+}
+
+/*
+ * Called when a spare VM is queued: the session is started in advance, so
+ * the client is attached to a ready-to-use connection. Requires the
+ * global lock.
+ */
+int proxy_prepare ( ctx_t *ctx_p, vm_t *vm )
+{
+	int vm_idx = vmtable_idx ( &ctx_p->vmtable, vm );
+	proxy_worker_t *worker = proxy_worker_pick ( ctx_p, vmtable_cold ( &ctx_p->vmtable, vm )->node - 1 );
+	int rc;
+
+	// No worker on the node of the VM
+	if ( worker == NULL )
+		worker = proxy_worker_pick ( ctx_p, -1 );
+
+	debug ( 3, "vm_idx == %i -> worker #%i", vm_idx, worker->id );
+	__sync_fetch_and_add ( &worker->sessions_count, 1 );
+	// Before the message: the worker could make the VM ready right away
+	vm->worker = worker;
+
+	if ( ( rc = proxy_msg_send ( worker, PMT_PREPARE, vm_idx, -1 ) ) ) {
+		__sync_fetch_and_sub ( &worker->sessions_count, 1 );
+		vm->worker = NULL;
+		return rc;
+	}
+
+	return 0;
+}
+
+// Called when the VM is forked: the worker starts connecting to it
+int proxy_spawned ( ctx_t *ctx_p, vm_t *vm )
+{
+	proxy_worker_t *worker = vm->worker;
+
+	if ( worker == NULL )
+		return EINVAL;
+
+	return proxy_msg_send ( worker, PMT_SPAWNED, vmtable_idx ( &ctx_p->vmtable, vm ), -1 );
+}
+
+/*
+ * Passes the client to the worker of the VM. The VM has to be claimed by
+ * the caller (see kvmpool_claim()); the worker takes the ownership of
+ * "client_fd" and checks if the VM is still alive.
+ */
+int proxy_attach ( ctx_t *ctx_p, vm_t *vm, int client_fd )
+{
+	proxy_worker_t *worker = vm->worker;
+	int vm_idx = vmtable_idx ( &ctx_p->vmtable, vm );
+
+	if ( worker == NULL )
+		return EINVAL;	// The slot is being reused
+
+	debug ( 3, "vm_idx == %i -> worker #%i", vm_idx, worker->id );
+	return proxy_msg_send ( worker, PMT_ATTACH, vm_idx, client_fd );
+}
+
+// Asks the worker of the VM to close it
+int proxy_close ( ctx_t *ctx_p, vm_t *vm )
+{
+	proxy_worker_t *worker = vm->worker;
+
+	if ( worker == NULL )
+		return EINVAL;
+
+	return proxy_msg_send ( worker, PMT_CLOSE, vmtable_idx ( &ctx_p->vmtable, vm ), -1 );
+}
+
+int proxy_init ( ctx_t *ctx_p )
+{
+	int i = 0, ncpus = sysconf ( _SC_NPROCESSORS_ONLN );
+	ctx_p->proxy_workers_count = ctx_p->flags[PROXY_WORKERS];
+	ctx_p->proxy_workers = xcalloc ( ctx_p->proxy_workers_count, sizeof ( *ctx_p->proxy_workers ) );
+	debug ( 2, "ctx_p->proxy_workers_count == %i", ctx_p->proxy_workers_count );
+#ifdef IO_URING_SUPPORT
+
+	// The backend is chosen for the whole pool, before any worker runs
+	if ( ctx_p->io_backend == IOB_IO_URING ) {
+		uring_t probe;
+
+		if ( ( errno = uring_init ( &probe, KVMPOOL_URING_ENTRIES, KVMPOOL_URING_BUFS, KVMPOOL_URING_BUFSIZE ) ) ) {
+			warning ( "Cannot initialize io_uring, falling back to io-backend \"recv\"" );
+			ctx_p->io_backend = IOB_RECV;
+		} else
+			uring_deinit ( &probe );
+	}
+
+#endif
+
+	while ( i < ctx_p->proxy_workers_count ) {
+		proxy_worker_t *worker = &ctx_p->proxy_workers[i];
+		struct epoll_event ev = {0};
+		pthread_attr_t attr;
+		worker->ctx_p = ctx_p;
+		worker->id    = i;
+		critical_on ( ( worker->epoll_fd = epoll_create1 ( EPOLL_CLOEXEC ) ) == -1 );
+		critical_on ( pipe2 ( worker->pipe_fd, O_NONBLOCK | O_CLOEXEC ) == -1 );
+		bufpool_init ( &worker->bufpool, ctx_p->flags[HUGEPAGES] );
+		readyq_init ( &worker->readyq, 2 * ctx_p->vms_max );	// Stale entries are possible, see kvmpool_attach_ready()
+		ev.events   = EPOLLIN;
+		ev.data.ptr = NULL;
+		critical_on ( epoll_ctl ( worker->epoll_fd, EPOLL_CTL_ADD, worker->pipe_fd[0], &ev ) == -1 );
+		worker->inotify_fd = -1;
+
+		// The VMs' sockets are in the runtime directory
+		if ( ctx_p->vnc_transport == VNCT_UNIX || ctx_p->flags[HANDOFF] ) {
+			worker->inotify_fd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC );
+
+			if ( worker->inotify_fd == -1 || inotify_add_watch ( worker->inotify_fd, ctx_p->runtime_dir, IN_CREATE ) == -1 ) {
+				warning ( "Cannot watch the runtime directory \"%s\", falling back to polling", ctx_p->runtime_dir );
+
+				if ( worker->inotify_fd != -1 )
+					close ( worker->inotify_fd );
+
+				worker->inotify_fd = -1;
+			} else {
+				ev.events   = EPOLLIN;
+				ev.data.ptr = &worker->inotify_fd;
+				critical_on ( epoll_ctl ( worker->epoll_fd, EPOLL_CTL_ADD, worker->inotify_fd, &ev ) == -1 );
+			}
+		}
+
+#ifdef IO_URING_SUPPORT
+
+		if ( ctx_p->io_backend == IOB_IO_URING ) {
+			// It worked for the probe above, so it's not expected to fail
+			if ( ( errno = uring_init ( &worker->uring, KVMPOOL_URING_ENTRIES, KVMPOOL_URING_BUFS, KVMPOOL_URING_BUFSIZE ) ) )
+				critical ( "Cannot initialize io_uring of worker #%i", i );
+
+			worker->uring_enabled   = 1;
+			worker->uring_bufs_free = KVMPOOL_URING_BUFS;
+			worker->uring_portions  = xcalloc ( KVMPOOL_URING_BUFS, sizeof ( *worker->uring_portions ) );
+			ev.events   = EPOLLIN;
+			ev.data.ptr = &worker->uring;
+			critical_on ( epoll_ctl ( worker->epoll_fd, EPOLL_CTL_ADD, worker->uring.fd, &ev ) == -1 );
+		}
+
+#endif
+		worker->cpu  = -1;
+		worker->node = -1;
+		critical_on ( pthread_attr_init ( &attr ) );
+
+		/*
+		 * "--numa": the workers are spread over the nodes, a worker serves
+		 * the VMs of its node (see proxy_prepare()). It's pinned to the
+		 * node, or to a CPU of it if acceptors are pinned to the workers.
+		 */
+		if ( ctx_p->flags[NUMA] ) {
+			worker->node = i % numa_nodes();
+
+			if ( ctx_p->flags[ACCEPTORS] > 1 )
+				worker->cpu = numa_cpu ( worker->node, i / numa_nodes() );
+
+			if ( ( errno = numa_pin ( &attr, worker->node, worker->cpu ) ) )
+				warning ( "Cannot pin worker #%i to node #%i", i, worker->node );
+		} else if ( ctx_p->flags[ACCEPTORS] > 1 ) {
+			// Acceptors are pinned to the CPUs of their workers (see kvmpool_acceptors_init())
+			worker->cpu = i % ncpus;
+
+			if ( ( errno = pthread_attr_setaffinity_cpu ( &attr, worker->cpu ) ) )
+				warning ( "Cannot pin worker #%i to CPU %i", i, worker->cpu );
+		}
+
+		// Pinned from the start, so the memory it touches first is local
+		if ( ( errno = pthread_create ( &worker->thread, &attr, proxy_worker_loop, worker ) ) ) {
+			warning ( "Cannot pin worker #%i", i );
+			critical_on ( pthread_create ( &worker->thread, NULL, proxy_worker_loop, worker ) );
+		}
+
+		pthread_attr_destroy ( &attr );
+
+		i++;
+	}
+
+	return 0;
+}
+
+int proxy_deinit ( ctx_t *ctx_p )
+{
+	int i = 0;
+	debug ( 2, "" );
+
+	while ( i < ctx_p->proxy_workers_count ) {
+		proxy_worker_t *worker = &ctx_p->proxy_workers[i++];
+		proxy_msg_send ( worker, PMT_WAKEUP, -1, -1 );
+
+		pthread_join ( worker->thread, NULL );
+		close ( worker->epoll_fd );
+		close ( worker->pipe_fd[0] );
+		close ( worker->pipe_fd[1] );
+
+		if ( worker->inotify_fd != -1 )
+			close ( worker->inotify_fd );
+
+		proxy_sessions_free ( worker, 1 );
+		bufpool_deinit ( &worker->bufpool );
+		readyq_deinit ( &worker->readyq );
+#ifdef IO_URING_SUPPORT
+
+		if ( worker->uring_enabled ) {
+			uring_deinit ( &worker->uring );
+			free ( worker->uring_portions );
+		}
+
+#endif
+	}
+
+	i = 0;
+
+	while ( i < ctx_p->vmtable.size ) {
+		vm_t *vm = &ctx_p->vmtable.vms[i++];
+
+		if ( vm->session != NULL ) {
+			free ( vm->session );
+			vm->session = NULL;
+		}
+	}
+
+	free ( ctx_p->proxy_workers );
+	ctx_p->proxy_workers = NULL;
+	ctx_p->proxy_workers_count = 0;
+	return 0;
+}
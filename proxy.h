@@ -0,0 +1,71 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVMPOOL_PROXY_H
+#define __KVMPOOL_PROXY_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "ctx.h"
+#include "uring.h"
+#include "bufpool.h"
+#include "readyq.h"
+
+struct proxy_session;
+struct proxy_uring_flow;
+struct proxy_uring_portion;
+
+struct proxy_worker {
+	ctx_t			*ctx_p;
+	int			 id;
+	int			 cpu;	// -1 if not pinned
+	int			 node;	// "--numa": the index of the node (see numa.c), -1 if not used
+	pthread_t		 thread;
+	int			 epoll_fd;
+	int			 pipe_fd[2];
+	int			 inotify_fd;	// Watches the runtime directory, -1 if not used
+	volatile int		 sessions_count;
+	struct proxy_session	*connecting;
+	struct proxy_session	*booting;	// Waiting for the guest to boot, see proxy_boot_start()
+	struct proxy_session	*closed;
+	readyq_t		 readyq;	// Ready spare VMs of this worker (indexes in ctx_p->vmtable.vms)
+	bufpool_t		 bufpool;	// "recv" backend
+	uint64_t		 bufpool_trim_at;	// CLOCK_MONOTONIC, ms; 0 if not scheduled
+#ifdef IO_URING_SUPPORT
+	int			 uring_enabled;
+	uring_t			 uring;
+	struct proxy_uring_portion *uring_portions;
+	unsigned		 uring_bufs_free;
+	struct proxy_uring_flow	*uring_nobufs;
+#endif
+};
+typedef struct proxy_worker proxy_worker_t;
+
+extern int proxy_init ( ctx_t *ctx_p );
+extern int proxy_prepare ( ctx_t *ctx_p, vm_t *vm );
+extern int proxy_attach ( ctx_t *ctx_p, vm_t *vm, int client_fd );
+extern int proxy_spawned ( ctx_t *ctx_p, vm_t *vm );
+extern int proxy_close ( ctx_t *ctx_p, vm_t *vm );
+extern int proxy_deinit ( ctx_t *ctx_p );
+
+#endif
@@ -18,7 +18,10 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "common.h"
+
 #include <string.h>
+#include <sched.h>
 #include <pthread.h>
 #include "pthreadex.h"
 #include "malloc.h"
@@ -79,3 +82,18 @@ int pthread_mutex_reltimedlock ( pthread_mutex_t *mutex_p, long tv_sec, long tv_
 	return pthread_mutex_timedlock ( mutex_p, &abs_time );
 }
 
+int pthread_setaffinity_cpu ( pthread_t thread, int cpu )
+{
+	cpu_set_t cpuset;
+	CPU_ZERO ( &cpuset );
+	CPU_SET ( cpu, &cpuset );
+	return pthread_setaffinity_np ( thread, sizeof ( cpuset ), &cpuset );
+}
+
+int pthread_attr_setaffinity_cpu ( pthread_attr_t *attr, int cpu )
+{
+	cpu_set_t cpuset;
+	CPU_ZERO ( &cpuset );
+	CPU_SET ( cpu, &cpuset );
+	return pthread_attr_setaffinity_np ( attr, sizeof ( cpuset ), &cpuset );
+}
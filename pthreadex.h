@@ -25,4 +25,6 @@ extern int pthread_mutex_destroy_shared ( pthread_mutex_t *mutex_p );
 extern int pthread_cond_init_shared ( pthread_cond_t **cond_p );
 extern int pthread_cond_destroy_shared ( pthread_cond_t *cond_p );
 extern int pthread_mutex_reltimedlock ( pthread_mutex_t *mutex_p, long tv_sec, long tv_nsec );
+extern int pthread_setaffinity_cpu ( pthread_t thread, int cpu );
+extern int pthread_attr_setaffinity_cpu ( pthread_attr_t *attr, int cpu );
 
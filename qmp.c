@@ -0,0 +1,267 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * A minimal QMP (QEMU Machine Protocol) client: just enough to hand a
+ * client socket over to the VM ("getfd" + "add_client"), to watch its
+ * events and to save its state ("migrate", see snapshot.c). QMP messages
+ * are machine-generated JSON objects, one per line, so they're recognized
+ * by their top-level key without a JSON parser.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "qmp.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+#include "malloc.h"
+
+qmp_t *qmp_new ( int fd )
+{
+	qmp_t *qmp = xcalloc ( 1, sizeof ( *qmp ) );
+	qmp->fd = fd;
+	return qmp;
+}
+
+/*
+ * Sends a command (a JSON object without the trailing newline). If
+ * "pass_fd" is not -1, the descriptor is attached with SCM_RIGHTS (for
+ * "getfd").
+ */
+int qmp_send ( qmp_t *qmp, const char *cmd, int pass_fd )
+{
+	struct iovec iov[2] = {
+		{ ( void * ) cmd, strlen ( cmd ) },
+		{ "\n", 1 },
+	};
+	union {
+		char		buf[CMSG_SPACE ( sizeof ( int ) )];
+		struct cmsghdr	align;
+	} cmsg_buf;
+	struct msghdr msg = {0};
+	ssize_t r;
+	debug ( 5, "qmp->fd == %i: %s (pass_fd == %i)", qmp->fd, cmd, pass_fd );
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = 2;
+
+	if ( pass_fd != -1 ) {
+		struct cmsghdr *cmsg;
+		memset ( &cmsg_buf, 0, sizeof ( cmsg_buf ) );
+		msg.msg_control    = cmsg_buf.buf;
+		msg.msg_controllen = sizeof ( cmsg_buf.buf );
+		cmsg = CMSG_FIRSTHDR ( &msg );
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN ( sizeof ( int ) );
+		memcpy ( CMSG_DATA ( cmsg ), &pass_fd, sizeof ( int ) );
+	}
+
+	// Commands are tiny, so a short write to a fresh unix socket is not expected
+	r = sendmsg ( qmp->fd, &msg, MSG_NOSIGNAL );
+
+	if ( r != ( ssize_t ) ( iov[0].iov_len + iov[1].iov_len ) ) {
+		error ( "Cannot send a QMP command to fd == %i", qmp->fd );
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 and sets *line_p (valid until the next call) if a complete
+ * line is received, 0 if more data is required (EAGAIN) and -1 on
+ * errors and EOF.
+ */
+int qmp_readline ( qmp_t *qmp, char **line_p )
+{
+	char *eol;
+
+	if ( qmp->skip ) {
+		memmove ( qmp->buf, &qmp->buf[qmp->skip], qmp->len - qmp->skip );
+		qmp->len -= qmp->skip;
+		qmp->skip = 0;
+	}
+
+	while ( ( eol = memchr ( qmp->buf, '\n', qmp->len ) ) == NULL ) {
+		ssize_t r;
+
+		if ( qmp->len >= sizeof ( qmp->buf ) - 1 ) {
+			error ( "Too long QMP message on fd == %i", qmp->fd );
+			return -1;
+		}
+
+		r = recv ( qmp->fd, &qmp->buf[qmp->len], sizeof ( qmp->buf ) - 1 - qmp->len, MSG_DONTWAIT );
+
+		if ( r == 0 )
+			return -1;
+
+		if ( r < 0 )
+			return errno == EAGAIN ? 0 : -1;
+
+		qmp->len += r;
+	}
+
+	*eol      = 0;
+	qmp->skip = eol - qmp->buf + 1;
+	*line_p   = qmp->buf;
+	debug ( 7, "qmp->fd == %i: %s", qmp->fd, qmp->buf );
+	return 1;
+}
+
+qmp_msgtype_t qmp_msgtype ( const char *line )
+{
+	while ( *line == ' ' || *line == '{' )
+		line++;
+
+	if ( !strncmp ( line, "\"QMP\"", 5 ) )
+		return QMP_MSG_GREETING;
+
+	if ( !strncmp ( line, "\"return\"", 8 ) )
+		return QMP_MSG_RETURN;
+
+	if ( !strncmp ( line, "\"error\"", 7 ) )
+		return QMP_MSG_ERROR;
+
+	if ( strstr ( line, "\"event\"" ) != NULL )
+		return QMP_MSG_EVENT;	// "timestamp" goes first
+
+	return QMP_MSG_UNKNOWN;
+}
+
+// Returns non-zero if the first "key" of the line has the string value "value"
+int qmp_haskey ( const char *line, const char *key, const char *value )
+{
+	char pattern[64];
+	const char *p;
+	snprintf ( pattern, sizeof ( pattern ), "\"%s\"", key );
+
+	if ( ( p = strstr ( line, pattern ) ) == NULL )
+		return 0;
+
+	p += strlen ( pattern );
+
+	while ( *p == ' ' || *p == ':' )
+		p++;
+
+	return *p == '"' && !strncmp ( &p[1], value, strlen ( value ) ) && p[1 + strlen ( value )] == '"';
+}
+
+/*
+ * Writes "str" to "dst" as the contents of a JSON string (quotes,
+ * backslashes and control characters escaped). Returns -1 (ENAMETOOLONG)
+ * if it doesn't fit into "size" bytes.
+ */
+int qmp_escape ( char *dst, size_t size, const char *str )
+{
+	size_t len = 0;
+
+	while ( *str ) {
+		unsigned char c = *str++;
+		char esc[7] = { c, 0 };
+
+		if ( c == '"' || c == '\\' )
+			snprintf ( esc, sizeof ( esc ), "\\%c", c );
+		else if ( c < 0x20 )
+			snprintf ( esc, sizeof ( esc ), "\\u%04x", c );
+
+		if ( len + strlen ( esc ) >= size ) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		strcpy ( &dst[len], esc );
+		len += strlen ( esc );
+	}
+
+	dst[len] = 0;
+	return 0;
+}
+
+int qmp_isevent ( const char *line, const char *event )
+{
+	return qmp_haskey ( line, "event", event );
+}
+
+/*
+ * The blocking conversation (for the rare long operations, e.g. saving
+ * the state): waits for the reply to the last command (or the greeting)
+ * until "deadline" (CLOCK_MONOTONIC, ms), the events are skipped.
+ * Returns -1 on errors, including QMP errors.
+ */
+int qmp_reply ( qmp_t *qmp, uint64_t deadline, char **line_p )
+{
+	struct pollfd pfd = {0};
+	pfd.fd     = qmp->fd;
+	pfd.events = POLLIN;
+
+	while ( 1 ) {
+		uint64_t now;
+		int rc = qmp_readline ( qmp, line_p );
+
+		if ( rc < 0 ) {
+			error ( "The QMP connection (fd == %i) is lost", qmp->fd );
+			return -1;
+		}
+
+		if ( rc ) {
+			switch ( qmp_msgtype ( *line_p ) ) {
+				case QMP_MSG_EVENT:
+					continue;
+
+				case QMP_MSG_ERROR:
+					error ( "QMP error (fd == %i): %s", qmp->fd, *line_p );
+					return -1;
+
+				default:
+					return 0;
+			}
+		}
+
+		if ( ( now = kvmpool_now_ms() ) >= deadline ) {
+			errno = ETIMEDOUT;
+			error ( "No QMP reply (fd == %i)", qmp->fd );
+			return -1;
+		}
+
+		poll ( &pfd, 1, deadline - now );
+	}
+}
+
+int qmp_execute ( qmp_t *qmp, const char *cmd, uint64_t deadline, char **line_p )
+{
+	if ( qmp_send ( qmp, cmd, -1 ) )
+		return -1;
+
+	return qmp_reply ( qmp, deadline, line_p );
+}
+
+void qmp_free ( qmp_t *qmp )
+{
+	free ( qmp );
+	return;
+}
@@ -0,0 +1,64 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_QMP_H
+#define __KVMPOOL_QMP_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define QMP_BUFSIZE (1<<12)
+
+enum qmp_msgtype {
+	QMP_MSG_UNKNOWN = 0,
+	QMP_MSG_GREETING,
+	QMP_MSG_RETURN,
+	QMP_MSG_ERROR,
+	QMP_MSG_EVENT,
+};
+typedef enum qmp_msgtype qmp_msgtype_t;
+
+/*
+ * A QMP connection. The socket is non-blocking, messages (one JSON
+ * object per line) are accumulated in "buf" until a newline is received.
+ */
+struct qmp {
+	int	 fd;
+	size_t	 len;
+	size_t	 skip;	// Bytes of the previously returned line
+	char	 buf[QMP_BUFSIZE];
+};
+typedef struct qmp qmp_t;
+
+extern qmp_t *qmp_new ( int fd );
+extern int qmp_send ( qmp_t *qmp, const char *cmd, int pass_fd );
+extern int qmp_readline ( qmp_t *qmp, char **line_p );
+extern qmp_msgtype_t qmp_msgtype ( const char *line );
+extern int qmp_haskey ( const char *line, const char *key, const char *value );
+extern int qmp_escape ( char *dst, size_t size, const char *str );
+extern int qmp_isevent ( const char *line, const char *event );
+extern int qmp_reply ( qmp_t *qmp, uint64_t deadline, char **line_p );
+extern int qmp_execute ( qmp_t *qmp, const char *cmd, uint64_t deadline, char **line_p );
+extern void qmp_free ( qmp_t *qmp );
+
+#endif
@@ -0,0 +1,113 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements the queue of ready spare VMs: proxy workers push a
+ * VM when it becomes ready and acceptors pop them without locking.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "readyq.h"
+
+#include "error.h"
+#include "malloc.h"
+
+// "size" is rounded up to a power of 2
+int readyq_init ( readyq_t *q, int size )
+{
+	uint64_t capacity = 1, i = 0;
+
+	while ( capacity < ( uint64_t ) size )
+		capacity <<= 1;
+
+	memset ( q, 0, sizeof ( *q ) );
+	q->cells = xcalloc ( capacity, sizeof ( *q->cells ) );
+	q->mask  = capacity - 1;
+
+	while ( i < capacity ) {
+		q->cells[i].seq = i;
+		i++;
+	}
+
+	return 0;
+}
+
+// Returns ENOBUFS if the queue is full
+int readyq_push ( readyq_t *q, int value )
+{
+	uint64_t pos = __atomic_load_n ( &q->tail, __ATOMIC_RELAXED );
+	struct readyq_cell *cell;
+
+	while ( 1 ) {
+		int64_t dif;
+		cell = &q->cells[pos & q->mask];
+		dif  = ( int64_t ) __atomic_load_n ( &cell->seq, __ATOMIC_ACQUIRE ) - ( int64_t ) pos;
+
+		if ( dif == 0 ) {
+			if ( __atomic_compare_exchange_n ( &q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+				break;
+		} else if ( dif < 0 )
+			return ENOBUFS;
+		else
+			pos = __atomic_load_n ( &q->tail, __ATOMIC_RELAXED );
+	}
+
+	cell->value = value;
+	__atomic_store_n ( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+	return 0;
+}
+
+// Returns ENOENT if the queue is empty
+int readyq_pop ( readyq_t *q, int *value_p )
+{
+	uint64_t pos = __atomic_load_n ( &q->head, __ATOMIC_RELAXED );
+	struct readyq_cell *cell;
+
+	while ( 1 ) {
+		int64_t dif;
+		cell = &q->cells[pos & q->mask];
+		dif  = ( int64_t ) __atomic_load_n ( &cell->seq, __ATOMIC_ACQUIRE ) - ( int64_t ) ( pos + 1 );
+
+		if ( dif == 0 ) {
+			if ( __atomic_compare_exchange_n ( &q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+				break;
+		} else if ( dif < 0 )
+			return ENOENT;
+		else
+			pos = __atomic_load_n ( &q->head, __ATOMIC_RELAXED );
+	}
+
+	*value_p = cell->value;
+	__atomic_store_n ( &cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE );
+	return 0;
+}
+
+void readyq_deinit ( readyq_t *q )
+{
+	free ( q->cells );
+	memset ( q, 0, sizeof ( *q ) );
+	return;
+}
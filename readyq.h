@@ -0,0 +1,52 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_READYQ_H
+#define __KVMPOOL_READYQ_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+struct readyq_cell {
+	volatile uint64_t	 seq;
+	int			 value;
+};
+
+/*
+ * A bounded lock-free multi-producer multi-consumer FIFO of integers (D.
+ * Vyukov's algorithm): every cell has a sequence number telling whether
+ * it's ready to be written or read at the current position.
+ */
+struct readyq {
+	struct readyq_cell	*cells;
+	uint64_t		 mask;
+	volatile uint64_t	 head __attribute__ ( ( aligned ( 64 ) ) );	// Next position to pop
+	volatile uint64_t	 tail __attribute__ ( ( aligned ( 64 ) ) );	// Next position to push
+};
+typedef struct readyq readyq_t;
+
+extern int readyq_init ( readyq_t *q, int size );
+extern int readyq_push ( readyq_t *q, int value );
+extern int readyq_pop ( readyq_t *q, int *value_p );
+extern void readyq_deinit ( readyq_t *q );
+
+#endif
@@ -0,0 +1,264 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements "--recycle": when a VM is ready for the first time
+ * (its guest is up, see proxy_boot_start()) its clean state is saved as an
+ * internal snapshot (HMP "savevm"), and
+ * when its client is gone the VM is reverted to it ("stop", "loadvm",
+ * "cont") and becomes a spare again instead of being killed and replaced
+ * by a new one. The QMP conversations are blocking (a "loadvm" takes
+ * a while), so they're done by a few recycler threads; the VMs are passed
+ * through vmtable.recycleq. The VMs have a QMP monitor of their own for
+ * it, see kvmpool_ctlpath().
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "recycle.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+#include "proxy.h"
+#include "qmp.h"
+
+static pthread_cond_t recycle_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t recycle_threads[KVMPOOL_RECYCLE_THREADS];
+static int recycle_threads_count;
+
+// Runs a HMP command, they report errors as the text of the "return"
+static int recycle_hmp ( qmp_t *qmp, const char *cmdline, uint64_t deadline )
+{
+	char esc[256], cmd[sizeof ( esc ) + 128], *line;
+
+	if ( qmp_escape ( esc, sizeof ( esc ), cmdline ) )
+		return -1;
+
+	snprintf ( cmd, sizeof ( cmd ), "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"%s\"}}", esc );
+
+	if ( qmp_execute ( qmp, cmd, deadline, &line ) )
+		return -1;
+
+	if ( !qmp_haskey ( line, "return", "" ) ) {
+		error ( "\"%s\" failed: %s", cmdline, line );
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * "--snapshot": a VM is "inmigrate" until its state is restored (it serves
+ * VNC meanwhile), and "savevm" is refused then.
+ */
+static int recycle_running ( qmp_t *qmp, int vnc_id, uint64_t deadline )
+{
+	char *line;
+
+	while ( 1 ) {
+		if ( qmp_execute ( qmp, "{\"execute\": \"query-status\"}", deadline, &line ) )
+			return -1;
+
+		if ( qmp_haskey ( line, "status", "running" ) )
+			return 0;
+
+		if ( kvmpool_now_ms() + KVMPOOL_RECYCLE_POLL >= deadline ) {
+			error ( "The VM (vnc_id == %i) doesn't run: %s", vnc_id, line );
+			return -1;
+		}
+
+		debug ( 5, "vm->vnc_id == %i: %s", vnc_id, line );
+		usleep ( KVMPOOL_RECYCLE_POLL * 1000 );
+	}
+}
+
+// Saves the clean state of the VM ("save" != 0) or reverts the VM to it
+static int recycle_qmp ( ctx_t *ctx_p, int vnc_id, int save )
+{
+	uint64_t deadline = kvmpool_now_ms() + KVMPOOL_RECYCLE_TIMEOUT;
+	struct sockaddr_un sun = {0};
+	char cmdline[128], *line;
+	qmp_t *qmp;
+	int fd, rc;
+	sun.sun_family = AF_UNIX;
+	kvmpool_ctlpath ( ctx_p, vnc_id, sun.sun_path, sizeof ( sun.sun_path ) );
+
+	if ( ( fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) == -1 )
+		return -1;
+
+	if ( connect ( fd, ( struct sockaddr * ) &sun, sizeof ( sun ) ) ) {
+		error ( "Cannot connect to \"%s\"", sun.sun_path );
+		close ( fd );
+		return -1;
+	}
+
+	qmp = qmp_new ( fd );
+	rc  = qmp_reply ( qmp, deadline, &line ) || qmp_execute ( qmp, "{\"execute\": \"qmp_capabilities\"}", deadline, &line );
+
+	if ( !rc && save ) {
+		snprintf ( cmdline, sizeof ( cmdline ), "savevm %s", ctx_p->recycle_tag );
+		rc = recycle_running ( qmp, vnc_id, deadline ) || recycle_hmp ( qmp, cmdline, deadline );
+	} else if ( !rc ) {
+		snprintf ( cmdline, sizeof ( cmdline ), "loadvm %s", ctx_p->recycle_tag );
+		rc = qmp_execute ( qmp, "{\"execute\": \"stop\"}", deadline, &line ) ||
+		     recycle_hmp ( qmp, cmdline, deadline ) ||
+		     qmp_execute ( qmp, "{\"execute\": \"cont\"}", deadline, &line );
+	}
+
+	qmp_free ( qmp );
+	close ( fd );
+	return rc ? -1 : 0;
+}
+
+// The clean state is saved (or not), the VM can serve clients. Requires the global lock.
+static void recycle_saved ( ctx_t *ctx_p, vm_t *vm, int rc )
+{
+	if ( rc )
+		warning ( "Cannot save the clean state of the VM (vnc_id == %i), it will be killed on disconnect", vm->vnc_id );
+	else
+		vmtable_cold ( &ctx_p->vmtable, vm )->clean = 1;
+
+	// A client could be attached meanwhile
+	if ( vm->state == VMST_BOOTING ) {
+		vmtable_setstate ( &ctx_p->vmtable, vm, VMST_READY );
+		kvmpool_vm_ready ( ctx_p, vm );
+	}
+
+	return;
+}
+
+/*
+ * The VM is reverted: it's a spare one again, and a new proxy session
+ * connects to it, as if it was just spawned. Requires the global lock.
+ */
+static void recycle_reverted ( ctx_t *ctx_p, vm_t *vm, int rc )
+{
+	if ( vm->state != VMST_RECYCLING )
+		return;
+
+	if ( rc ) {
+		error ( "Cannot revert the VM (vnc_id == %i), killing it", vm->vnc_id );
+		kvmpool_closevm ( ctx_p, vm );
+		return;
+	}
+
+	debug ( 3, "vm->vnc_id == %i: reverted", vm->vnc_id );
+	__sync_fetch_and_add ( &ctx_p->vms_spare_count, 1 );
+	vmtable_setstate ( &ctx_p->vmtable, vm, VMST_BOOTING );
+	// The connect timeout is counted from it
+	vmtable_cold ( &ctx_p->vmtable, vm )->state_at[VMST_SPAWNING] = kvmpool_now_ms();
+
+	if ( proxy_prepare ( ctx_p, vm ) || proxy_spawned ( ctx_p, vm ) ) {
+		kvmpool_closevm ( ctx_p, vm );
+		return;
+	}
+
+	kvmpool_ctl_wakeup();
+	return;
+}
+
+static void *recycle_loop ( void *_ctx_p )
+{
+	ctx_t *ctx_p = _ctx_p;
+	vmtable_t *t = &ctx_p->vmtable;
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+
+	while ( ctx_p->state == STATE_RUNNING ) {
+		vm_t *vm = t->recycleq.head;
+		int save, vnc_id, rc;
+		pid_t pid;
+
+		if ( vm == NULL ) {
+			pthread_cond_wait ( &recycle_cond, &kvmpool_globalmutex );
+			continue;
+		}
+
+		vmtable_dequeue ( t, vm );
+
+		if ( vm->state == VMST_RECYCLING )
+			save = 0;
+		else if ( vm->state == VMST_BOOTING )
+			save = 1;
+		else
+			continue;	// A client is attached before the clean state is saved
+
+		pid    = vm->pid;
+		vnc_id = vm->vnc_id;
+		pthread_mutex_unlock ( &kvmpool_globalmutex );
+		rc = recycle_qmp ( ctx_p, vnc_id, save );
+		pthread_mutex_lock ( &kvmpool_globalmutex );
+
+		// The VM could be closed (and the slot reused) meanwhile
+		if ( vm->pid != pid || vm->vnc_id != vnc_id )
+			continue;
+
+		if ( save )
+			recycle_saved ( ctx_p, vm, rc );
+		else
+			recycle_reverted ( ctx_p, vm, rc );
+	}
+
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+	return NULL;
+}
+
+// Passes the VM to a recycler: VMST_BOOTING to save the clean state, VMST_RECYCLING to revert. Requires the global lock.
+void recycle_push ( ctx_t *ctx_p, vm_t *vm )
+{
+	vmtable_enqueue ( &ctx_p->vmtable, &ctx_p->vmtable.recycleq, vm );
+	pthread_cond_signal ( &recycle_cond );
+	return;
+}
+
+int recycle_init ( ctx_t *ctx_p )
+{
+	while ( recycle_threads_count < KVMPOOL_RECYCLE_THREADS ) {
+		int rc = pthread_create ( &recycle_threads[recycle_threads_count], NULL, recycle_loop, ctx_p );
+
+		if ( rc )
+			return rc;
+
+		recycle_threads_count++;
+	}
+
+	return 0;
+}
+
+// Requires ctx_p->state != STATE_RUNNING
+void recycle_deinit ( ctx_t *ctx_p )
+{
+	pthread_mutex_lock ( &kvmpool_globalmutex );
+	pthread_cond_broadcast ( &recycle_cond );
+	pthread_mutex_unlock ( &kvmpool_globalmutex );
+
+	while ( recycle_threads_count )
+		pthread_join ( recycle_threads[--recycle_threads_count], NULL );
+
+	return;
+}
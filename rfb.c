@@ -0,0 +1,289 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * This file implements the RFB (VNC) handshake (RFC 6143, sections 7.1
+ * and 7.2) on non-blocking sockets: the handshake functions are called on
+ * every EPOLLIN and return 0 until the required data is received.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "rfb.h"
+
+#include "error.h"
+
+#define RFB_SECTYPE_INVALID	0
+#define RFB_SECTYPE_NONE	1
+
+/*
+ * Receives the message of "size" bytes into "dst" (rfb->len bytes are
+ * already received). Returns 1 if it's complete, 0 if more data is
+ * required and -1 on errors and EOF.
+ */
+static int rfb_read ( rfb_t *rfb, int fd, uint8_t *dst, size_t size )
+{
+	while ( rfb->len < size ) {
+		ssize_t r = recv ( fd, &dst[rfb->len], size - rfb->len, MSG_DONTWAIT );
+
+		if ( r == 0 )
+			return -1;
+
+		if ( r < 0 )
+			return errno == EAGAIN ? 0 : -1;
+
+		rfb->len += r;
+	}
+
+	rfb->len = 0;
+	return 1;
+}
+
+// Handshake messages are tiny and the socket buffer is empty, so a short write is an error
+static int rfb_write ( int fd, const void *data, size_t size )
+{
+	if ( send ( fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL ) != ( ssize_t ) size ) {
+		error ( "Cannot send a handshake message to fd == %i", fd );
+		return -1;
+	}
+
+	return 0;
+}
+
+// RFB 3.3, 3.7 and 3.8 are defined; others are to be treated as 3.3
+static int rfb_version_parse ( const uint8_t *buf )
+{
+	int major, minor;
+
+	if ( memcmp ( buf, "RFB ", 4 ) || buf[RFB_VERSION_LEN - 1] != '\n' )
+		return -1;
+
+	if ( sscanf ( ( const char * ) buf, "RFB %3d.%3d", &major, &minor ) != 2 || major != 3 )
+		return -1;
+
+	return minor >= 8 ? 8 : minor == 7 ? 7 : 3;
+}
+
+static int rfb_version_send ( int fd, int minor )
+{
+	char version[] = "RFB 003.00X\n";
+	version[RFB_VERSION_LEN - 2] = '0' + minor;
+	return rfb_write ( fd, version, RFB_VERSION_LEN );
+}
+
+/*
+ * The handshake with the VNC server of the VM. Returns 1 when the server
+ * waits for ClientInit, 0 if more data is required and -1 on errors.
+ */
+int rfb_upstream_handshake ( rfb_t *rfb, int fd )
+{
+	int rc;
+
+	while ( 1 ) {
+		switch ( rfb->state ) {
+			case RFB_VERSION:
+				if ( ( rc = rfb_read ( rfb, fd, rfb->buf, RFB_VERSION_LEN ) ) <= 0 )
+					return rc;
+
+				if ( ( rfb->minor = rfb_version_parse ( rfb->buf ) ) < 0 ) {
+					error ( "Invalid RFB version of the VNC server: \"%.11s\"", rfb->buf );
+					return -1;
+				}
+
+				if ( rfb_version_send ( fd, rfb->minor ) )
+					return -1;
+
+				rfb->state = rfb->minor == 3 ? RFB_SECTYPE33 : RFB_SECTYPES_COUNT;
+				break;
+
+			case RFB_SECTYPE33: {
+					uint32_t sectype;
+
+					if ( ( rc = rfb_read ( rfb, fd, rfb->sectypes, sizeof ( sectype ) ) ) <= 0 )
+						return rc;
+
+					memcpy ( &sectype, rfb->sectypes, sizeof ( sectype ) );
+					sectype = ntohl ( sectype );
+
+					if ( sectype == RFB_SECTYPE_INVALID ) {
+						error ( "The VNC server refused the connection" );
+						return -1;
+					}
+
+					rfb->sectypes_len = sizeof ( sectype );
+					rfb->none  = ( sectype == RFB_SECTYPE_NONE );
+					rfb->state = RFB_READY;
+					break;
+				}
+
+			case RFB_SECTYPES_COUNT:
+				if ( ( rc = rfb_read ( rfb, fd, rfb->sectypes, 1 ) ) <= 0 )
+					return rc;
+
+				if ( rfb->sectypes[0] == 0 ) {
+					error ( "The VNC server refused the connection" );
+					return -1;
+				}
+
+				rfb->state = RFB_SECTYPES;
+				break;
+
+			case RFB_SECTYPES:
+				if ( ( rc = rfb_read ( rfb, fd, &rfb->sectypes[1], rfb->sectypes[0] ) ) <= 0 )
+					return rc;
+
+				rfb->sectypes_len = 1 + rfb->sectypes[0];
+
+				if ( memchr ( &rfb->sectypes[1], RFB_SECTYPE_NONE, rfb->sectypes[0] ) == NULL ) {
+					debug ( 3, "The VNC server doesn't offer security type \"None\", the client will authenticate itself" );
+					rfb->state = RFB_READY;
+					break;
+				}
+
+				if ( rfb_write ( fd, "\x01", 1 ) )
+					return -1;
+
+				rfb->none  = 1;
+				rfb->state = rfb->minor == 8 ? RFB_SECRESULT : RFB_READY;
+				break;
+
+			case RFB_SECRESULT: {
+					uint32_t result;
+
+					if ( ( rc = rfb_read ( rfb, fd, rfb->buf, sizeof ( result ) ) ) <= 0 )
+						return rc;
+
+					memcpy ( &result, rfb->buf, sizeof ( result ) );
+
+					if ( result ) {
+						error ( "The VNC server rejected security type \"None\"" );
+						return -1;
+					}
+
+					rfb->state = RFB_READY;
+					break;
+				}
+
+			case RFB_READY:
+				return 1;
+
+			default:
+				critical ( "Invalid state: %i", rfb->state );
+		}
+	}
+
+	return -1;
+}
+
+int rfb_client_start ( rfb_t *rfb, int fd )
+{
+	critical_on ( rfb->state != RFB_READY );
+	rfb->state = RFB_CLIENT_VERSION;
+	return rfb_version_send ( fd, rfb->minor );
+}
+
+/*
+ * The handshake with the client (replaying the one done with the server).
+ * Returns 1 when everything since ClientInit may be relayed, 0 if more
+ * data is required and -1 on errors.
+ */
+int rfb_client_handshake ( rfb_t *rfb, int fd )
+{
+	int rc;
+
+	while ( 1 ) {
+		switch ( rfb->state ) {
+			case RFB_CLIENT_VERSION:
+				if ( ( rc = rfb_read ( rfb, fd, rfb->buf, RFB_VERSION_LEN ) ) <= 0 )
+					return rc;
+
+				if ( ( rfb->client_minor = rfb_version_parse ( rfb->buf ) ) < 0 ) {
+					error ( "Invalid RFB version of the client: \"%.11s\"", rfb->buf );
+					return -1;
+				}
+
+				rfb->client_minor = MIN ( rfb->client_minor, rfb->minor );
+
+				if ( !rfb->none ) {
+					// The rest of the handshake is between the client and the server
+					if ( rfb->client_minor != rfb->minor ) {
+						error ( "The client requested RFB 3.%i, but 3.%i is already negotiated with the VNC server", rfb->client_minor, rfb->minor );
+						return -1;
+					}
+
+					if ( rfb_write ( fd, rfb->sectypes, rfb->sectypes_len ) )
+						return -1;
+
+					rfb->state = RFB_DONE;
+					break;
+				}
+
+				if ( rfb->client_minor == 3 ) {
+					uint32_t sectype = htonl ( RFB_SECTYPE_NONE );
+
+					if ( rfb_write ( fd, &sectype, sizeof ( sectype ) ) )
+						return -1;
+
+					rfb->state = RFB_DONE;
+					break;
+				}
+
+				if ( rfb_write ( fd, "\x01\x01", 2 ) )	// 1 type: "None"
+					return -1;
+
+				rfb->state = RFB_CLIENT_SECTYPE;
+				break;
+
+			case RFB_CLIENT_SECTYPE:
+				if ( ( rc = rfb_read ( rfb, fd, rfb->buf, 1 ) ) <= 0 )
+					return rc;
+
+				if ( rfb->buf[0] != RFB_SECTYPE_NONE ) {
+					error ( "The client chose an invalid security type: %u", rfb->buf[0] );
+					return -1;
+				}
+
+				if ( rfb->client_minor == 8 ) {
+					uint32_t result = 0;
+
+					if ( rfb_write ( fd, &result, sizeof ( result ) ) )
+						return -1;
+				}
+
+				rfb->state = RFB_DONE;
+				break;
+
+			case RFB_DONE:
+				return 1;
+
+			default:
+				critical ( "Invalid state: %i", rfb->state );
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,72 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_RFB_H
+#define __KVMPOOL_RFB_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RFB_VERSION_LEN 12	// "RFB 003.008\n"
+
+enum rfb_state {
+	// With the VNC server of the VM (kvm-pool is the client)
+	RFB_VERSION = 0,
+	RFB_SECTYPE33,		// RFB 3.3: the server chooses the security type
+	RFB_SECTYPES_COUNT,
+	RFB_SECTYPES,
+	RFB_SECRESULT,
+	RFB_READY,		// The server waits for ClientInit
+
+	// With the client (kvm-pool is the server)
+	RFB_CLIENT_VERSION,
+	RFB_CLIENT_SECTYPE,
+	RFB_DONE,		// The rest (since ClientInit) is just relayed
+};
+typedef enum rfb_state rfb_state_t;
+
+/*
+ * The handshake is done with the VNC server in advance (see
+ * rfb_upstream_handshake()) and then replayed to the client when it's
+ * attached (see rfb_client_handshake()). If the server doesn't offer the
+ * security type "None", only the version is negotiated in advance: the
+ * list of security types is replayed to the client as is and the client
+ * authenticates with the server itself.
+ */
+struct rfb {
+	rfb_state_t	 state;
+	int		 minor;		// RFB 3.<minor> negotiated with the server: 3, 7 or 8
+	int		 client_minor;
+	int		 none;		// Security type "None" is negotiated with the server
+	uint8_t		 sectypes[1 + 255];	// As received from the server
+	size_t		 sectypes_len;
+	uint8_t		 buf[RFB_VERSION_LEN];
+	size_t		 len;		// Received bytes of the current message
+};
+typedef struct rfb rfb_t;
+
+extern int rfb_upstream_handshake ( rfb_t *rfb, int fd );
+extern int rfb_client_start ( rfb_t *rfb, int fd );
+extern int rfb_client_handshake ( rfb_t *rfb, int fd );
+
+#endif
@@ -0,0 +1,191 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements "--snapshot": the state of a booted template VM is
+ * saved by a QMP "migrate" to a file, and the spare VMs are started with
+ * "-incoming" from it, so they are restored instead of booting the guest.
+ * It's done once on start, so the QMP conversation is just blocking.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#include "error.h"
+#include "kvm-pool.h"
+#include "qmp.h"
+
+/*
+ * Makes an "exec:" migration URI running "cmd" on "path". QEMU passes it
+ * to the shell, so the path is single-quoted (a quote is "'\\''").
+ * Returns -1 (ENAMETOOLONG) if it doesn't fit into "size" bytes.
+ */
+int snapshot_execuri ( char *uri, size_t size, const char *cmd, const char *path )
+{
+	size_t len = snprintf ( uri, size, "exec:%s '", cmd );
+
+	while ( len < size && *path ) {
+		if ( *path == '\'' )
+			len += snprintf ( &uri[len], size - len, "'\\''" );
+		else
+			uri[len++] = *path;
+
+		path++;
+	}
+
+	if ( len + sizeof ( "'" ) > size ) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy ( &uri[len], "'" );
+	return 0;
+}
+
+// Returns non-zero if the template VM is gone
+static int snapshot_vm_exited ( pid_t pid )
+{
+	int status;
+
+	if ( waitpid ( pid, &status, WNOHANG ) != pid )
+		return 0;
+
+	error ( "The template VM exited (status %i)", status );
+	return 1;
+}
+
+// The QMP server is up as soon as the VM is run, but the connect() is retried just in case
+static int snapshot_qmp_connect ( pid_t pid, const char *qmp_path, uint64_t deadline )
+{
+	struct sockaddr_un sun = {0};
+	sun.sun_family = AF_UNIX;
+	strncpy ( sun.sun_path, qmp_path, sizeof ( sun.sun_path ) - 1 );
+
+	while ( kvmpool_now_ms() < deadline && !snapshot_vm_exited ( pid ) ) {
+		int fd = socket ( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+		if ( fd == -1 )
+			return -1;
+
+		if ( !connect ( fd, ( struct sockaddr * ) &sun, sizeof ( sun ) ) )
+			return fd;
+
+		close ( fd );
+		usleep ( KVMPOOL_SNAPSHOT_POLL * 1000 );
+	}
+
+	error ( "Cannot connect to the QMP server of the template VM (\"%s\")", qmp_path );
+	return -1;
+}
+
+// Waits for the guest to boot and migrates the VM to "path"
+static int snapshot_migrate ( ctx_t *ctx_p, pid_t pid, qmp_t *qmp, uint64_t deadline, const char *path )
+{
+	uint64_t boot_at = kvmpool_now_ms() + ctx_p->flags[SNAPSHOT_DELAY] * 1000ULL;
+	char uri[SNAPSHOT_URI_MAX], esc[sizeof ( uri ) * 2], cmd[sizeof ( esc ) + 64], *line;
+
+	if ( qmp_reply ( qmp, deadline, &line ) || qmp_execute ( qmp, "{\"execute\": \"qmp_capabilities\"}", deadline, &line ) )
+		return -1;
+
+	debug ( 1, "Waiting %i seconds for the guest of the template VM to boot", ctx_p->flags[SNAPSHOT_DELAY] );
+
+	while ( kvmpool_now_ms() < boot_at ) {
+		if ( snapshot_vm_exited ( pid ) )
+			return -1;
+
+		usleep ( KVMPOOL_SNAPSHOT_POLL * 1000 );
+	}
+
+	if ( snapshot_execuri ( uri, sizeof ( uri ), "cat >", path ) || qmp_escape ( esc, sizeof ( esc ), uri ) ) {
+		error ( "The snapshot path is too long: \"%s\"", path );
+		return -1;
+	}
+
+	snprintf ( cmd, sizeof ( cmd ), "{\"execute\": \"migrate\", \"arguments\": {\"uri\": \"%s\"}}", esc );
+
+	if ( qmp_execute ( qmp, cmd, deadline, &line ) )
+		return -1;
+
+	while ( 1 ) {
+		if ( qmp_execute ( qmp, "{\"execute\": \"query-migrate\"}", deadline, &line ) )
+			return -1;
+
+		if ( qmp_haskey ( line, "status", "completed" ) )
+			return 0;
+
+		if ( qmp_haskey ( line, "status", "failed" ) || qmp_haskey ( line, "status", "cancelled" ) ) {
+			error ( "Cannot save the state of the template VM: %s", line );
+			return -1;
+		}
+
+		if ( kvmpool_now_ms() >= deadline ) {
+			errno = ETIMEDOUT;
+			error ( "The state of the template VM is being saved for too long" );
+			return -1;
+		}
+
+		usleep ( KVMPOOL_SNAPSHOT_POLL * 1000 );
+	}
+}
+
+/*
+ * Lets the guest of the template VM boot for "--snapshot-delay" seconds and
+ * migrates the VM to a temporary file, which is renamed to the snapshot
+ * path when the migration is completed (so a failed attempt doesn't leave
+ * a broken snapshot). The VM is not killed here.
+ */
+int snapshot_save ( ctx_t *ctx_p, pid_t pid, const char *qmp_path )
+{
+	uint64_t deadline = kvmpool_now_ms() + KVMPOOL_SNAPSHOT_TIMEOUT;
+	char tmp_path[PATH_MAX];
+	qmp_t *qmp;
+	int fd, rc = 0;
+	snprintf ( tmp_path, sizeof ( tmp_path ), "%s.tmp", ctx_p->snapshot_path );
+
+	if ( ( fd = snapshot_qmp_connect ( pid, qmp_path, deadline ) ) == -1 )
+		return errno ? errno : EIO;
+
+	qmp = qmp_new ( fd );
+
+	if ( snapshot_migrate ( ctx_p, pid, qmp, deadline, tmp_path ) )
+		rc = errno ? errno : EIO;
+	else if ( rename ( tmp_path, ctx_p->snapshot_path ) ) {
+		rc = errno;
+		error ( "Cannot rename \"%s\" to \"%s\"", tmp_path, ctx_p->snapshot_path );
+	} else
+		debug ( 1, "The snapshot is saved to \"%s\"", ctx_p->snapshot_path );
+
+	if ( rc )
+		unlink ( tmp_path );
+
+	qmp_free ( qmp );
+	close ( fd );
+	return rc;
+}
@@ -0,0 +1,37 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVMPOOL_SNAPSHOT_H
+#define __KVMPOOL_SNAPSHOT_H
+
+#include "common.h"
+
+#include <limits.h>
+#include <sys/types.h>
+
+#include "ctx.h"
+
+// The path can be quadrupled by the quoting
+#define SNAPSHOT_URI_MAX (PATH_MAX * 4 + 16)
+
+extern int snapshot_execuri ( char *uri, size_t size, const char *cmd, const char *path );
+extern int snapshot_save ( ctx_t *ctx_p, pid_t pid, const char *qmp_path );
+
+#endif
@@ -0,0 +1,63 @@
+#!/bin/sh
+# The io backends on loopback: CLIENTS clients stream SIZE bytes each way
+# through kvm-pool to the echoing stand-in VMs. Reported per backend: the
+# throughput (of a run without tracing) and the system calls of kvm-pool
+# per MiB relayed (of a run under syscount, see syscount.c). Run by
+# "make bench"; not a pass/fail test.
+
+. "$(dirname "$0")/common.sh"
+
+BACKENDS=${BACKENDS:-recv io_uring}
+CLIENTS=${CLIENTS:-4}
+SIZE=${SIZE:-67108864}
+STUB_KVM_BOOT_MS=0
+COUNT_FILE=$WORK_DIR/syscount
+
+# Relayed: both directions of every client
+MIB=$(( 2 * CLIENTS * SIZE / 1048576 ))
+
+bench_start() {
+	kp_start --io-backend="$1" --min-vms=$CLIENTS --min-spare=$CLIENTS
+	wait_for 10 '[ "$(stub_count "rfb: connected")" -ge $CLIENTS ]' || fail "the spare VMs are not ready ($1)"
+}
+
+bench_stop() {
+	kp_stop
+	rm -f "$STUB_KVM_LOG"
+}
+
+# Makes syscount write the count so far and prints it
+syscount_get() {
+	rm -f "$COUNT_FILE"
+	kill -USR1 "$KP_PID"
+	wait_for 10 '[ -s "$COUNT_FILE" ]' || fail "no count from syscount"
+	cat "$COUNT_FILE"
+}
+
+printf '%s clients, %s bytes each way per client, %s MiB relayed\n\n' $CLIENTS $SIZE $MIB
+printf '%-18s %12s %16s\n' backend MiB/s syscalls/MiB
+
+for backend in $BACKENDS; do
+	name=$backend
+	: > "$WORK_DIR/kvm-pool.log"
+
+	bench_start $backend
+	out=$(vnc_client -c $CLIENTS -s $SIZE) || fail "the clients are not served ($backend)"
+	rate=$(echo "$out" | tail -1 | sed -n 's/.* \([0-9.]*\) MiB\/s.*/\1/p')
+	bench_stop
+
+	grep -q "falling back" "$WORK_DIR/kvm-pool.log" && name="recv (fallback)"
+
+	KP_WRAPPER="$TESTS_DIR/syscount $COUNT_FILE"
+	bench_start $backend
+	before=$(syscount_get)
+	vnc_client -c $CLIENTS -s $SIZE > /dev/null || fail "the clients are not served ($backend, traced)"
+	after=$(syscount_get)
+	bench_stop
+	KP_WRAPPER=
+
+	printf '%-18s %12s %16s\n' "$name" "$rate" $(awk "BEGIN { printf \"%.1f\", ( $after - $before ) / $MIB }")
+done
+
+kp_stop
+rm -rf "$WORK_DIR"
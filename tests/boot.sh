@@ -0,0 +1,33 @@
+#!/bin/sh
+# A VM holds its boot slot until its guest is up, not until the VNC
+# handshake: the stand-in emulator serves VNC at once ("early VNC", as
+# QEMU does) while its guest boots for STUB_KVM_BOOT_MS. With one boot
+# slot the second VM is spawned only when the guest of the first one
+# answers the guest agent ("--guest-agent") or "--boot-delay" passes.
+
+STUB_KVM_BOOT_MS=2000
+STUB_KVM_EARLY_VNC=1
+export STUB_KVM_EARLY_VNC
+
+. "$(dirname "$0")/common.sh"
+
+kp_start --guest-agent=1 --max-booting=1 --min-vms=2 --min-spare=2
+wait_for 10 '[ "$(stub_count "rfb: connected")" -ge 1 ]' || fail "no VNC handshake"
+sleep 1
+[ "$(stub_count "argv:")" -eq 1 ] || fail "the boot slot is released before the guest is up (guest-agent)"
+wait_for 10 '[ "$(stub_count "argv:")" -eq 2 ]' || fail "the second VM is not spawned (guest-agent)"
+[ "$(stub_count '"guest-ping"')" -ge 1 ] || fail "the guest agent is not pinged"
+grep -q -- "-device virtserialport,bus=kvmpool-agent-serial.0,chardev=kvmpool-agent,name=org.qemu.guest_agent.0" "$STUB_KVM_LOG" || fail "no guest agent port"
+vnc_client -s 65536 || fail "the client is not served (guest-agent)"
+kp_stop
+rm -f "$STUB_KVM_LOG"
+
+STUB_KVM_BOOT_MS=0
+kp_start --boot-delay=2 --max-booting=1 --min-vms=2 --min-spare=2
+wait_for 10 '[ "$(stub_count "rfb: connected")" -ge 1 ]' || fail "no VNC handshake"
+sleep 1
+[ "$(stub_count "argv:")" -eq 1 ] || fail "the boot slot is released before the guest is up (boot-delay)"
+wait_for 10 '[ "$(stub_count "argv:")" -eq 2 ]' || fail "the second VM is not spawned (boot-delay)"
+vnc_client -s 65536 || fail "the client is not served (boot-delay)"
+
+pass
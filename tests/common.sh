@@ -0,0 +1,72 @@
+# The shared part of the tests: kvm-pool is run with the stand-in emulator
+# (tests/kvm, see stub-kvm.c) in a temporary directory. Sourced by the
+# test scripts, which are run by "make check" from the top directory.
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+TOP_DIR=$(dirname "$TESTS_DIR")
+WORK_DIR=$(mktemp -d "${TMPDIR:-/tmp}/kvm-pool-test.XXXXXX")
+PORT=${PORT:-15900}
+STUB_KVM_LOG=$WORK_DIR/kvm.log
+STUB_KVM_BOOT_MS=${STUB_KVM_BOOT_MS:-300}
+export STUB_KVM_LOG STUB_KVM_BOOT_MS
+KP_PID=
+KP_WRAPPER=	# A command kvm-pool is run by (see bench.sh)
+
+kp_start() {
+	mkdir -p "$WORK_DIR/run"
+	PATH="$TESTS_DIR:$PATH" $KP_WRAPPER "$TOP_DIR/kvm-pool" --listen=127.0.0.1:$PORT --runtime-dir="$WORK_DIR/run" "$@" >> "$WORK_DIR/kvm-pool.log" 2>&1 &
+	KP_PID=$!
+}
+
+# The VMs exit with kvm-pool (the stub sets PR_SET_PDEATHSIG)
+kp_stop() {
+	[ -n "$KP_PID" ] || return 0
+	kill "$KP_PID" 2>/dev/null
+	wait "$KP_PID" 2>/dev/null
+	KP_PID=
+	sleep 0.2
+}
+
+# Lines of the stub log matching the pattern
+stub_count() {
+	if [ -f "$STUB_KVM_LOG" ]; then
+		grep -c -- "$1" "$STUB_KVM_LOG"
+	else
+		echo 0
+	fi
+}
+
+# Waits up to $1 seconds for the shell condition $2
+wait_for() {
+	local deadline=$(( $(date +%s) + $1 ))
+
+	until eval "$2"; do
+		[ "$(date +%s)" -lt "$deadline" ] || return 1
+		sleep 0.1
+	done
+}
+
+vnc_client() {
+	"$TESTS_DIR/vnc-client" "$@" 127.0.0.1 $PORT
+}
+
+fail() {
+	echo "FAIL: $TEST_NAME: $*"
+	kp_stop
+	echo "--- kvm-pool log (tail)"
+	tail -20 "$WORK_DIR/kvm-pool.log"
+	echo "--- stub log (tail)"
+	tail -20 "$STUB_KVM_LOG"
+	echo "(kept $WORK_DIR)"
+	exit 1
+}
+
+pass() {
+	kp_stop
+	echo "PASS: $TEST_NAME"
+	rm -rf "$WORK_DIR"
+	exit 0
+}
+
+TEST_NAME=$(basename "$0" .sh)
+trap kp_stop EXIT
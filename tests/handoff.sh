@@ -0,0 +1,19 @@
+#!/bin/sh
+# --handoff: the client socket is passed to the VM over QMP ("getfd" with
+# SCM_RIGHTS, then "add_client"), and the session ends with the
+# VNC_DISCONNECTED event of the VM.
+
+. "$(dirname "$0")/common.sh"
+
+kp_start --handoff=1 --min-vms=2 --min-spare=2 --kill-vm-on-disconnect=1
+wait_for 10 '[ "$(stub_count "qmp_capabilities")" -ge 2 ]' || fail "the spare VMs are not ready"
+
+vnc_client -s 1048576 || fail "the client is not served"
+[ "$(stub_count '"getfd"')" -eq 1 ] || fail "no getfd"
+[ "$(stub_count '"add_client"')" -eq 1 ] || fail "no add_client"
+
+# The VM of the gone client is replaced
+wait_for 10 '[ "$(stub_count "argv:")" -ge 3 ]' || fail "the VM is not replaced"
+vnc_client -c 2 -s 65536 || fail "the clients are not served by the replacements"
+
+pass
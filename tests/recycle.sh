@@ -0,0 +1,35 @@
+#!/bin/sh
+# --recycle: the clean state is saved when the guest is up, and a VM
+# whose client is gone is reverted to it instead of being replaced. The
+# stand-in emulator serves VNC at once ("early VNC", as QEMU does), so
+# the VNC handshake is done while the state is still being restored (and
+# "savevm" is refused) or while the guest still boots.
+
+STUB_KVM_EARLY_VNC=1
+STUB_KVM_RESTORE_MS=1500
+export STUB_KVM_EARLY_VNC STUB_KVM_RESTORE_MS
+
+. "$(dirname "$0")/common.sh"
+
+# Restored VMs: "savevm" waits until they run
+kp_start --snapshot="$WORK_DIR/snapshot" --snapshot-delay=0 --recycle=clean --min-vms=1 --min-spare=1
+wait_for 15 '[ "$(stub_count "savevm:")" -ge 1 ]' || fail "the clean state is not saved (snapshot)"
+[ "$(stub_count "savevm: refused")" -eq 0 ] || fail "savevm while restoring"
+[ "$(stub_count "savevm: guest up")" -eq 1 ] || fail "the clean state is not of a running guest (snapshot)"
+grep -q "it will be killed on disconnect" "$WORK_DIR/kvm-pool.log" && fail "recycling is turned off (snapshot)"
+vnc_client -s 65536 || fail "the client is not served (snapshot)"
+wait_for 10 '[ "$(stub_count "loadvm:")" -ge 1 ]' || fail "the VM is not reverted (snapshot)"
+vnc_client -s 65536 || fail "the client is not served by the reverted VM (snapshot)"
+kp_stop
+rm -f "$STUB_KVM_LOG"
+
+# Booted VMs: "savevm" waits until the guest agent answers
+STUB_KVM_BOOT_MS=1500
+kp_start --guest-agent=1 --recycle=clean --min-vms=1 --min-spare=1
+wait_for 15 '[ "$(stub_count "savevm:")" -ge 1 ]' || fail "the clean state is not saved (boot)"
+[ "$(stub_count "savevm: guest up")" -eq 1 ] || fail "the clean state is of a booting guest"
+vnc_client -s 65536 || fail "the client is not served (boot)"
+wait_for 10 '[ "$(stub_count "loadvm: guest up")" -ge 1 ]' || fail "the VM is not reverted to a booted guest"
+vnc_client -s 65536 || fail "the client is not served by the reverted VM (boot)"
+
+pass
@@ -0,0 +1,29 @@
+#!/bin/sh
+# --snapshot: the template VM is saved with a QMP "migrate" to an "exec:"
+# URI, the pool VMs are restored with "-incoming", and an existing
+# snapshot is reused on restart. The path has quotes and a space, so it
+# has to be escaped for JSON and for the shell.
+
+. "$(dirname "$0")/common.sh"
+
+SNAPSHOT="$WORK_DIR/it's a \"snapshot\""
+
+kp_start --snapshot="$SNAPSHOT" --snapshot-delay=1 --min-vms=2 --min-spare=2
+wait_for 15 '[ "$(stub_count "rfb: connected")" -ge 2 ]' || fail "the spare VMs are not ready"
+
+[ "$(stub_count "migrate: completed")" -eq 1 ] || fail "the template VM is not saved"
+[ -f "$SNAPSHOT" ] || fail "no snapshot file"
+[ ! -e "$SNAPSHOT.tmp" ] || fail "the temporary file is left"
+[ "$(stub_count "incoming: restored")" -ge 2 ] || fail "the VMs are not restored"
+[ "$(stub_count "incoming: cannot")" -eq 0 ] || fail "a VM cannot be restored"
+vnc_client -s 65536 || fail "the client is not served"
+
+# The existing snapshot is reused: no template VM
+kp_stop
+mv "$STUB_KVM_LOG" "$WORK_DIR/kvm.log.1"
+kp_start --snapshot="$SNAPSHOT" --snapshot-delay=1 --min-vms=2 --min-spare=2
+wait_for 15 '[ "$(stub_count "rfb: connected")" -ge 2 ]' || fail "the spare VMs are not ready after the restart"
+[ "$(stub_count "template.qmp")" -eq 0 ] || fail "the template VM is started again"
+[ "$(stub_count "incoming: restored")" -ge 2 ] || fail "the VMs are not restored after the restart"
+
+pass
@@ -0,0 +1,774 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * A stand-in for "kvm" used by the tests: it runs no guest, but it
+ * serves what kvm-pool talks to. The VNC server ("-vnc unix:<path>" or
+ * "-vnc :<display>") does the RFB 3.8 handshake (security "None") and
+ * then echoes everything back. The QMP monitors ("-qmp unix:<path>,...")
+ * accept "qmp_capabilities", "getfd" (the descriptor is passed with
+ * SCM_RIGHTS), "add_client" (the passed client is served by the VNC
+ * server, and VNC_DISCONNECTED is sent when it's gone),
+ * "human-monitor-command" ("savevm" and "loadvm" of one internal
+ * snapshot, other HMP commands are ignored), "stop", "cont",
+ * "query-status", "migrate" and "query-migrate". "savevm" is refused
+ * while the state is restored, and "loadvm" of a snapshot saved while the
+ * guest was booting boots it again. The saved state is just STUB_STATE:
+ * "migrate" writes it to the shell command of an "exec:" URI, and
+ * "-incoming exec:<command>" reads it. The
+ * guest agent ("-chardev socket,...,path=<path>,...") answers "guest-ping"
+ * when the guest is up.
+ *
+ * The arguments and the QMP commands are logged to $STUB_KVM_LOG (one
+ * line each, "<pid> <what>: ..."), so the tests can check them. The
+ * "boot" takes $STUB_KVM_BOOT_MS (300 ms by default), a restore takes
+ * $STUB_KVM_RESTORE_MS (50 ms by default). The VNC server and the QMP
+ * monitors are served when the guest is up, or with $STUB_KVM_EARLY_VNC=1
+ * at once, as QEMU does (while the guest is in its firmware or the
+ * state is being restored). The stub exits with kvm-pool
+ * (PR_SET_PDEATHSIG).
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STUB_MONITORS_MAX	4
+#define STUB_FDS_MAX		16
+#define STUB_BUFSIZE		(1<<16)
+#define STUB_DEFAULT_BOOT_MS	300
+#define STUB_DEFAULT_RESTORE_MS	50
+#define STUB_STATE		"stub-kvm state\n"
+
+// A QMP monitor (or the guest agent): its listening socket and the connection (one at a time)
+struct stub_monitor {
+	char	 path[sizeof ( ( ( struct sockaddr_un * ) 0 )->sun_path )];
+	int	 agent;
+	int	 listen_fd;
+	int	 fd;
+	int	 passed_fd;	// Received with the last message, for "getfd"
+	size_t	 len;
+	char	 buf[4096];
+};
+
+// A descriptor got by "getfd"
+struct stub_fd {
+	char	 name[64];
+	int	 fd;
+};
+
+static struct stub_monitor stub_monitors[STUB_MONITORS_MAX];
+static int stub_monitors_count;
+static struct stub_fd stub_fds[STUB_FDS_MAX];
+static char stub_vnc_path[sizeof ( ( ( struct sockaddr_un * ) 0 )->sun_path )];
+static int stub_events[2];	// The served handed-over clients write to it when they're gone
+static const char *stub_migration = "none";	// The status of the last "migrate"
+static const char *stub_incoming_cmd;	// "-incoming exec:<command>", until the state is restored
+static long long stub_up_at;	// CLOCK_MONOTONIC, ms; when the guest is up
+static int stub_boot_ms;
+static int stub_paused;	// "stop"
+static int stub_saved;	// "savevm": 1 if the guest was up, 2 if it was booting
+
+static long long stub_now_ms ()
+{
+	struct timespec ts;
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int stub_guest_up ()
+{
+	return stub_incoming_cmd == NULL && stub_now_ms() >= stub_up_at;
+}
+
+static void stub_log ( const char *fmt, ... )
+{
+	const char *path = getenv ( "STUB_KVM_LOG" );
+	char line[8192];
+	va_list ap;
+	int len, fd;
+
+	if ( path == NULL )
+		return;
+
+	len = snprintf ( line, sizeof ( line ), "%i ", getpid() );
+	va_start ( ap, fmt );
+	len += vsnprintf ( &line[len], sizeof ( line ) - len - 1, fmt, ap );
+	va_end ( ap );
+
+	if ( len > ( int ) sizeof ( line ) - 2 )
+		len = sizeof ( line ) - 2;
+
+	line[len++] = '\n';
+
+	// One write() per line, so the lines of the concurrent stubs don't mix
+	if ( ( fd = open ( path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 ) ) == -1 )
+		return;
+
+	if ( write ( fd, line, len ) == -1 )
+		perror ( "write" );
+
+	close ( fd );
+	return;
+}
+
+static void stub_die ( const char *what )
+{
+	perror ( what );
+	stub_log ( "error: %s: %s", what, strerror ( errno ) );
+	exit ( 1 );
+}
+
+static void stub_unlink ()
+{
+	int i = 0;
+
+	if ( *stub_vnc_path )
+		unlink ( stub_vnc_path );
+
+	while ( i < stub_monitors_count )
+		unlink ( stub_monitors[i++].path );
+
+	return;
+}
+
+static void stub_exit ( int signum )
+{
+	stub_unlink();
+	_exit ( 0 );
+}
+
+static int stub_recvn ( int fd, void *buf, size_t size )
+{
+	size_t got = 0;
+
+	while ( got < size ) {
+		ssize_t r = recv ( fd, ( char * ) buf + got, size - got, 0 );
+
+		if ( r <= 0 )
+			return -1;
+
+		got += r;
+	}
+
+	return 0;
+}
+
+static int stub_sendall ( int fd, const void *buf, size_t size )
+{
+	size_t sent = 0;
+
+	while ( sent < size ) {
+		ssize_t r = send ( fd, ( const char * ) buf + sent, size - sent, MSG_NOSIGNAL );
+
+		if ( r <= 0 )
+			return -1;
+
+		sent += r;
+	}
+
+	return 0;
+}
+
+/*
+ * Serves a VNC client: the server part of the RFB 3.8 handshake, then
+ * the echo. The argument is the descriptor, negated if the client was
+ * handed over by "add_client".
+ */
+static void *stub_rfb ( void *arg )
+{
+	static const char init[] = "\0\x08\0\x08" "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0" "\0\0\0\x04" "stub";
+	int fd = ( long ) arg, handed_over = fd < 0;
+	char version[12], c, *buf;
+	ssize_t r;
+
+	if ( handed_over )
+		fd = -fd;
+
+	if ( stub_sendall ( fd, "RFB 003.008\n", 12 ) || stub_recvn ( fd, version, sizeof ( version ) ) ||
+	     stub_sendall ( fd, "\x01\x01", 2 ) || stub_recvn ( fd, &c, 1 ) || c != 1 ||
+	     stub_sendall ( fd, "\0\0\0\0", 4 ) ) {
+		close ( fd );
+		return NULL;
+	}
+
+	// kvm-pool connects to the spare VMs in advance, up to here
+	stub_log ( "rfb: connected%s", handed_over ? " (handed over)" : "" );
+
+	if ( stub_recvn ( fd, &c, 1 ) || stub_sendall ( fd, init, sizeof ( init ) - 1 ) ) {
+		close ( fd );
+		return NULL;
+	}
+
+	buf = malloc ( STUB_BUFSIZE );
+
+	while ( buf != NULL && ( r = recv ( fd, buf, STUB_BUFSIZE, 0 ) ) > 0 )
+		if ( stub_sendall ( fd, buf, r ) )
+			break;
+
+	free ( buf );
+	close ( fd );
+
+	if ( handed_over && write ( stub_events[1], "", 1 ) == -1 )
+		perror ( "write" );
+
+	return NULL;
+}
+
+static void stub_rfb_start ( int fd, int handed_over )
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	pthread_attr_init ( &attr );
+	pthread_attr_setdetachstate ( &attr, PTHREAD_CREATE_DETACHED );
+	pthread_attr_setstacksize ( &attr, 1 << 17 );
+
+	if ( pthread_create ( &thread, &attr, stub_rfb, ( void * ) ( long ) ( handed_over ? -fd : fd ) ) ) {
+		perror ( "pthread_create" );
+		close ( fd );
+	}
+
+	pthread_attr_destroy ( &attr );
+	return;
+}
+
+// "unix:<path>[,options]" (the path is returned) or ":<display>" (the path is empty)
+static int stub_listen ( const char *addr, char *path, size_t path_size )
+{
+	union {
+		struct sockaddr		sa;
+		struct sockaddr_un	un;
+		struct sockaddr_in	in;
+	} sa;
+	socklen_t len;
+	int fd, one = 1;
+	memset ( &sa, 0, sizeof ( sa ) );
+	*path = 0;
+
+	if ( !strncmp ( addr, "unix:", 5 ) ) {
+		snprintf ( path, path_size, "%.*s", ( int ) strcspn ( &addr[5], "," ), &addr[5] );
+		sa.un.sun_family = AF_UNIX;
+		strncpy ( sa.un.sun_path, path, sizeof ( sa.un.sun_path ) - 1 );
+		len = sizeof ( sa.un );
+		unlink ( path );
+	} else if ( *addr == ':' ) {
+		sa.in.sin_family      = AF_INET;
+		sa.in.sin_addr.s_addr = htonl ( INADDR_LOOPBACK );
+		sa.in.sin_port        = htons ( 5900 + atoi ( &addr[1] ) );
+		len = sizeof ( sa.in );
+	} else {
+		errno = EINVAL;
+		stub_die ( addr );
+	}
+
+	if ( ( fd = socket ( sa.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) == -1 )
+		stub_die ( "socket" );
+
+	if ( sa.sa.sa_family == AF_INET )
+		setsockopt ( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof ( one ) );
+
+	if ( bind ( fd, &sa.sa, len ) || listen ( fd, 16 ) )
+		stub_die ( addr );
+
+	return fd;
+}
+
+// Copies the (unescaped) string value of the first "key" of the JSON line
+static int stub_json_str ( const char *line, const char *key, char *out, size_t size )
+{
+	char pattern[64];
+	const char *p;
+	size_t len = 0;
+	snprintf ( pattern, sizeof ( pattern ), "\"%s\"", key );
+
+	if ( ( p = strstr ( line, pattern ) ) == NULL )
+		return -1;
+
+	p += strlen ( pattern );
+	p += strspn ( p, " :" );
+
+	if ( *p++ != '"' )
+		return -1;
+
+	while ( *p && *p != '"' && len < size - 1 ) {
+		char c = *p++;
+
+		if ( c == '\\' ) {
+			switch ( ( c = *p++ ) ) {
+				case 'n':
+					c = '\n';
+					break;
+
+				case 't':
+					c = '\t';
+					break;
+
+				case 'u': {
+						char hex[5] = {0};
+						strncpy ( hex, p, 4 );
+						c = strtol ( hex, NULL, 16 );
+						p += strlen ( hex );
+						break;
+					}
+			}
+		}
+
+		out[len++] = c;
+	}
+
+	out[len] = 0;
+	return *p == '"' ? 0 : -1;
+}
+
+static void stub_qmp_send ( struct stub_monitor *m, const char *json )
+{
+	if ( stub_sendall ( m->fd, json, strlen ( json ) ) || stub_sendall ( m->fd, "\n", 1 ) )
+		perror ( "send" );
+
+	return;
+}
+
+static void stub_qmp_error ( struct stub_monitor *m, const char *desc )
+{
+	char json[512];
+	snprintf ( json, sizeof ( json ), "{\"error\": {\"class\": \"GenericError\", \"desc\": \"%s\"}}", desc );
+	stub_qmp_send ( m, json );
+	return;
+}
+
+static struct stub_fd *stub_fd_find ( const char *name )
+{
+	int i = 0;
+
+	while ( i < STUB_FDS_MAX ) {
+		struct stub_fd *f = &stub_fds[i++];
+
+		if ( !strcmp ( f->name, name ) )
+			return f;
+	}
+
+	return NULL;
+}
+
+// Writes the state to the shell command (the "exec:" migration)
+static int stub_migrate ( const char *command )
+{
+	FILE *f = popen ( command, "w" );
+	int rc;
+
+	if ( f == NULL )
+		return -1;
+
+	rc = fputs ( STUB_STATE, f ) == EOF;
+	return pclose ( f ) || rc ? -1 : 0;
+}
+
+// Reads the state from the shell command ("-incoming exec:<command>")
+static int stub_incoming ( const char *command )
+{
+	char state[sizeof ( STUB_STATE ) + 1] = {0};
+	FILE *f = popen ( command, "r" );
+	size_t len;
+
+	if ( f == NULL )
+		return -1;
+
+	len = fread ( state, 1, sizeof ( state ) - 1, f );
+	return pclose ( f ) || len != sizeof ( STUB_STATE ) - 1 || strcmp ( state, STUB_STATE ) ? -1 : 0;
+}
+
+static void stub_hmp ( struct stub_monitor *m, const char *line )
+{
+	char cmdline[256];
+
+	if ( stub_json_str ( line, "command-line", cmdline, sizeof ( cmdline ) ) ) {
+		stub_qmp_error ( m, "no command-line" );
+		return;
+	}
+
+	if ( !strncmp ( cmdline, "savevm ", 7 ) ) {
+		if ( stub_incoming_cmd != NULL ) {
+			stub_log ( "savevm: refused, restoring" );
+			stub_qmp_send ( m, "{\"return\": \"Error: The VM is being restored\\r\\n\"}" );
+			return;
+		}
+
+		stub_saved = stub_guest_up() ? 1 : 2;
+		stub_log ( "savevm: %s", stub_saved == 1 ? "guest up" : "guest booting" );
+	} else if ( !strncmp ( cmdline, "loadvm ", 7 ) ) {
+		if ( !stub_saved ) {
+			stub_qmp_send ( m, "{\"return\": \"Error: Snapshot does not exist\\r\\n\"}" );
+			return;
+		}
+
+		// The guest continues from where it was saved
+		stub_up_at = stub_saved == 1 ? 0 : stub_now_ms() + stub_boot_ms;
+		stub_log ( "loadvm: %s", stub_saved == 1 ? "guest up" : "guest booting" );
+	}
+
+	stub_qmp_send ( m, "{\"return\": \"\"}" );
+	return;
+}
+
+static void stub_qmp_execute ( struct stub_monitor *m, const char *line )
+{
+	char cmd[64], name[sizeof ( stub_fds[0].name )];
+	struct stub_fd *f;
+
+	if ( stub_json_str ( line, "execute", cmd, sizeof ( cmd ) ) ) {
+		stub_qmp_error ( m, "no command" );
+		return;
+	}
+
+	if ( m->agent ) {
+		stub_log ( "agent: %s", line );
+
+		if ( !strcmp ( cmd, "guest-ping" ) )
+			stub_qmp_send ( m, "{\"return\": {}}" );
+		else
+			stub_qmp_error ( m, "The command is not supported by the stub" );
+
+		return;
+	}
+
+	stub_log ( "qmp: %s", line );
+
+	if ( !strcmp ( cmd, "stop" ) || !strcmp ( cmd, "cont" ) )
+		stub_paused = !strcmp ( cmd, "stop" );
+
+	if ( !strcmp ( cmd, "qmp_capabilities" ) || !strcmp ( cmd, "stop" ) || !strcmp ( cmd, "cont" ) )
+		stub_qmp_send ( m, "{\"return\": {}}" );
+	else if ( !strcmp ( cmd, "human-monitor-command" ) )
+		stub_hmp ( m, line );
+	else if ( !strcmp ( cmd, "query-status" ) ) {
+		const char *status = stub_incoming_cmd != NULL ? "inmigrate" : stub_paused ? "paused" : "running";
+		char json[128];
+		snprintf ( json, sizeof ( json ), "{\"return\": {\"status\": \"%s\", \"singlestep\": false, \"running\": %s}}", status, strcmp ( status, "running" ) ? "false" : "true" );
+		stub_qmp_send ( m, json );
+	}
+	else if ( !strcmp ( cmd, "getfd" ) ) {
+		if ( m->passed_fd == -1 || stub_json_str ( line, "fdname", name, sizeof ( name ) ) || !*name ) {
+			stub_qmp_error ( m, "No file descriptor supplied via SCM_RIGHTS" );
+			return;
+		}
+
+		if ( ( f = stub_fd_find ( name ) ) != NULL )
+			close ( f->fd );
+		else if ( ( f = stub_fd_find ( "" ) ) == NULL ) {
+			stub_qmp_error ( m, "Too many file descriptors" );
+			return;
+		}
+
+		strcpy ( f->name, name );
+		f->fd        = m->passed_fd;
+		m->passed_fd = -1;
+		stub_qmp_send ( m, "{\"return\": {}}" );
+	} else if ( !strcmp ( cmd, "add_client" ) ) {
+		if ( stub_json_str ( line, "fdname", name, sizeof ( name ) ) || !*name || ( f = stub_fd_find ( name ) ) == NULL ) {
+			stub_qmp_error ( m, "File descriptor named not found" );
+			return;
+		}
+
+		stub_rfb_start ( f->fd, 1 );
+		*f->name = 0;
+		stub_qmp_send ( m, "{\"return\": {}}" );
+	} else if ( !strcmp ( cmd, "migrate" ) ) {
+		char uri[16384];
+
+		if ( stub_json_str ( line, "uri", uri, sizeof ( uri ) ) || strncmp ( uri, "exec:", 5 ) ) {
+			stub_qmp_error ( m, "Only exec: migration is supported by the stub" );
+			return;
+		}
+
+		stub_migration = stub_migrate ( &uri[5] ) ? "failed" : "completed";
+		stub_log ( "migrate: %s", stub_migration );
+		stub_qmp_send ( m, "{\"return\": {}}" );
+	} else if ( !strcmp ( cmd, "query-migrate" ) ) {
+		char json[128];
+		snprintf ( json, sizeof ( json ), "{\"return\": {\"status\": \"%s\"}}", stub_migration );
+		stub_qmp_send ( m, json );
+	} else
+		stub_qmp_error ( m, "The command is not supported by the stub" );
+
+	return;
+}
+
+static void stub_qmp_close ( struct stub_monitor *m )
+{
+	close ( m->fd );
+
+	if ( m->passed_fd != -1 )
+		close ( m->passed_fd );
+
+	m->fd = m->passed_fd = -1;
+	m->len = 0;
+	return;
+}
+
+// Reads the commands (one per line) and the descriptors passed with them
+static void stub_qmp_read ( struct stub_monitor *m )
+{
+	union {
+		char		buf[CMSG_SPACE ( sizeof ( int ) )];
+		struct cmsghdr	align;
+	} cmsg_buf;
+	struct iovec iov = { &m->buf[m->len], sizeof ( m->buf ) - 1 - m->len };
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	char *nl;
+	ssize_t r;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = cmsg_buf.buf;
+	msg.msg_controllen = sizeof ( cmsg_buf.buf );
+
+	if ( ( r = recvmsg ( m->fd, &msg, MSG_CMSG_CLOEXEC ) ) <= 0 ) {
+		stub_qmp_close ( m );
+		return;
+	}
+
+	for ( cmsg = CMSG_FIRSTHDR ( &msg ); cmsg != NULL; cmsg = CMSG_NXTHDR ( &msg, cmsg ) )
+		if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+			if ( m->passed_fd != -1 )
+				close ( m->passed_fd );
+
+			memcpy ( &m->passed_fd, CMSG_DATA ( cmsg ), sizeof ( int ) );
+		}
+
+	m->len += r;
+	m->buf[m->len] = 0;
+
+	while ( ( nl = strchr ( m->buf, '\n' ) ) != NULL ) {
+		size_t line_len = nl + 1 - m->buf;
+		*nl = 0;
+		stub_qmp_execute ( m, m->buf );
+		m->len -= line_len;
+		memmove ( m->buf, &m->buf[line_len], m->len + 1 );
+	}
+
+	if ( m->len == sizeof ( m->buf ) - 1 ) {
+		fprintf ( stderr, "stub-kvm: too long QMP command\n" );
+		stub_qmp_close ( m );
+	}
+
+	return;
+}
+
+static void stub_qmp_accept ( struct stub_monitor *m )
+{
+	if ( ( m->fd = accept4 ( m->listen_fd, NULL, NULL, SOCK_CLOEXEC ) ) == -1 || m->agent )
+		return;
+
+	stub_qmp_send ( m, "{\"QMP\": {\"version\": {\"qemu\": {\"micro\": 0, \"minor\": 0, \"major\": 0}, \"package\": \"stub\"}, \"capabilities\": []}}" );
+	return;
+}
+
+// A handed-over client is gone
+static void stub_qmp_events ()
+{
+	char buf[64];
+	ssize_t r = read ( stub_events[0], buf, sizeof ( buf ) );
+
+	while ( r-- > 0 ) {
+		int i = 0;
+
+		while ( i < stub_monitors_count ) {
+			struct stub_monitor *m = &stub_monitors[i++];
+
+			if ( m->fd != -1 && !m->agent )
+				stub_qmp_send ( m, "{\"timestamp\": {\"seconds\": 0, \"microseconds\": 0}, \"event\": \"VNC_DISCONNECTED\", \"data\": {}}" );
+		}
+	}
+
+	return;
+}
+
+// The state is restored ("-incoming"), the guest runs
+static void stub_restore ()
+{
+	if ( strncmp ( stub_incoming_cmd, "exec:", 5 ) || stub_incoming ( &stub_incoming_cmd[5] ) ) {
+		stub_log ( "incoming: cannot restore from \"%s\"", stub_incoming_cmd );
+		stub_unlink();
+		exit ( 1 );
+	}
+
+	stub_log ( "incoming: restored" );
+	stub_incoming_cmd = NULL;
+	stub_up_at = stub_now_ms();
+	return;
+}
+
+// "socket,id=<id>,path=<path>[,options]": the host side of the guest agent port
+static void stub_chardev ( const char *chardev )
+{
+	char addr[sizeof ( ( ( struct sockaddr_un * ) 0 )->sun_path ) + 8];
+	struct stub_monitor *m;
+	const char *path = strstr ( chardev, ",path=" );
+
+	if ( strncmp ( chardev, "socket,", 7 ) || path == NULL || stub_monitors_count >= STUB_MONITORS_MAX )
+		return;
+
+	path += sizeof ( ",path=" ) - 1;
+	snprintf ( addr, sizeof ( addr ), "unix:%.*s", ( int ) strcspn ( path, "," ), path );
+	m = &stub_monitors[stub_monitors_count++];
+	m->agent     = 1;
+	m->listen_fd = stub_listen ( addr, m->path, sizeof ( m->path ) );
+	m->fd = m->passed_fd = -1;
+	return;
+}
+
+int main ( int argc, char *argv[] )
+{
+	struct pollfd pfds[2 + STUB_MONITORS_MAX];
+	const char *vnc = NULL, *boot_ms = getenv ( "STUB_KVM_BOOT_MS" ), *restore_ms = getenv ( "STUB_KVM_RESTORE_MS" ), *early = getenv ( "STUB_KVM_EARLY_VNC" );
+	char args[8192];
+	int i = 1, len = 0, vnc_fd, delay;
+	prctl ( PR_SET_PDEATHSIG, SIGTERM );
+	signal ( SIGTERM, stub_exit );
+	signal ( SIGINT, stub_exit );
+	signal ( SIGPIPE, SIG_IGN );
+	*args = 0;
+
+	while ( i < argc && len < ( int ) sizeof ( args ) )
+		len += snprintf ( &args[len], sizeof ( args ) - len, " %s", argv[i++] );
+
+	stub_log ( "argv:%s", args );
+	i = 1;
+
+	// The first "-vnc" is the one of kvm-pool
+	while ( i < argc - 1 ) {
+		const char *opt = argv[i++];
+
+		if ( !strcmp ( opt, "-vnc" ) && vnc == NULL )
+			vnc = argv[i++];
+		else if ( !strcmp ( opt, "-incoming" ) )
+			stub_incoming_cmd = argv[i++];
+		else if ( !strcmp ( opt, "-chardev" ) )
+			stub_chardev ( argv[i++] );
+		else if ( !strcmp ( opt, "-qmp" ) && stub_monitors_count < STUB_MONITORS_MAX ) {
+			struct stub_monitor *m = &stub_monitors[stub_monitors_count++];
+			m->listen_fd = stub_listen ( argv[i++], m->path, sizeof ( m->path ) );
+			m->fd = m->passed_fd = -1;
+		}
+	}
+
+	if ( vnc == NULL ) {
+		fprintf ( stderr, "stub-kvm: no -vnc\n" );
+		return 1;
+	}
+
+	if ( pipe2 ( stub_events, O_CLOEXEC ) )
+		stub_die ( "pipe2" );
+
+	if ( stub_incoming_cmd != NULL )
+		delay = restore_ms != NULL ? atoi ( restore_ms ) : STUB_DEFAULT_RESTORE_MS;
+	else
+		delay = boot_ms != NULL ? atoi ( boot_ms ) : STUB_DEFAULT_BOOT_MS;
+
+	stub_boot_ms = boot_ms != NULL ? atoi ( boot_ms ) : STUB_DEFAULT_BOOT_MS;
+
+	stub_up_at = stub_now_ms() + delay;
+
+	if ( early == NULL || !atoi ( early ) ) {
+		usleep ( delay * 1000 );
+
+		if ( stub_incoming_cmd != NULL )
+			stub_restore();
+	}
+
+	vnc_fd = stub_listen ( vnc, stub_vnc_path, sizeof ( stub_vnc_path ) );
+	stub_log ( "vnc: %s", vnc );
+
+	while ( 1 ) {
+		long long now = stub_now_ms();
+		int timeout = -1, up;
+
+		if ( stub_incoming_cmd != NULL && now >= stub_up_at )
+			stub_restore();
+
+		if ( !( up = stub_guest_up() ) )
+			timeout = stub_up_at > now ? stub_up_at - now : 0;
+
+		pfds[0].fd     = vnc_fd;
+		pfds[1].fd     = stub_events[0];
+		pfds[0].events = pfds[1].events = POLLIN;
+		i = 0;
+
+		while ( i < stub_monitors_count ) {
+			struct stub_monitor *m = &stub_monitors[i];
+			pfds[2 + i].fd = m->fd == -1 ? m->listen_fd : m->fd;
+
+			// Nobody reads the port of the agent until the agent is started in the guest
+			if ( m->agent && m->fd != -1 && !up )
+				pfds[2 + i].fd = -1;
+
+			pfds[2 + i++].events = POLLIN;
+		}
+
+		if ( poll ( pfds, 2 + stub_monitors_count, timeout ) == -1 ) {
+			if ( errno == EINTR )
+				continue;
+
+			stub_die ( "poll" );
+		}
+
+		if ( pfds[0].revents ) {
+			int fd = accept4 ( vnc_fd, NULL, NULL, SOCK_CLOEXEC );
+
+			if ( fd != -1 )
+				stub_rfb_start ( fd, 0 );
+		}
+
+		if ( pfds[1].revents )
+			stub_qmp_events();
+
+		i = 0;
+
+		while ( i < stub_monitors_count ) {
+			struct stub_monitor *m = &stub_monitors[i];
+
+			if ( !pfds[2 + i++].revents )
+				continue;
+
+			if ( m->fd == -1 )
+				stub_qmp_accept ( m );
+			else
+				stub_qmp_read ( m );
+		}
+	}
+
+	return 0;
+}
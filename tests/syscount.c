@@ -0,0 +1,144 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * Counts the system calls of a command (all its threads, not its child
+ * processes) with ptrace, for the benchmark (see bench.sh):
+ *
+ *	syscount <count-file> <command> [arguments]
+ *
+ * On SIGUSR1 the count so far is written to <count-file>, so the calls
+ * of a part of the run can be measured. The final count is written when
+ * the command exits.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t syscount_dump;
+
+static void syscount_sigusr1 ( int signum )
+{
+	syscount_dump = 1;
+	return;
+}
+
+static void syscount_write ( const char *path, uint64_t count )
+{
+	char tmp[4096];
+	FILE *f;
+	snprintf ( tmp, sizeof ( tmp ), "%s.tmp", path );
+
+	// Renamed, so the reader never sees a partial file
+	if ( ( f = fopen ( tmp, "w" ) ) == NULL ) {
+		perror ( tmp );
+		return;
+	}
+
+	fprintf ( f, "%llu\n", ( unsigned long long ) count );
+	fclose ( f );
+
+	if ( rename ( tmp, path ) )
+		perror ( path );
+
+	return;
+}
+
+int main ( int argc, char *argv[] )
+{
+	struct sigaction sa;
+	uint64_t stops = 0;	// A system call is two stops: the entry and the exit
+	pid_t pid, tid;
+	int status;
+
+	if ( argc < 3 ) {
+		fprintf ( stderr, "usage: syscount <count-file> <command> [arguments]\n" );
+		return 2;
+	}
+
+	if ( ( pid = fork() ) == 0 ) {
+		ptrace ( PTRACE_TRACEME, 0, NULL, NULL );
+		raise ( SIGSTOP );
+		execvp ( argv[2], &argv[2] );
+		perror ( argv[2] );
+		_exit ( 127 );
+	}
+
+	if ( pid == -1 || waitpid ( pid, &status, 0 ) != pid || !WIFSTOPPED ( status ) ) {
+		perror ( "syscount" );
+		return 1;
+	}
+
+	// No SA_RESTART: the signal interrupts waitpid()
+	memset ( &sa, 0, sizeof ( sa ) );
+	sa.sa_handler = syscount_sigusr1;
+	sigaction ( SIGUSR1, &sa, NULL );
+	ptrace ( PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL );
+	ptrace ( PTRACE_SYSCALL, pid, NULL, NULL );
+
+	while ( 1 ) {
+		int signum = 0;
+
+		if ( syscount_dump ) {
+			syscount_dump = 0;
+			syscount_write ( argv[1], stops / 2 );
+		}
+
+		if ( ( tid = waitpid ( -1, &status, __WALL ) ) == -1 ) {
+			if ( errno == EINTR )
+				continue;
+
+			perror ( "waitpid" );
+			return 1;
+		}
+
+		if ( WIFEXITED ( status ) || WIFSIGNALED ( status ) ) {
+			if ( tid != pid )
+				continue;
+
+			syscount_write ( argv[1], stops / 2 );
+			return WIFEXITED ( status ) ? WEXITSTATUS ( status ) : 128 + WTERMSIG ( status );
+		}
+
+		if ( !WIFSTOPPED ( status ) )
+			continue;
+
+		// The system call stops, the clone events and the initial stops of new threads are not signals
+		if ( WSTOPSIG ( status ) == ( SIGTRAP | 0x80 ) )
+			stops++;
+		else if ( WSTOPSIG ( status ) != SIGTRAP && WSTOPSIG ( status ) != SIGSTOP )
+			signum = WSTOPSIG ( status );
+
+		ptrace ( PTRACE_SYSCALL, tid, NULL, ( void * ) ( long ) signum );
+	}
+
+	return 0;
+}
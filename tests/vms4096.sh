@@ -0,0 +1,28 @@
+#!/bin/sh
+# 4096 VMs at once (--vnc-transport=unix, so there's no TCP port limit):
+# every VM has to get a MAC, a VNC id and a socket of its own, the MAC
+# suffix has to be the VNC id, and all of them have to become ready.
+
+. "$(dirname "$0")/common.sh"
+
+VMS=${VMS:-4096}
+STUB_KVM_BOOT_MS=0
+# A socket and a pidfd per VM, at least
+ulimit -n "$(ulimit -Hn)" 2>/dev/null
+[ "$(ulimit -n)" = unlimited ] || [ "$(ulimit -n)" -ge $(( VMS * 3 + 64 )) ] || fail "ulimit -n is too low for $VMS VMs: $(ulimit -n)"
+
+kp_start --vnc-transport=unix --max-vms=$VMS --min-vms=$VMS --min-spare=$VMS --max-spare=$VMS --max-booting=256
+wait_for 600 '[ "$(stub_count "rfb: connected")" -ge $VMS ]' || fail "only $(stub_count "rfb: connected") of $VMS VMs are ready"
+
+grep "argv:" "$STUB_KVM_LOG" | sed -n 's/.* -vnc unix:[^ ]*\/vm-\([0-9]*\)\.sock .*macaddr=\([0-9a-f:]*\).*/\1 \2/p' > "$WORK_DIR/vms"
+[ "$(wc -l < "$WORK_DIR/vms")" -eq $VMS ] || fail "$(wc -l < "$WORK_DIR/vms") of $VMS VMs are spawned"
+[ "$(cut -d' ' -f1 "$WORK_DIR/vms" | sort -u | wc -l)" -eq $VMS ] || fail "the VNC ids are not unique"
+[ "$(cut -d' ' -f2 "$WORK_DIR/vms" | sort -u | wc -l)" -eq $VMS ] || fail "the MACs are not unique"
+[ "$(ls "$WORK_DIR/run" | grep -c '^vm-[0-9]*\.sock$')" -eq $VMS ] || fail "the sockets are not unique"
+
+while read -r id mac; do
+	[ "$mac" = "$(printf '52:54:00:%02x:%02x:%02x' $(( id >> 16 )) $(( id >> 8 & 255 )) $(( id & 255 )))" ] || fail "VM $id has MAC $mac"
+done < "$WORK_DIR/vms"
+
+vnc_client -s 65536 || fail "the client is not served"
+pass
@@ -0,0 +1,275 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+/*
+ * A VNC client for the tests: every client connects to kvm-pool, does
+ * the client part of the RFB 3.8 handshake and sends a pattern, which has
+ * to come back unchanged (the VMs are tests/kvm, they echo). It prints
+ * the handshake time of every client and the total throughput.
+ *
+ *	vnc-client [-c clients] [-s bytes] [-h hold-ms] <host> <port>
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CLIENT_CHUNK (1<<16)
+
+struct client {
+	pthread_t	 thread;
+	int		 fd;
+	int		 failed;
+	double		 handshake_s;
+	char		 name[64];
+};
+
+static struct sockaddr_in client_addr;
+static size_t client_bytes;
+static int client_hold_ms;
+
+static double client_now ()
+{
+	struct timespec ts;
+	clock_gettime ( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int client_recvn ( int fd, void *buf, size_t size )
+{
+	size_t got = 0;
+
+	while ( got < size ) {
+		ssize_t r = recv ( fd, ( char * ) buf + got, size - got, 0 );
+
+		if ( r <= 0 ) {
+			if ( !r )
+				errno = ECONNRESET;
+
+			return -1;
+		}
+
+		got += r;
+	}
+
+	return 0;
+}
+
+static int client_sendall ( int fd, const void *buf, size_t size )
+{
+	size_t sent = 0;
+
+	while ( sent < size ) {
+		ssize_t r = send ( fd, ( const char * ) buf + sent, size - sent, MSG_NOSIGNAL );
+
+		if ( r <= 0 )
+			return -1;
+
+		sent += r;
+	}
+
+	return 0;
+}
+
+static unsigned char client_pattern ( size_t offset )
+{
+	return ( offset * 7 + offset / 4093 ) & 0xff;
+}
+
+// Sends the pattern, while the client thread reads it back
+static void *client_writer ( void *arg )
+{
+	struct client *c = arg;
+	unsigned char buf[CLIENT_CHUNK];
+	size_t sent = 0;
+
+	while ( sent < client_bytes ) {
+		size_t i = 0, n = client_bytes - sent < sizeof ( buf ) ? client_bytes - sent : sizeof ( buf );
+
+		while ( i < n ) {
+			buf[i] = client_pattern ( sent + i );
+			i++;
+		}
+
+		if ( client_sendall ( c->fd, buf, n ) )
+			return ( void * ) 1;
+
+		sent += n;
+	}
+
+	return NULL;
+}
+
+static int client_handshake ( struct client *c )
+{
+	unsigned char version[12], n, types[256], result[4], init[24];
+	uint32_t name_len;
+
+	if ( client_recvn ( c->fd, version, sizeof ( version ) ) || memcmp ( version, "RFB 003.00", 10 ) ||
+	     client_sendall ( c->fd, "RFB 003.008\n", 12 ) || client_recvn ( c->fd, &n, 1 ) || !n ||
+	     client_recvn ( c->fd, types, n ) || memchr ( types, 1, n ) == NULL ||
+	     client_sendall ( c->fd, "\x01", 1 ) || client_recvn ( c->fd, result, 4 ) || memcmp ( result, "\0\0\0\0", 4 ) ||
+	     client_sendall ( c->fd, "\x01", 1 ) || client_recvn ( c->fd, init, sizeof ( init ) ) )
+		return -1;
+
+	memcpy ( &name_len, &init[20], sizeof ( name_len ) );
+	name_len = ntohl ( name_len );
+
+	if ( name_len >= sizeof ( c->name ) || client_recvn ( c->fd, c->name, name_len ) )
+		return -1;
+
+	c->name[name_len] = 0;
+	return 0;
+}
+
+static void *client_run ( void *arg )
+{
+	struct client *c = arg;
+	unsigned char buf[CLIENT_CHUNK];
+	double start = client_now();
+	pthread_t writer;
+	size_t got = 0;
+	void *rc;
+	int one = 1;
+
+	if ( ( c->fd = socket ( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) == -1 || connect ( c->fd, ( struct sockaddr * ) &client_addr, sizeof ( client_addr ) ) ) {
+		perror ( "vnc-client: connect" );
+		c->failed = 1;
+		return NULL;
+	}
+
+	setsockopt ( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof ( one ) );
+
+	if ( client_handshake ( c ) ) {
+		fprintf ( stderr, "vnc-client: the RFB handshake failed: %s\n", strerror ( errno ) );
+		c->failed = 1;
+		close ( c->fd );
+		return NULL;
+	}
+
+	c->handshake_s = client_now() - start;
+	pthread_create ( &writer, NULL, client_writer, c );
+
+	while ( got < client_bytes && !c->failed ) {
+		ssize_t i = 0, r = recv ( c->fd, buf, sizeof ( buf ), 0 );
+
+		if ( r <= 0 ) {
+			fprintf ( stderr, "vnc-client: the connection is closed after %zu bytes\n", got );
+			c->failed = 1;
+			break;
+		}
+
+		while ( i < r && buf[i] == client_pattern ( got + i ) )
+			i++;
+
+		if ( i < r ) {
+			fprintf ( stderr, "vnc-client: wrong data at offset %zu\n", got + i );
+			c->failed = 1;
+		}
+
+		got += r;
+	}
+
+	if ( c->failed )
+		shutdown ( c->fd, SHUT_RDWR );
+
+	pthread_join ( writer, &rc );
+
+	if ( rc != NULL )
+		c->failed = 1;
+
+	usleep ( client_hold_ms * 1000 );
+	close ( c->fd );
+	return NULL;
+}
+
+int main ( int argc, char *argv[] )
+{
+	struct client *clients;
+	int opt, count = 1, failed = 0, i = 0;
+	double start, elapsed;
+
+	while ( ( opt = getopt ( argc, argv, "c:s:h:" ) ) != -1 ) {
+		switch ( opt ) {
+			case 'c':
+				count = atoi ( optarg );
+				break;
+
+			case 's':
+				client_bytes = strtoull ( optarg, NULL, 0 );
+				break;
+
+			case 'h':
+				client_hold_ms = atoi ( optarg );
+				break;
+
+			default:
+				fprintf ( stderr, "usage: vnc-client [-c clients] [-s bytes] [-h hold-ms] <host> <port>\n" );
+				return 2;
+		}
+	}
+
+	if ( argc - optind != 2 || count < 1 || !inet_aton ( argv[optind], &client_addr.sin_addr ) ) {
+		fprintf ( stderr, "usage: vnc-client [-c clients] [-s bytes] [-h hold-ms] <host> <port>\n" );
+		return 2;
+	}
+
+	client_addr.sin_family = AF_INET;
+	client_addr.sin_port   = htons ( atoi ( argv[optind + 1] ) );
+	clients = calloc ( count, sizeof ( *clients ) );
+	start   = client_now();
+
+	while ( i < count ) {
+		pthread_create ( &clients[i].thread, NULL, client_run, &clients[i] );
+		i++;
+	}
+
+	while ( i-- > 0 )
+		pthread_join ( clients[i].thread, NULL );
+
+	elapsed = client_now() - start - client_hold_ms / 1000.0;
+
+	while ( ++i < count ) {
+		struct client *c = &clients[i];
+
+		if ( c->failed )
+			failed++;
+		else
+			printf ( "client %i: ok, handshake %.3f s, server \"%s\"\n", i, c->handshake_s, c->name );
+	}
+
+	printf ( "clients %i, failed %i, %zu bytes each way per client, %.3f s, %.1f MiB/s (both ways)\n", count, failed, client_bytes, elapsed,
+		 elapsed > 0 ? 2.0 * count * client_bytes / ( 1 << 20 ) / elapsed : 0 );
+	free ( clients );
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,237 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A minimal io_uring wrapper (raw syscalls, no liburing): one SQ/CQ
+ * pair plus a ring of provided buffers registered in the kernel.
+ */
+
+#include "common.h"
+
+#ifdef IO_URING_SUPPORT
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#include "error.h"
+
+static inline int io_uring_setup ( unsigned entries, struct io_uring_params *params_p )
+{
+	return syscall ( __NR_io_uring_setup, entries, params_p );
+}
+
+static inline int io_uring_enter ( int fd, unsigned to_submit, unsigned min_complete, unsigned flags )
+{
+	return syscall ( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static inline int io_uring_register ( int fd, unsigned opcode, void *arg, unsigned nr_args )
+{
+	return syscall ( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+void uring_deinit ( uring_t *uring )
+{
+	if ( uring->buf_ring != NULL )
+		munmap ( uring->buf_ring, uring->buf_ring_size );
+
+	if ( uring->bufs != NULL )
+		munmap ( uring->bufs, uring->bufs_count * uring->buf_size );
+
+	if ( uring->sqes != NULL )
+		munmap ( uring->sqes, uring->sqes_size );
+
+	if ( uring->cq_ring != NULL && uring->cq_ring != uring->sq_ring )
+		munmap ( uring->cq_ring, uring->cq_ring_size );
+
+	if ( uring->sq_ring != NULL )
+		munmap ( uring->sq_ring, uring->sq_ring_size );
+
+	if ( uring->fd > 0 )
+		close ( uring->fd );
+
+	memset ( uring, 0, sizeof ( *uring ) );
+	return;
+}
+
+int uring_init ( uring_t *uring, unsigned entries, unsigned bufs_count, size_t buf_size )
+{
+	struct io_uring_params params = {0};
+	struct io_uring_buf_reg buf_reg = {0};
+	unsigned bid;
+	debug ( 3, "(uring, %u, %u, %u)", entries, bufs_count, buf_size );
+	critical_on ( bufs_count & ( bufs_count - 1 ) );	// Has to be a power of 2
+	memset ( uring, 0, sizeof ( *uring ) );
+	params.flags      = IORING_SETUP_CQSIZE;
+	params.cq_entries = entries * 4;
+
+	if ( ( uring->fd = io_uring_setup ( entries, &params ) ) < 0 ) {
+		uring->fd = 0;
+		return errno;
+	}
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof ( unsigned );
+	uring->cq_ring_size = params.cq_off.cqes  + params.cq_entries * sizeof ( struct io_uring_cqe );
+
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+		uring->sq_ring_size = uring->cq_ring_size = MAX ( uring->sq_ring_size, uring->cq_ring_size );
+
+	uring->sq_ring = mmap ( NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING );
+
+	if ( uring->sq_ring == MAP_FAILED )
+		goto l_uring_init_fail;
+
+	if ( params.features & IORING_FEAT_SINGLE_MMAP )
+		uring->cq_ring = uring->sq_ring;
+	else {
+		uring->cq_ring = mmap ( NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING );
+
+		if ( uring->cq_ring == MAP_FAILED )
+			goto l_uring_init_fail;
+	}
+
+	uring->sqes_size = params.sq_entries * sizeof ( struct io_uring_sqe );
+	uring->sqes = mmap ( NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES );
+
+	if ( uring->sqes == MAP_FAILED )
+		goto l_uring_init_fail;
+
+	uring->sq_head  = uring->sq_ring + params.sq_off.head;
+	uring->sq_tail  = uring->sq_ring + params.sq_off.tail;
+	uring->sq_mask  = uring->sq_ring + params.sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + params.sq_off.array;
+	uring->sq_tail_local = *uring->sq_tail;
+	uring->cq_head  = uring->cq_ring + params.cq_off.head;
+	uring->cq_tail  = uring->cq_ring + params.cq_off.tail;
+	uring->cq_mask  = uring->cq_ring + params.cq_off.ring_mask;
+	uring->cqes     = uring->cq_ring + params.cq_off.cqes;
+	// Provided buffers
+	uring->bufs_count    = bufs_count;
+	uring->buf_size      = buf_size;
+	uring->buf_ring_size = bufs_count * sizeof ( struct io_uring_buf );
+	uring->buf_ring = mmap ( NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+	if ( uring->buf_ring == MAP_FAILED )
+		goto l_uring_init_fail;
+
+	uring->bufs = mmap ( NULL, bufs_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+	if ( uring->bufs == MAP_FAILED )
+		goto l_uring_init_fail;
+
+	buf_reg.ring_addr    = ( unsigned long ) uring->buf_ring;
+	buf_reg.ring_entries = bufs_count;
+	buf_reg.bgid         = 0;
+
+	if ( io_uring_register ( uring->fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1 ) )
+		goto l_uring_init_fail;
+
+	uring->buf_ring->tail = 0;
+	bid = 0;
+
+	while ( bid < bufs_count )
+		uring_buf_recycle ( uring, bid++ );
+
+	return 0;
+l_uring_init_fail: {
+		int rc = errno;
+
+		if ( uring->sq_ring == MAP_FAILED )
+			uring->sq_ring = NULL;
+
+		if ( uring->cq_ring == MAP_FAILED )
+			uring->cq_ring = NULL;
+
+		if ( uring->sqes == MAP_FAILED )
+			uring->sqes = NULL;
+
+		if ( uring->buf_ring == MAP_FAILED )
+			uring->buf_ring = NULL;
+
+		if ( uring->bufs == MAP_FAILED )
+			uring->bufs = NULL;
+
+		uring_deinit ( uring );
+		return rc;
+	}
+}
+
+struct io_uring_sqe *uring_sqe_get ( uring_t *uring )
+{
+	unsigned head = __atomic_load_n ( uring->sq_head, __ATOMIC_ACQUIRE );
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	if ( uring->sq_tail_local - head > *uring->sq_mask )
+		return NULL;
+
+	idx = uring->sq_tail_local & *uring->sq_mask;
+	sqe = &uring->sqes[idx];
+	memset ( sqe, 0, sizeof ( *sqe ) );
+	uring->sq_array[idx] = idx;
+	uring->sq_tail_local++;
+	return sqe;
+}
+
+int uring_submit ( uring_t *uring )
+{
+	unsigned to_submit = uring->sq_tail_local - *uring->sq_tail;
+
+	if ( !to_submit )
+		return 0;
+
+	__atomic_store_n ( uring->sq_tail, uring->sq_tail_local, __ATOMIC_RELEASE );
+	debug ( 10, "io_uring_enter(%i, %u, 0, 0)", uring->fd, to_submit );
+	return io_uring_enter ( uring->fd, to_submit, 0, 0 );
+}
+
+struct io_uring_cqe *uring_cqe_peek ( uring_t *uring )
+{
+	unsigned head = *uring->cq_head;
+
+	if ( head == __atomic_load_n ( uring->cq_tail, __ATOMIC_ACQUIRE ) )
+		return NULL;
+
+	return &uring->cqes[head & *uring->cq_mask];
+}
+
+void uring_cqe_seen ( uring_t *uring )
+{
+	__atomic_store_n ( uring->cq_head, *uring->cq_head + 1, __ATOMIC_RELEASE );
+	return;
+}
+
+void uring_buf_recycle ( uring_t *uring, unsigned bid )
+{
+	unsigned short tail = uring->buf_ring->tail;
+	struct io_uring_buf *buf = &uring->buf_ring->bufs[tail & ( uring->bufs_count - 1 )];
+	buf->addr = ( unsigned long ) uring_buf ( uring, bid );
+	buf->len  = uring->buf_size;
+	buf->bid  = bid;
+	__atomic_store_n ( &uring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE );
+	return;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __KVMPOOL_URING_H
+#define __KVMPOOL_URING_H
+
+#include "common.h"
+
+#ifdef IO_URING_SUPPORT
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int			 fd;
+
+	void			*sq_ring;
+	size_t			 sq_ring_size;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		 sq_tail_local;
+	struct io_uring_sqe	*sqes;
+	size_t			 sqes_size;
+
+	void			*cq_ring;
+	size_t			 cq_ring_size;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	// Provided (kernel-registered) buffers for the buffer group #0
+	struct io_uring_buf_ring *buf_ring;
+	size_t			 buf_ring_size;
+	char			*bufs;
+	unsigned		 bufs_count;
+	size_t			 buf_size;
+};
+typedef struct uring uring_t;
+
+extern int uring_init ( uring_t *uring, unsigned entries, unsigned bufs_count, size_t buf_size );
+extern void uring_deinit ( uring_t *uring );
+extern struct io_uring_sqe *uring_sqe_get ( uring_t *uring );
+extern int uring_submit ( uring_t *uring );
+extern struct io_uring_cqe *uring_cqe_peek ( uring_t *uring );
+extern void uring_cqe_seen ( uring_t *uring );
+extern void uring_buf_recycle ( uring_t *uring, unsigned bid );
+
+static inline unsigned uring_sq_space ( uring_t *uring )
+{
+	return *uring->sq_mask + 1 - ( uring->sq_tail_local - __atomic_load_n ( uring->sq_head, __ATOMIC_ACQUIRE ) );
+}
+
+static inline char *uring_buf ( uring_t *uring, unsigned bid )
+{
+	return &uring->bufs[ ( size_t ) bid * uring->buf_size];
+}
+
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vmtable.h"
+
+#include "error.h"
+#include "malloc.h"
+#include "kvm-pool.h"
+
+int vmtable_init ( vmtable_t *t, int size, int vnc_id_base )
+{
+	int i = 0;
+	memset ( t, 0, sizeof ( *t ) );
+	critical_on ( posix_memalign ( ( void ** ) &t->vms, sizeof ( *t->vms ), size * sizeof ( *t->vms ) ) );
+	memset ( t->vms, 0, size * sizeof ( *t->vms ) );
+	t->cold    = xcalloc ( size, sizeof ( *t->cold ) );
+	t->free    = xcalloc ( size, sizeof ( *t->free ) );
+	t->vnc_ids = xcalloc ( ( size + 63 ) / 64, sizeof ( *t->vnc_ids ) );
+	t->size    = size;
+	t->vnc_id_base = vnc_id_base;
+
+	// The lowest slots are taken first
+	while ( i < size ) {
+		t->free[i] = size - 1 - i;
+		i++;
+	}
+
+	t->free_count = size;
+	return 0;
+}
+
+static int vmtable_vncid_alloc ( vmtable_t *t )
+{
+	int word = 0, words = ( t->size + 63 ) / 64;
+
+	while ( word < words ) {
+		if ( ~t->vnc_ids[word] ) {
+			int bit = __builtin_ctzll ( ~t->vnc_ids[word] );
+			int n = word * 64 + bit;
+
+			if ( n >= t->size )
+				break;
+
+			t->vnc_ids[word] |= 1ULL << bit;
+			return t->vnc_id_base + n;
+		}
+
+		word++;
+	}
+
+	return -1;
+}
+
+static void vmtable_vncid_free ( vmtable_t *t, int vnc_id )
+{
+	int n = vnc_id - t->vnc_id_base;
+	t->vnc_ids[n / 64] &= ~ ( 1ULL << ( n % 64 ) );
+	return;
+}
+
+static void vmtable_unlink ( vmtable_t *t, vm_t *vm )
+{
+	struct vmtable_list *list = &t->lists[vm->list];
+
+	if ( vm->list == VMST_FREE )
+		return;
+
+	if ( vm->prev != NULL )
+		vm->prev->next = vm->next;
+	else
+		list->head = vm->next;
+
+	if ( vm->next != NULL )
+		vm->next->prev = vm->prev;
+	else
+		list->tail = vm->prev;
+
+	list->count--;
+	vm->prev = vm->next = NULL;
+	vm->list = VMST_FREE;
+	return;
+}
+
+static void vmtable_link ( vmtable_t *t, vm_t *vm, vm_state_t state )
+{
+	struct vmtable_list *list = &t->lists[state];
+
+	if ( state == VMST_FREE )
+		return;
+
+	vm->list = state;
+	vm->prev = list->tail;
+	vm->next = NULL;
+
+	if ( list->tail != NULL )
+		list->tail->next = vm;
+	else
+		list->head = vm;
+
+	list->tail = vm;
+	list->count++;
+	return;
+}
+
+// Returns a zeroed VM (in VMST_FREE) with a new VNC id, or NULL if the table is full
+vm_t *vmtable_alloc ( vmtable_t *t )
+{
+	vm_t *vm;
+	int vnc_id;
+
+	if ( !t->free_count )
+		return NULL;
+
+	if ( ( vnc_id = vmtable_vncid_alloc ( t ) ) < 0 )
+		return NULL;
+
+	vm = &t->vms[t->free[--t->free_count]];
+	memset ( vm, 0, sizeof ( *vm ) );
+	memset ( vmtable_cold ( t, vm ), 0, sizeof ( vm_cold_t ) );
+	vm->vnc_id = vnc_id;
+	t->count++;
+	return vm;
+}
+
+void vmtable_free ( vmtable_t *t, vm_t *vm )
+{
+	vmtable_unlink ( t, vm );
+	vmtable_dequeue ( t, vm );
+	vmtable_vncid_free ( t, vm->vnc_id );
+	vm->state = VMST_FREE;
+	vm->pid   = 0;
+	t->free[t->free_count++] = vmtable_idx ( t, vm );
+	t->count--;
+	return;
+}
+
+// Moves the VM to the list of its current state
+void vmtable_relink ( vmtable_t *t, vm_t *vm )
+{
+	vm_state_t state = vm->state;
+
+	if ( vm->list == state )
+		return;
+
+	vmtable_unlink ( t, vm );
+	vmtable_link ( t, vm, state );
+	return;
+}
+
+void vmtable_setstate ( vmtable_t *t, vm_t *vm, vm_state_t state )
+{
+	debug ( 10, "vm->vnc_id == %i: %i -> %i", vm->vnc_id, vm->state, state );
+	vm->state = state;
+	vmtable_cold ( t, vm )->state_at[state] = kvmpool_now_ms();
+	vmtable_relink ( t, vm );
+	return;
+}
+
+// Returns the VM that is in "state" for the longest time
+vm_t *vmtable_first ( vmtable_t *t, vm_state_t state )
+{
+	vm_t *vm;
+
+	while ( ( vm = t->lists[state].head ) != NULL && vm->state != state )
+		vmtable_relink ( t, vm );
+
+	return vm;
+}
+
+/*
+ * The queues are separate from the state lists: e.g. a client can claim a
+ * queued VM (VMST_QUEUED -> VMST_ATTACHED), and it still has to be
+ * spawned in its turn. A VM is in one queue at most.
+ */
+void vmtable_enqueue ( vmtable_t *t, struct vmtable_list *queue, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( t, vm );
+
+	if ( cold->queue != NULL )
+		return;
+
+	cold->queue      = queue;
+	cold->queue_prev = queue->tail;
+	cold->queue_next = NULL;
+
+	if ( queue->tail != NULL )
+		vmtable_cold ( t, queue->tail )->queue_next = vm;
+	else
+		queue->head = vm;
+
+	queue->tail = vm;
+	queue->count++;
+	return;
+}
+
+void vmtable_dequeue ( vmtable_t *t, vm_t *vm )
+{
+	vm_cold_t *cold = vmtable_cold ( t, vm );
+	struct vmtable_list *queue = cold->queue;
+
+	if ( queue == NULL )
+		return;
+
+	if ( cold->queue_prev != NULL )
+		vmtable_cold ( t, cold->queue_prev )->queue_next = cold->queue_next;
+	else
+		queue->head = cold->queue_next;
+
+	if ( cold->queue_next != NULL )
+		vmtable_cold ( t, cold->queue_next )->queue_prev = cold->queue_prev;
+	else
+		queue->tail = cold->queue_prev;
+
+	queue->count--;
+	cold->queue_prev = cold->queue_next = NULL;
+	cold->queue      = NULL;
+	return;
+}
+
+void vmtable_deinit ( vmtable_t *t )
+{
+	free ( t->vms );
+	free ( t->cold );
+	free ( t->free );
+	free ( t->vnc_ids );
+	memset ( t, 0, sizeof ( *t ) );
+	return;
+}
@@ -0,0 +1,132 @@
+/*
+    kvm-pool  -  utility  to  manage  KVM (Kernel Virtual Machine)
+    instances as a pool for rdesktop.
+
+    Copyright (C) 2016 Dmitry Yu Okunev <dyokunev@ut.mephi.ru> 0x8E30679C
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __KVMPOOL_VMTABLE_H
+#define __KVMPOOL_VMTABLE_H
+
+#include "common.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct proxy_session;
+struct proxy_worker;
+
+enum vm_state {
+	VMST_FREE = 0,		// The slot is not used
+	VMST_QUEUED,		// A spare VM waiting to be spawned, see kvmpool_spawn()
+	VMST_SPAWNING,		// Being fork()-ed
+	VMST_BOOTING,		// Running, the proxy is connecting to its VNC server (or QMP) or waiting for the guest
+	VMST_READY,		// A spare VM, a client can be attached right away
+	VMST_ATTACHED,		// Serves a client
+	VMST_RECYCLING,		// The client is gone, the VM is being reverted to its clean snapshot ("--recycle")
+	VMST_DRAINING,		// Being killed
+	VMST_DEAD,		// To be freed by kvmpool_gc()
+
+	VMST_MAX
+};
+typedef enum vm_state vm_state_t;
+
+/*
+ * The fields used on every attach/close; exactly one cache line, so
+ * neighbouring VMs don't share lines. Rarely used fields are in struct
+ * vm_cold.
+ */
+struct vm {
+	vm_state_t	 state;
+	vm_state_t	 list;		// The list of vmtable the VM is linked to, see vmtable_relink()
+	pid_t		 pid;		// -1 if the process is reaped
+	int		 pidfd;		// 0 if pidfd_open() is not supported
+	int		 vnc_id;
+	int		 vnc_fd;
+	int		 client_fd;	// -1 if the client socket is handed over to the VM
+	int		 qmp_fd;
+	struct proxy_session *session;
+	struct proxy_worker *worker;
+	struct vm	*prev;
+	struct vm	*next;
+} __attribute__ ( ( aligned ( 64 ) ) );
+typedef struct vm vm_t;
+
+struct vm_cold {
+	uint64_t	 state_at[VMST_MAX];	// CLOCK_MONOTONIC, ms; when the state was entered last time
+	int		 exit_status;		// As returned by waitpid()
+	int		 booting;		// Spawned and not ready, yet (even if a client is attached)
+	int		 clean;			// "--recycle": the clean snapshot is saved
+	int		 overlay;		// "--overlay-backing": the index of the overlay + 1, 0 if none, yet
+	int		 node;			// "--numa": the index of the node + 1 (see numa.c), 0 if not placed
+	int		 cgroup;		// "--cgroup": the group the VM is in (enum cgroup_group), 0 if none
+	volatile int	 cgroup_queued;		// "--cgroup": the VM is queued to be moved (see cgroup_queue())
+	struct vmtable_list *queue;		// The queue the VM is in (vmtable.spawnq or vmtable.recycleq), if any
+	struct vm	*queue_prev;
+	struct vm	*queue_next;
+};
+typedef struct vm_cold vm_cold_t;
+
+struct vmtable_list {
+	vm_t		*head;	// The VM that is in the state for the longest time
+	vm_t		*tail;
+	int		 count;
+};
+
+/*
+ * The VMs: a free slots stack, a bitmap of used VNC ids and a list of
+ * VMs per state, so all the operations are O(1) (except the bitmap
+ * search, which is O(size/64)). Requires the global lock, but an acceptor
+ * can change the state of a VM from VMST_READY without the lock, so the
+ * lists are fixed up lazily (see vmtable_first()).
+ */
+struct vmtable {
+	vm_t		*vms;
+	vm_cold_t	*cold;
+	int		 size;
+	int		 count;		// Used slots
+	int		*free;		// Free slots stack
+	int		 free_count;
+	int		 vnc_id_base;
+	uint64_t	*vnc_ids;	// Bit "i" is set if VNC id "vnc_id_base + i" is used
+	struct vmtable_list lists[VMST_MAX];
+	struct vmtable_list spawnq;	// VMs to be spawned (spare or claimed by a client), FIFO; linked through vm_cold
+	struct vmtable_list recycleq;	// VMs to be saved or reverted by the recyclers, FIFO; linked through vm_cold
+};
+typedef struct vmtable vmtable_t;
+
+static inline int vmtable_idx ( vmtable_t *t, vm_t *vm )
+{
+	return vm - t->vms;
+}
+
+static inline vm_cold_t *vmtable_cold ( vmtable_t *t, vm_t *vm )
+{
+	return &t->cold[vm - t->vms];
+}
+
+extern int vmtable_init ( vmtable_t *t, int size, int vnc_id_base );
+extern vm_t *vmtable_alloc ( vmtable_t *t );
+extern void vmtable_free ( vmtable_t *t, vm_t *vm );
+extern void vmtable_relink ( vmtable_t *t, vm_t *vm );
+extern void vmtable_setstate ( vmtable_t *t, vm_t *vm, vm_state_t state );
+extern vm_t *vmtable_first ( vmtable_t *t, vm_state_t state );
+extern void vmtable_enqueue ( vmtable_t *t, struct vmtable_list *queue, vm_t *vm );
+extern void vmtable_dequeue ( vmtable_t *t, vm_t *vm );
+extern void vmtable_deinit ( vmtable_t *t );
+
+#endif